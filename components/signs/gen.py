@@ -4,8 +4,10 @@ from __future__ import annotations
 import os
 import re
 import random
+import struct
 import argparse
-from dataclasses import dataclass
+from dataclasses import dataclass, replace
+from collections import Counter
 from typing import List, Tuple
 
 from PIL import Image, ImageDraw, ImageFont
@@ -28,6 +30,10 @@ GLYPHS = ["★", "✶", "✷", "+", "x", "@", "#"]
 
 THRESHOLD = 140
 
+# Delta coded rows between keyframes, a random row read decodes at most
+# this many rows
+KEYFRAME_INTERVAL = 16
+
 # ================= UTIL =================
 def load_font(size: int) -> ImageFont.FreeTypeFont:
     return ImageFont.truetype(os.path.join(FONT_DIR, FONT_NAME), size)
@@ -148,38 +154,232 @@ def draw_glyphs(draw, forbid_rect):
 class RleImage:
     w: int
     h: int
+    # Offset of every keyframe_interval-th row, or of its rows in the
+    # shared pool when SHARED_ROW is set
     row_offs: List[int]
     data: bytes
+    codec: str = "rle"
+    keyframe_interval: int = 1
+    # Stored part (x, y, w, h), everything around it is white
+    box: Tuple[int, int, int, int] = (0, 0, 0, 0)
+    # Print plan, see make_plan()
+    plan: bytes = b""
+    # Pre-encoded row packets, see make_packets()
+    packets: bytes = b""
+
+# The low 7 bits of a run token hold its length. The largest length is an
+# escape, the byte after the token adds up to 255 pixels to it.
+LONG_RUN = 127
+
+def emit_run(out: bytearray, v: int, n: int):
+    while n:
+        k = min(n, LONG_RUN + 255)
+        if k < LONG_RUN:
+            out.append(((v & 1) << 7) | k)
+        else:
+            out.append(((v & 1) << 7) | LONG_RUN)
+            out.append(k - LONG_RUN)
+        n -= k
 
-def img_to_rle(img: Image.Image) -> RleImage:
+def content_box(img: Image.Image) -> Tuple[Tuple[int, int, int, int], List[List[int]]]:
+    """Bounding box (x, y, w, h) of the black pixels and the rows within it.
+
+    Blank images get an empty box.
+    """
     img = img.convert("1")
     px = img.load()
     w, h = img.size
 
+    rows = [[1 if px[x, y] == 0 else 0 for x in range(w)] for y in range(h)]
+    ys = [y for y, row in enumerate(rows) if any(row)]
+    if not ys:
+        return (0, 0, 0, 0), []
+    x0 = min(row.index(1) for row in rows if any(row))
+    x1 = max(w - row[::-1].index(1) for row in rows if any(row))
+    return (x0, ys[0], x1 - x0, ys[-1] + 1 - ys[0]), [row[x0:x1] for row in rows[ys[0]:ys[-1] + 1]]
+
+def img_to_rle(img: Image.Image) -> RleImage:
+    w, h = img.size
+    box, rows = content_box(img)
+
     row_offs = []
     out = bytearray()
 
-    def emit(v, n):
-        while n:
-            k = min(n, 127)
-            out.append(((v & 1) << 7) | k)
-            n -= k
-
-    for y in range(h):
+    for row in rows:
         row_offs.append(len(out))
-        cur = 1 if px[0, y] == 0 else 0
+        cur = row[0]
         run = 1
-        for x in range(1, w):
-            b = 1 if px[x, y] == 0 else 0
+        for b in row[1:]:
             if b == cur:
                 run += 1
             else:
-                emit(cur, run)
+                emit_run(out, cur, run)
                 cur = b
                 run = 1
-        emit(cur, run)
+        emit_run(out, cur, run)
+
+    return RleImage(w, h, row_offs, bytes(out), box=box)
+
+def img_to_delta(img: Image.Image, keyframe_interval: int = KEYFRAME_INTERVAL) -> RleImage:
+    """Run-length encode every row XORed with the row above.
+
+    Set runs flip pixels, a 0x00 token ends a row early and leaves the rest
+    of it unchanged. Keyframe rows are coded against a white row and are
+    the only rows with an offset.
+    """
+    w, h = img.size
+    assert w <= WIDTH, "delta rows are decoded into kWidth wide buffers"
+    box, rows = content_box(img)
+    bw = box[2]
+
+    row_offs = []
+    out = bytearray()
+
+    prev = [0] * bw
+    for y, row in enumerate(rows):
+        if y % keyframe_interval == 0:
+            row_offs.append(len(out))
+            prev = [0] * bw
+        flips = [a ^ b for a, b in zip(row, prev)]
+        prev = row
+
+        x = 0
+        last = max((i for i, f in enumerate(flips) if f), default=-1)
+        while x <= last:
+            cur = flips[x]
+            run = 1
+            while x + run < bw and flips[x + run] == cur:
+                run += 1
+            emit_run(out, cur, run)
+            x += run
+        if x < bw:
+            out.append(0)
 
-    return RleImage(w, h, row_offs, bytes(out))
+    return RleImage(w, h, row_offs, bytes(out), "delta", keyframe_interval, box)
+
+CODECS = {
+    "rle": lambda img, keyframe_interval: img_to_rle(img),
+    "delta": img_to_delta,
+}
+
+# ================= PRINT PLAN =================
+# Row packets the printer sends, rows with up to PLAN_MAX_INDEXED_PIXELS
+# black pixels go as pixel indexes, denser ones as bitmaps. Bit counts
+# split the printhead into chunks of PLAN_CHUNK_WIDTH pixels.
+PLAN_EMPTY, PLAN_INDEXED, PLAN_BITMAP = range(3)
+PLAN_MAX_INDEXED_PIXELS = 23
+PLAN_CHUNKS = 3
+PLAN_CHUNK_WIDTH = WIDTH // PLAN_CHUNKS
+PLAN_MAX_ROWS = 255
+
+def plan_steps(img: Image.Image) -> List[Tuple[int, int, int, Tuple[int, ...]]]:
+    """Steps (first row, rows, kind, pixels) of identical rows sent as one
+    packet, in row order."""
+    img = img.convert("1")
+    px = img.load()
+    w, h = img.size
+    assert w == PLAN_CHUNKS * PLAN_CHUNK_WIDTH, "plans are made for the printhead width"
+    rows = [tuple(1 if px[x, y] == 0 else 0 for x in range(w)) for y in range(h)]
+
+    steps = []
+    for y, row in enumerate(rows):
+        if steps and steps[-1][3] == row and steps[-1][1] < PLAN_MAX_ROWS:
+            steps[-1][1] += 1
+            continue
+        black = sum(row)
+        if black == 0:
+            kind = PLAN_EMPTY
+        elif black <= PLAN_MAX_INDEXED_PIXELS:
+            kind = PLAN_INDEXED
+        else:
+            kind = PLAN_BITMAP
+        steps.append([y, 1, kind, row])
+    return [tuple(step) for step in steps]
+
+def chunk_counts(row: Tuple[int, ...]) -> bytes:
+    return bytes(sum(row[x:x + PLAN_CHUNK_WIDTH]) for x in range(0, len(row), PLAN_CHUNK_WIDTH))
+
+def make_plan(img: Image.Image) -> bytes:
+    """Print plan of an image.
+
+    A step is a byte holding the row kind in bits 7-6 and the number of
+    rows in bits 5-0, or 0 there and the number of rows in the next byte.
+    Bitmap steps add the black pixel count of each printhead chunk.
+    """
+    out = bytearray()
+    for _, count, kind, row in plan_steps(img):
+        if count < 64:
+            out.append(kind << 6 | count)
+        else:
+            out += bytes((kind << 6, count))
+        if kind == PLAN_BITMAP:
+            out += chunk_counts(row)
+    return bytes(out)
+
+# ================= PACKET STREAMS =================
+# Row packet types, as NiimbotPrinter sends them
+PRINT_EMPTY_ROW = 0x84
+PRINT_BITMAP_ROW_INDEXED = 0x83
+PRINT_BITMAP_ROW = 0x85
+
+def frame_packet(type_: int, data: bytes) -> bytes:
+    """55 55 type len data xor AA AA, the XOR covering type, len and data."""
+    xor = type_ ^ len(data)
+    for b in data:
+        xor ^= b
+    return bytes((0x55, 0x55, type_, len(data))) + data + bytes((xor, 0xAA, 0xAA))
+
+def make_packets(img: Image.Image) -> bytes:
+    """Framed row packets printing the whole image, in send order."""
+    out = bytearray()
+    for y, count, kind, row in plan_steps(img):
+        if kind == PLAN_EMPTY:
+            out += frame_packet(PRINT_EMPTY_ROW, struct.pack(">HB", y, count))
+        elif kind == PLAN_INDEXED:
+            xs = b"".join(struct.pack(">H", x) for x, b in enumerate(row) if b)
+            data = struct.pack(">H", y) + chunk_counts(row) + bytes((count,)) + xs
+            out += frame_packet(PRINT_BITMAP_ROW_INDEXED, data)
+        else:
+            bits = bytes(sum(b << (7 - i) for i, b in enumerate(row[x:x + 8])) for x in range(0, len(row), 8))
+            data = struct.pack(">H", y) + chunk_counts(row) + bytes((count,)) + bits
+            out += frame_packet(PRINT_BITMAP_ROW, data)
+    return bytes(out)
+
+# ================= SHARED ROWS =================
+# Offsets with this bit set point into the rows shared by all signs
+SHARED_ROW = 0x8000
+
+def share_rows(images: List[RleImage]) -> Tuple[List[RleImage], bytes]:
+    """Store rows that repeat, within a sign or across signs, only once.
+
+    The bytes from one offset to the next (a row, or a keyframe and the
+    delta rows after it) decode on their own, so repeated ones move to a
+    shared pool and their offsets are redirected there.
+    """
+    def segments(img):
+        ends = img.row_offs[1:] + [len(img.data)]
+        return [img.data[a:b] for a, b in zip(img.row_offs, ends)]
+
+    counts = Counter(seg for img in images for seg in segments(img))
+    shared = bytearray()
+    shared_offs = {}
+    for seg, count in counts.items():
+        if count > 1:
+            shared_offs[seg] = len(shared)
+            shared += seg
+
+    out = []
+    for img in images:
+        row_offs = []
+        data = bytearray()
+        for seg in segments(img):
+            if seg in shared_offs:
+                row_offs.append(SHARED_ROW | shared_offs[seg])
+            else:
+                row_offs.append(len(data))
+                data += seg
+        out.append(replace(img, row_offs=row_offs, data=bytes(data)))
+    return out, bytes(shared)
 
 # ================= CODEGEN =================
 def _hex_array(data: bytes, items_per_line: int = 16) -> str:
@@ -200,55 +400,197 @@ def _int_array(values: List[int], items_per_line: int = 12) -> str:
     return ",\n  ".join(lines)
 
 
-def write_cpp(images: List[RleImage], hpp: str, cpp: str):
+_CODEC_NAMES = {
+    "rle": "Codec::Rle",
+    "delta": "Codec::Delta",
+}
+
+
+def check_row_offsets(images: List[RleImage], shared: bytes):
+    if len(shared) > SHARED_ROW:
+        raise ValueError("shared rows are too large for 15-bit row offsets")
+    for i, img in enumerate(images):
+        if len(img.data) > SHARED_ROW:
+            raise ValueError(f"sign {i} is too large for 15-bit row offsets")
+
+
+def write_cpp(images: List[RleImage], shared: bytes, hpp: str, cpp: str):
     n = len(images)
+    check_row_offsets(images, shared)
 
     with open(hpp, "w", encoding="utf-8") as h:
-        h.write("""\
+        h.write(f"""\
 #pragma once
 
 #include <cstdint>
 
-namespace PRNM::Signs {
+#include <esp_err.h>
+
+namespace PRNM::Signs {{
 
-struct RleImage {
+// Size every sign is rendered at
+constexpr uint16_t kWidth = {WIDTH};
+constexpr uint16_t kHeight = {HEIGHT};
+
+// Rows are coded as runs of pixels. A run token holds the colour in bit 7
+// and the length in the low 7 bits, a length of {LONG_RUN} adds the byte
+// after the token.
+enum class Codec : uint8_t {{
+  // Every row run-length encoded on its own
+  Rle,
+  // Rows XORed with the row above and run-length encoded, set runs flip
+  // pixels and a 0x00 token ends a row early. Keyframe rows are coded
+  // against a white row. At most kWidth wide.
+  Delta,
+}};
+
+struct RleImage {{
   uint16_t w, h;
-  const uint32_t* row_offs;
+  // Offset of every keyframe_interval-th stored row, rows repeated within
+  // or across signs are stored once in the shared pool that offsets with
+  // kSharedRow set point into
+  const uint16_t* row_offs;
   const uint8_t* data;
-};
-
-void Initialize();
+  const uint8_t* shared = nullptr;
+  Codec codec = Codec::Rle;
+  uint8_t keyframe_interval = 1;
+  // Only the pixels within the box are stored, the rest is white
+  uint16_t box_x = 0, box_y = 0, box_w = w, box_h = h;
+  // Print plan, null when the printer has to work it out
+  const uint8_t* plan = nullptr;
+  // Framed row packets printing all h rows, ready to send
+  const uint8_t* packets = nullptr;
+  uint32_t packets_len = 0;
+}};
+
+constexpr uint16_t kSharedRow = 0x{SHARED_ROW:04X};
+
+// Load the signs, compiled in or from the sign pack partition with
+// PRNM_SIGNS_PARTITION. Next() does it on first use.
+esp_err_t Initialize();
+// Signs in shuffled order, null when they failed to load
 const RleImage* Next();
 
+// Black pixel run [x, x + len) within a row
+struct RleRun {{
+  uint16_t x, len;
+}};
+
 void decode_rle_row_1bpp(
   const RleImage& img,
   uint16_t y,
   uint8_t* row_data,
   uint16_t row_bytes);
 
-}
+// Walks the RLE runs of row y without expanding it. Stores up to
+// max_runs black runs, sets num_runs to the total number of black runs
+// in the row and returns the number of black pixels.
+uint16_t rle_row_black_runs(
+  const RleImage& img,
+  uint16_t y,
+  RleRun* runs,
+  uint16_t max_runs,
+  uint16_t* num_runs);
+
+// Reads the rows of an image. The last delta coded row read is kept, so
+// rows read in order are decoded once, others are decoded from the
+// nearest keyframe.
+class RowReader {{
+public:
+  explicit RowReader(const RleImage& img) : img_(img) {{}}
+
+  // Same as decode_rle_row_1bpp and rle_row_black_runs
+  void Decode(uint16_t y, uint8_t* row_data, uint16_t row_bytes);
+  uint16_t BlackRuns(uint16_t y, RleRun* runs, uint16_t max_runs, uint16_t* num_runs);
+
+private:
+  static constexpr uint16_t kNoRow = UINT16_MAX;
+
+  // Bring words_ to stored row y of a delta coded image
+  void Seek(uint16_t y);
+
+  const RleImage& img_;
+  // Row y_, pixel x being bit 31 - (x & 31) of word x >> 5
+  uint32_t words_[kWidth / 32] = {{}};
+  uint16_t y_ = kNoRow;
+  // Tokens of row y_ + 1
+  const uint8_t* next_ = nullptr;
+}};
+
+// Row packet kinds of a print plan
+enum class RowKind : uint8_t {{
+  Empty,
+  // Rows with up to kPlanMaxIndexedPixels black pixels
+  Indexed,
+  Bitmap,
+}};
+
+constexpr uint16_t kPlanMaxIndexedPixels = {PLAN_MAX_INDEXED_PIXELS};
+// Bit counts split rows into chunks this wide
+constexpr uint8_t kPlanChunks = {PLAN_CHUNKS};
+constexpr uint16_t kPlanChunkWidth = {PLAN_CHUNK_WIDTH};
+
+// Rows [row, row + rows) are identical and go as one packet of kind
+struct PlanStep {{
+  uint16_t row;
+  uint8_t rows;
+  RowKind kind;
+  // Black pixels per chunk, bitmap steps only
+  uint8_t counts[kPlanChunks];
+}};
+
+// Walks the print plan of an image, steps cover its rows in order
+class PlanReader {{
+public:
+  explicit PlanReader(const RleImage& img) : img_(img), p_(img.plan) {{}}
+
+  bool HasPlan() const {{ return img_.plan != nullptr; }}
+  // Next step, false past the last row, without a plan or on a step
+  // of no rows
+  bool Next(PlanStep* step);
+
+private:
+  const RleImage& img_;
+  const uint8_t* p_;
+  uint16_t row_ = 0;
+}};
+
+}}
 """)
 
     with open(cpp, "w", encoding="utf-8") as c:
         c.write(f"""\
 #include "signs.h"
 
+#include <cstdlib>
 #include <cstring>
 
+#include <sdkconfig.h>
+#include <esp_check.h>
+#include <esp_log.h>
 #include <esp_random.h>
 
+#if CONFIG_PRNM_SIGNS_PARTITION
+#include "sign_pack.h"
+#endif
+
 namespace PRNM::Signs {{
 
 namespace {{
 
-constexpr size_t kNumSigns = {n};
+constexpr const char* kLogTag = "prnm::signs";
+
+#if CONFIG_PRNM_SIGNS_PARTITION
+SignPack pack_;
+#endif
 
-size_t indices_[kNumSigns] = {{0}};
+uint16_t* indices_ = nullptr;
+size_t num_signs_ = 0;
 size_t current_idx_ = 0;
 bool initialized_ = false;
 
 void Shuffle() {{
-  for (size_t i = kNumSigns - 1; i > 0; --i) {{
+  for (size_t i = num_signs_ - 1; i > 0; --i) {{
     size_t j = esp_random() % (i + 1);
     size_t tmp = indices_[i];
     indices_[i] = indices_[j];
@@ -257,42 +599,269 @@ void Shuffle() {{
   current_idx_ = 0;
 }}
 
+constexpr uint8_t kLongRun = {LONG_RUN};
+
+// Length of the run of token t, p pointing past it. The longest length
+// adds the byte after the token.
+uint16_t RunLength(uint8_t t, const uint8_t*& p) {{
+  uint16_t len = t & 0x7F;
+  if (len == kLongRun) {{
+    len += *p++;
+  }}
+  return len;
+}}
+
+// Set bits [x, end) of an MSB-first row. Edge bytes may be shared with
+// neighbouring runs and are masked in, bytes in between belong to this
+// run only and are stored whole, a word at a time.
+void FillBits(uint8_t* row_data, uint16_t x, uint16_t end) {{
+  uint16_t first = x >> 3;
+  uint16_t last = (end - 1) >> 3;
+  uint8_t head = 0xFF >> (x & 7);
+  uint8_t tail = 0xFF << (7 - ((end - 1) & 7));
+  if (first == last) {{
+    row_data[first] |= head & tail;
+    return;
+  }}
+
+  row_data[first] |= head;
+  row_data[last] |= tail;
+
+  static constexpr uint32_t kOnes = UINT32_MAX;
+  uint8_t* p = row_data + first + 1;
+  uint8_t* stop = row_data + last;
+  for (; p + sizeof(kOnes) <= stop; p += sizeof(kOnes)) {{
+    memcpy(p, &kOnes, sizeof(kOnes));
+  }}
+  for (; p < stop; ++p) {{
+    *p = 0xFF;
+  }}
+}}
+
+uint32_t ToBigEndian(uint32_t value) {{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap32(value);
+#else
+  return value;
+#endif
+}}
+
+// Decodes a row of a width known at compile time. The row is built in
+// 32-bit words held locally, pixel x being bit 31 - (x & 31) of word
+// x >> 5, so run edges are single masks and no byte is touched twice.
+template <uint16_t kRowWidth>
+void DecodeRow(const uint8_t* p, uint16_t x, uint16_t row_end, uint8_t* row_data) {{
+  static_assert(kRowWidth % 32 == 0, "rows are decoded a word at a time");
+  static constexpr size_t kWords = kRowWidth / 32;
+
+  uint32_t words[kWords] = {{}};
+  while (x < row_end) {{
+    uint8_t t = *p++;
+    uint16_t end = x + RunLength(t, p);
+    if (end > row_end) {{
+      end = row_end;
+    }}
+    if ((t & 0x80) != 0 && end > x) {{
+      uint16_t first = x >> 5;
+      uint16_t last = (end - 1) >> 5;
+      uint32_t head = UINT32_MAX >> (x & 31);
+      uint32_t tail = UINT32_MAX << (31 - ((end - 1) & 31));
+      if (first == last) {{
+        words[first] |= head & tail;
+      }} else {{
+        words[first] |= head;
+        for (uint16_t i = first + 1; i < last; ++i) {{
+          words[i] = UINT32_MAX;
+        }}
+        words[last] |= tail;
+      }}
+    }}
+    x = end;
+  }}
+
+  for (size_t i = 0; i < kWords; ++i) {{
+    uint32_t word = ToBigEndian(words[i]);
+    memcpy(row_data + i * sizeof(word), &word, sizeof(word));
+  }}
+}}
+
+constexpr size_t kRowWords = kWidth / 32;
+static_assert(kWidth % 32 == 0, "delta rows are decoded a word at a time");
+
+// Flip bits [x, end) of a row held in words as DecodeRow does
+void FlipBits(uint32_t* words, uint16_t x, uint16_t end) {{
+  uint16_t first = x >> 5;
+  uint16_t last = (end - 1) >> 5;
+  uint32_t head = UINT32_MAX >> (x & 31);
+  uint32_t tail = UINT32_MAX << (31 - ((end - 1) & 31));
+  if (first == last) {{
+    words[first] ^= head & tail;
+    return;
+  }}
+  words[first] ^= head;
+  for (uint16_t i = first + 1; i < last; ++i) {{
+    words[i] = ~words[i];
+  }}
+  words[last] ^= tail;
+}}
+
+// Apply the runs of one delta coded row over [x, row_end) and return
+// where the next row starts
+const uint8_t* ApplyDeltaRow(const uint8_t* p, uint32_t* words, uint16_t x, uint16_t row_end) {{
+  while (x < row_end) {{
+    uint8_t t = *p++;
+    if (t == 0) {{
+      break;  // Rest of the row unchanged
+    }}
+    uint16_t end = x + RunLength(t, p);
+    if (end > row_end) {{
+      end = row_end;
+    }}
+    if (t & 0x80) {{
+      FlipBits(words, x, end);
+    }}
+    x = end;
+  }}
+  return p;
+}}
+
+// Store row words MSB first, cut or padded white to row_bytes
+void StoreWords(const uint32_t* words, uint8_t* row_data, uint16_t row_bytes) {{
+  size_t len = row_bytes < kRowWords * 4 ? row_bytes : kRowWords * 4;
+  size_t i = 0;
+  for (; (i + 1) * 4 <= len; ++i) {{
+    uint32_t word = ToBigEndian(words[i]);
+    memcpy(row_data + i * 4, &word, 4);
+  }}
+  if (i * 4 < len) {{
+    uint32_t word = ToBigEndian(words[i]);
+    memcpy(row_data + i * 4, &word, len - i * 4);
+  }}
+  memset(row_data + len, 0x00, row_bytes - len);
+}}
+
+// First pixel from x on that is set, or clear when invert is all ones
+uint16_t NextBit(const uint32_t* words, uint16_t x, uint16_t width, uint32_t invert) {{
+  while (x < width) {{
+    uint32_t word = (words[x >> 5] ^ invert) << (x & 31);
+    if (word != 0) {{
+      x += __builtin_clz(word);
+      return x < width ? x : width;
+    }}
+    x = (x | 31) + 1;
+  }}
+  return width;
+}}
+
+// Black runs of a row held in words, as rle_row_black_runs
+uint16_t WordRuns(const uint32_t* words, uint16_t width, RleRun* runs, uint16_t max_runs,
+                  uint16_t* num_runs) {{
+  uint16_t black = 0;
+  uint16_t n = 0;
+  uint16_t x = NextBit(words, 0, width, 0);
+  while (x < width) {{
+    uint16_t end = NextBit(words, x, width, UINT32_MAX);
+    if (n < max_runs) {{
+      runs[n] = {{x, static_cast<uint16_t>(end - x)}};
+    }}
+    n++;
+    black += end - x;
+    x = NextBit(words, end, width, 0);
+  }}
+  *num_runs = n;
+  return black;
+}}
+
 """)
 
-        # Write image data
+        # Write image data, left out when the signs come from the pack
+        c.write("#if !CONFIG_PRNM_SIGNS_PARTITION\n\n")
+        c.write(f"constexpr size_t kNumSigns = {n};\n\n")
+        c.write(f"constexpr uint8_t kSharedRows[] = {{\n  {_hex_array(shared or bytes(1))}\n}};\n\n")
         for i, img in enumerate(images):
-            c.write(f"constexpr uint32_t kRowOffs{i}[] = {{\n  {_int_array(img.row_offs)}\n}};\n\n")
-            c.write(f"constexpr uint8_t kRowData{i}[] = {{\n  {_hex_array(img.data)}\n}};\n\n")
-            c.write(f"constexpr RleImage kSign{i} = {{{img.w}, {img.h}, kRowOffs{i}, kRowData{i}}};\n\n")
+            # Blank signs store no rows, arrays can't be empty though
+            c.write(f"constexpr uint16_t kRowOffs{i}[] = {{\n  {_int_array(img.row_offs or [0])}\n}};\n\n")
+            c.write(f"constexpr uint8_t kRowData{i}[] = {{\n  {_hex_array(img.data or bytes(1))}\n}};\n\n")
+            plan = "nullptr"
+            if img.plan:
+                c.write(f"constexpr uint8_t kPlan{i}[] = {{\n  {_hex_array(img.plan)}\n}};\n\n")
+                plan = f"kPlan{i}"
+            packets = "nullptr, 0"
+            if img.packets:
+                c.write(f"constexpr uint8_t kPackets{i}[] = {{\n  {_hex_array(img.packets)}\n}};\n\n")
+                packets = f"kPackets{i}, sizeof(kPackets{i})"
+            bx, by, bw, bh = img.box
+            c.write(f"constexpr RleImage kSign{i} = {{{img.w}, {img.h}, kRowOffs{i}, kRowData{i}, kSharedRows, "
+                    f"{_CODEC_NAMES[img.codec]}, {img.keyframe_interval}, {bx}, {by}, {bw}, {bh}, {plan}, "
+                    f"{packets}}};\n\n")
 
         # Write table
         c.write("constexpr const RleImage* kTable[] = {\n")
         for i in range(n):
             c.write(f"  &kSign{i},\n")
         c.write("};\n\n")
+        c.write("#endif\n\n")
 
         c.write(f"""\
+// Sign i of the loaded ones
+const RleImage* Sign(size_t i) {{
+#if CONFIG_PRNM_SIGNS_PARTITION
+  return pack_.Get(i);
+#else
+  return kTable[i];
+#endif
 }}
 
-void Initialize() {{
-  for (size_t i = 0; i < kNumSigns; ++i) {{
+// Whether row y is within the stored box
+bool IsStored(const RleImage& img, uint16_t y) {{
+  return y >= img.box_y && y - img.box_y < img.box_h;
+}}
+
+// Tokens starting at row_offs[i]
+const uint8_t* RowData(const RleImage& img, uint16_t i) {{
+  uint16_t off = img.row_offs[i];
+  if (off & kSharedRow) {{
+    return img.shared + (off & ~kSharedRow);
+  }}
+  return img.data + off;
+}}
+
+}}
+
+esp_err_t Initialize() {{
+  if (initialized_) {{
+    return ESP_OK;
+  }}
+
+#if CONFIG_PRNM_SIGNS_PARTITION
+  ESP_RETURN_ON_ERROR(pack_.Open(CONFIG_PRNM_SIGNS_PARTITION_LABEL), kLogTag, "Failed to load the sign pack");
+  num_signs_ = pack_.Count();
+  ESP_LOGI(kLogTag, "Loaded %u signs from the sign pack", static_cast<unsigned>(num_signs_));
+#else
+  num_signs_ = kNumSigns;
+#endif
+
+  indices_ = static_cast<uint16_t*>(malloc(num_signs_ * sizeof(*indices_)));
+  ESP_RETURN_ON_FALSE(indices_, ESP_ERR_NO_MEM, kLogTag, "Failed to allocate sign order");
+  for (size_t i = 0; i < num_signs_; ++i) {{
     indices_[i] = i;
   }}
   Shuffle();
   initialized_ = true;
+  return ESP_OK;
 }}
 
 const RleImage* Next() {{
-  if (!initialized_) {{
-    Initialize();
+  if (!initialized_ && Initialize() != ESP_OK) {{
+    return nullptr;
   }}
 
   size_t idx = indices_[current_idx_++];
-  if (current_idx_ >= kNumSigns) {{
+  if (current_idx_ >= num_signs_) {{
     Shuffle();
   }}
 
-  return kTable[idx];
+  return Sign(idx);
 }}
 
 void decode_rle_row_1bpp(
@@ -300,32 +869,209 @@ void decode_rle_row_1bpp(
     uint16_t y,
     uint8_t* row_data,
     uint16_t row_bytes) {{
-  memset(row_data, 0x00, row_bytes);
-  if (y >= img.h) {{
+  if (!IsStored(img, y)) {{
+    memset(row_data, 0x00, row_bytes);
+    return;
+  }}
+  if (img.codec == Codec::Delta) {{
+    RowReader reader(img);
+    reader.Decode(y, row_data, row_bytes);
     return;
   }}
 
-  const uint8_t* p = img.data + img.row_offs[y];
-  uint16_t x = 0;
+  // Every generated sign takes the fixed width path, whole rows are
+  // written so no clearing is needed
+  const uint8_t* p = RowData(img, y - img.box_y);
+  uint16_t x = img.box_x;
+  uint16_t box_end = img.box_x + img.box_w;
+  if (img.w == kWidth && row_bytes == kWidth / 8) {{
+    DecodeRow<kWidth>(p, x, box_end, row_data);
+    return;
+  }}
+
+  memset(row_data, 0x00, row_bytes);
+  uint16_t width = box_end < row_bytes * 8 ? box_end : row_bytes * 8;
+
+  // The row is zeroed, white runs only advance
+  while (x < width) {{
+    uint8_t t = *p++;
+    uint16_t end = x + RunLength(t, p);
+    if (end > width) {{
+      end = width;
+    }}
+    if ((t & 0x80) != 0 && end > x) {{
+      FillBits(row_data, x, end);
+    }}
+    x = end;
+  }}
+}}
+
+uint16_t rle_row_black_runs(
+    const RleImage& img,
+    uint16_t y,
+    RleRun* runs,
+    uint16_t max_runs,
+    uint16_t* num_runs) {{
+  *num_runs = 0;
+  if (!IsStored(img, y)) {{
+    return 0;
+  }}
+  if (img.codec == Codec::Delta) {{
+    RowReader reader(img);
+    return reader.BlackRuns(y, runs, max_runs, num_runs);
+  }}
+
+  const uint8_t* p = RowData(img, y - img.box_y);
+  uint16_t x = img.box_x;
+  uint16_t box_end = img.box_x + img.box_w;
+  uint16_t black_end = 0;
+  uint16_t black = 0;
+  uint16_t n = 0;
 
-  while (x < img.w) {{
+  while (x < box_end) {{
     uint8_t t = *p++;
-    bool black = (t & 0x80) != 0;
-    uint8_t run = t & 0x7F;
+    uint16_t run = RunLength(t, p);
+    if (run > box_end - x) {{
+      run = box_end - x;
+    }}
 
-    if (black) {{
-      for (uint8_t i = 0; i < run && x < img.w; ++i, ++x) {{
-        row_data[x >> 3] |= (0x80 >> (x & 7));
+    if (t & 0x80) {{
+      // Long runs are split into several bytes, merge them back
+      if (n > 0 && black_end == x) {{
+        if (n <= max_runs) {{
+          runs[n - 1].len += run;
+        }}
+      }} else {{
+        if (n < max_runs) {{
+          runs[n] = {{x, run}};
+        }}
+        n++;
       }}
-    }} else {{
-      x += run;
+      black += run;
+      black_end = x + run;
     }}
+    x += run;
   }}
+
+  *num_runs = n;
+  return black;
+}}
+
+void RowReader::Decode(uint16_t y, uint8_t* row_data, uint16_t row_bytes) {{
+  if (img_.codec != Codec::Delta || !IsStored(img_, y)) {{
+    decode_rle_row_1bpp(img_, y, row_data, row_bytes);
+    return;
+  }}
+  Seek(y);
+  StoreWords(words_, row_data, row_bytes);
+}}
+
+uint16_t RowReader::BlackRuns(uint16_t y, RleRun* runs, uint16_t max_runs, uint16_t* num_runs) {{
+  if (img_.codec != Codec::Delta || !IsStored(img_, y)) {{
+    return rle_row_black_runs(img_, y, runs, max_runs, num_runs);
+  }}
+  Seek(y);
+  return WordRuns(words_, img_.box_x + img_.box_w, runs, max_runs, num_runs);
+}}
+
+bool PlanReader::Next(PlanStep* step) {{
+  if (!p_ || row_ >= img_.h) {{
+    return false;
+  }}
+
+  uint8_t b = *p_++;
+  step->row = row_;
+  step->kind = static_cast<RowKind>(b >> 6);
+  step->rows = b & 0x3F;
+  if (step->rows == 0) {{
+    step->rows = *p_++;
+  }}
+  if (step->rows == 0) {{
+    return false;  // Corrupt, a step covers at least one row
+  }}
+  if (step->kind == RowKind::Bitmap) {{
+    memcpy(step->counts, p_, kPlanChunks);
+    p_ += kPlanChunks;
+  }}
+  row_ += step->rows;
+  return true;
+}}
+
+void RowReader::Seek(uint16_t y) {{
+  if (y == y_) {{
+    return;
+  }}
+
+  // Carry on from the kept row when it is on the way, otherwise start
+  // over at the keyframe. Keyframes count from the top of the box.
+  uint16_t stored = y - img_.box_y;
+  uint16_t keyframe = y - stored % img_.keyframe_interval;
+  uint16_t row = y_ + 1;
+  if (y_ == kNoRow || y_ < keyframe || y_ > y) {{
+    memset(words_, 0x00, sizeof(words_));
+    next_ = RowData(img_, stored / img_.keyframe_interval);
+    row = keyframe;
+  }}
+  for (; row <= y; ++row) {{
+    next_ = ApplyDeltaRow(next_, words_, img_.box_x, img_.box_x + img_.box_w);
+  }}
+  y_ = y;
 }}
 
 }}
 """)
 
+# ================= ASSET PACK =================
+# Signs read in place from a flash partition instead of compiled in, see
+# sign_pack.cc. Fields are little-endian, sections 4-byte aligned and
+# offsets count from the start of the pack.
+PACK_MAGIC = b"PRNS"
+PACK_VERSION = 1
+# Magic, version, number of signs, width, height, shared rows offset and
+# length, pack size
+PACK_HEADER = struct.Struct("<4sHHHHIII")
+# Per sign: w, h, codec, keyframe interval, number of row offsets, box
+# x, y, w, h, then the offset of the row offsets and the offset and
+# length of the row data, plan and packets. Absent sections have
+# offset 0.
+PACK_ENTRY = struct.Struct("<HHBBHHHHHIIIIIII")
+
+_PACK_CODECS = {
+    "rle": 0,
+    "delta": 1,
+}
+
+
+def write_pack(images: List[RleImage], shared: bytes, path: str):
+    """Write the signs as an asset pack: a header, an index entry per sign,
+    then the shared rows and every sign's sections."""
+    check_row_offsets(images, shared)
+
+    base = PACK_HEADER.size + PACK_ENTRY.size * len(images)
+    blobs = bytearray()
+
+    def add(data: bytes) -> int:
+        blobs.extend(bytes(-(base + len(blobs)) % 4))
+        off = base + len(blobs)
+        blobs.extend(data)
+        return off
+
+    shared_off = add(shared)
+    index = bytearray()
+    for img in images:
+        row_offs = add(struct.pack(f"<{len(img.row_offs)}H", *img.row_offs))
+        data = add(img.data)
+        plan = add(img.plan) if img.plan else 0
+        packets = add(img.packets) if img.packets else 0
+        index += PACK_ENTRY.pack(img.w, img.h, _PACK_CODECS[img.codec], img.keyframe_interval,
+                                 len(img.row_offs), *img.box, row_offs, data, len(img.data),
+                                 plan, len(img.plan), packets, len(img.packets))
+
+    header = PACK_HEADER.pack(PACK_MAGIC, PACK_VERSION, len(images), WIDTH, HEIGHT,
+                              shared_off, len(shared), base + len(blobs))
+    with open(path, "wb") as f:
+        f.write(header + index + blobs)
+
 # ================= MAIN =================
 def main():
     ap = argparse.ArgumentParser()
@@ -333,11 +1079,21 @@ def main():
     ap.add_argument("--seed", type=int, default=42)
     ap.add_argument("--hpp", default="signs.h")
     ap.add_argument("--cpp", default="signs.cc")
+    ap.add_argument("--codec", choices=sorted(CODECS), default="delta",
+                    help="row codec of the generated assets")
+    ap.add_argument("--keyframe-interval", type=int, default=KEYFRAME_INTERVAL,
+                    help="rows per keyframe of the delta codec")
+    ap.add_argument("--packets", action="store_true",
+                    help="also store every sign as ready row packets, several times the flash")
+    ap.add_argument("--pack", metavar="PATH",
+                    help="also write the signs as an asset pack for the signs partition")
     ap.add_argument("--emit-png", action="store_true",
                 help="also save rendered labels as PNG for preview")
     ap.add_argument("--png-out", default="out",
                     help="directory for preview PNGs")
     args = ap.parse_args()
+    if not 1 <= args.keyframe_interval <= 255:
+        ap.error("--keyframe-interval must be within 1..255")
 
     if args.seed is not None:
         random.seed(args.seed)
@@ -377,10 +1133,18 @@ def main():
                 bw.save(path)
                 png_index += 1
 
-            images.append(img_to_rle(bw))
+            image = CODECS[args.codec](bw, args.keyframe_interval)
+            image.plan = make_plan(bw)
+            if args.packets:
+                image.packets = make_packets(bw)
+            images.append(image)
 
-    write_cpp(images, args.hpp, args.cpp)
+    images, shared = share_rows(images)
+    write_cpp(images, shared, args.hpp, args.cpp)
     print(f"Generated {args.hpp} and {args.cpp}")
+    if args.pack:
+        write_pack(images, shared, args.pack)
+        print(f"Generated {args.pack}")
 
     if args.emit_png:
         print(f"Preview PNGs saved to: {args.png_out}/")
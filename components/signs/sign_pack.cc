@@ -0,0 +1,232 @@
+#include "sign_pack.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <esp_check.h>
+#include <esp_log.h>
+
+using namespace PRNM::Signs;
+
+namespace {
+  static constexpr const char* kLogTag = "prnm::signs";
+
+  // Layout written by write_pack() in gen.py
+  static constexpr char kMagic[4] = {'P', 'R', 'N', 'S'};
+  static constexpr uint16_t kVersion = 1;
+
+  static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "packs are little-endian");
+
+  struct Header {
+    char magic[4];
+    uint16_t version;
+    uint16_t num_signs;
+    uint16_t width, height;
+    uint32_t shared_off, shared_len;
+    uint32_t size;
+  };
+  static_assert(sizeof(Header) == 24, "pack header layout");
+
+  struct Entry {
+    uint16_t w, h;
+    uint8_t codec;
+    uint8_t keyframe_interval;
+    uint16_t num_row_offs;
+    uint16_t box_x, box_y, box_w, box_h;
+    uint32_t row_offs_off;
+    uint32_t data_off, data_len;
+    uint32_t plan_off, plan_len;
+    uint32_t packets_off, packets_len;
+  };
+  static_assert(sizeof(Entry) == 44, "pack index entry layout");
+
+  // Row packet framing as gen.py's frame_packet() writes it: start
+  // markers, type, length, checksum and end markers
+  static constexpr uint8_t kPacketStart = 0x55;
+  static constexpr uint8_t kPacketEnd = 0xAA;
+  static constexpr size_t kPacketOverhead = 7;
+  // PRINT_BITMAP_ROW_INDEXED to PRINT_BITMAP_ROW
+  static constexpr uint8_t kFirstRowPacket = 0x83;
+  static constexpr uint8_t kLastRowPacket = 0x85;
+
+  // Whether [off, off + len) lies within size bytes
+  bool Within(uint32_t off, uint32_t len, size_t size)
+  {
+    return off <= size && len <= size - off;
+  }
+
+  // Whether a plan of len bytes is made of whole steps, each of at least
+  // one row, that cover exactly h rows
+  bool IsValidPlan(const uint8_t* plan, uint32_t len, uint16_t h)
+  {
+    uint32_t rows = 0;
+    uint32_t i = 0;
+    while (i < len) {
+      uint8_t b = plan[i++];
+      RowKind kind = static_cast<RowKind>(b >> 6);
+      uint8_t step_rows = b & 0x3F;
+      if (step_rows == 0) {
+        if (i == len) {
+          return false;
+        }
+        step_rows = plan[i++];
+      }
+      if (kind > RowKind::Bitmap || step_rows == 0) {
+        return false;
+      }
+      if (kind == RowKind::Bitmap) {
+        if (len - i < kPlanChunks) {
+          return false;
+        }
+        i += kPlanChunks;
+      }
+      rows += step_rows;
+    }
+    return rows == h;
+  }
+
+  // Whether len bytes are whole framed row packets back to back
+  bool IsValidPacketStream(const uint8_t* packets, uint32_t len)
+  {
+    uint32_t off = 0;
+    while (off < len) {
+      if (len - off < kPacketOverhead) {
+        return false;
+      }
+      const uint8_t* pkt = packets + off;
+      uint32_t pkt_len = pkt[3] + kPacketOverhead;
+      if (pkt_len > len - off ||
+          pkt[0] != kPacketStart || pkt[1] != kPacketStart ||
+          pkt[2] < kFirstRowPacket || pkt[2] > kLastRowPacket ||
+          pkt[pkt_len - 2] != kPacketEnd || pkt[pkt_len - 1] != kPacketEnd) {
+        return false;
+      }
+      off += pkt_len;
+    }
+    return true;
+  }
+
+  // Whether a sign's fields and sections fit the decoders and the pack,
+  // every row offset, plan step and row packet included
+  bool IsValidEntry(const uint8_t* data, const Header& header, const Entry& e)
+  {
+    if (e.codec > static_cast<uint8_t>(Codec::Delta) || e.keyframe_interval == 0) {
+      return false;
+    }
+    if (e.box_x + e.box_w > e.w || e.box_y + e.box_h > e.h) {
+      return false;
+    }
+    if (e.codec == static_cast<uint8_t>(Codec::Delta) && e.w > kWidth) {
+      return false;
+    }
+    if (e.num_row_offs != (e.box_h + e.keyframe_interval - 1) / e.keyframe_interval) {
+      return false;
+    }
+
+    if (e.row_offs_off % alignof(uint16_t) != 0 ||
+        !Within(e.row_offs_off, e.num_row_offs * sizeof(uint16_t), header.size) ||
+        !Within(e.data_off, e.data_len, header.size) ||
+        (e.plan_off != 0 && !Within(e.plan_off, e.plan_len, header.size)) ||
+        (e.packets_off != 0 && !Within(e.packets_off, e.packets_len, header.size))) {
+      return false;
+    }
+
+    const uint16_t* row_offs = reinterpret_cast<const uint16_t*>(data + e.row_offs_off);
+    for (size_t i = 0; i < e.num_row_offs; i++) {
+      uint16_t off = row_offs[i];
+      bool shared = (off & kSharedRow) != 0;
+      if ((off & ~kSharedRow) >= (shared ? header.shared_len : e.data_len)) {
+        return false;
+      }
+    }
+
+    if (e.plan_off != 0 && !IsValidPlan(data + e.plan_off, e.plan_len, e.h)) {
+      return false;
+    }
+    if (e.packets_off != 0 && !IsValidPacketStream(data + e.packets_off, e.packets_len)) {
+      return false;
+    }
+    return true;
+  }
+}
+
+SignPack::~SignPack()
+{
+  Close();
+}
+
+esp_err_t SignPack::Open(const char* name)
+{
+  Close();
+  ESP_RETURN_ON_ERROR(Map(name), kLogTag, "Failed to map sign pack %s", name);
+
+  esp_err_t err = Load(map_, map_size_);
+  if (err != ESP_OK) {
+    Close();
+  }
+  return err;
+}
+
+void SignPack::Close()
+{
+  free(images_);
+  images_ = nullptr;
+  count_ = 0;
+
+  if (map_) {
+    Unmap();
+    map_ = nullptr;
+    map_size_ = 0;
+    map_handle_ = 0;
+  }
+}
+
+esp_err_t SignPack::Load(const uint8_t* data, size_t size)
+{
+  Header header;
+  ESP_RETURN_ON_FALSE(size >= sizeof(header), ESP_ERR_INVALID_SIZE, kLogTag, "Sign pack too small");
+  memcpy(&header, data, sizeof(header));
+
+  ESP_RETURN_ON_FALSE(memcmp(header.magic, kMagic, sizeof(kMagic)) == 0, ESP_ERR_NOT_FOUND, kLogTag,
+                      "No sign pack found");
+  ESP_RETURN_ON_FALSE(header.version == kVersion, ESP_ERR_INVALID_VERSION, kLogTag,
+                      "Sign pack version %u, expected %u", header.version, kVersion);
+  ESP_RETURN_ON_FALSE(header.width == kWidth && header.height == kHeight, ESP_ERR_INVALID_SIZE, kLogTag,
+                      "Signs are %ux%u, expected %ux%u", header.width, header.height, kWidth, kHeight);
+  ESP_RETURN_ON_FALSE(header.num_signs > 0 && header.size <= size &&
+                      Within(sizeof(Header), header.num_signs * sizeof(Entry), header.size) &&
+                      Within(header.shared_off, header.shared_len, header.size),
+                      ESP_ERR_INVALID_SIZE, kLogTag, "Sign pack truncated or corrupt");
+
+  RleImage* images = static_cast<RleImage*>(malloc(header.num_signs * sizeof(RleImage)));
+  ESP_RETURN_ON_FALSE(images, ESP_ERR_NO_MEM, kLogTag, "Failed to allocate %u signs", header.num_signs);
+
+  const uint8_t* index = data + sizeof(Header);
+  for (size_t i = 0; i < header.num_signs; i++) {
+    Entry e;
+    memcpy(&e, index + i * sizeof(Entry), sizeof(e));
+    if (!IsValidEntry(data, header, e)) {
+      ESP_LOGE(kLogTag, "Sign %u of the pack is corrupt", static_cast<unsigned>(i));
+      free(images);
+      return ESP_ERR_INVALID_SIZE;
+    }
+
+    images[i] = RleImage{
+      e.w, e.h,
+      reinterpret_cast<const uint16_t*>(data + e.row_offs_off),
+      data + e.data_off,
+      data + header.shared_off,
+      static_cast<Codec>(e.codec),
+      e.keyframe_interval,
+      e.box_x, e.box_y, e.box_w, e.box_h,
+      e.plan_off != 0 ? data + e.plan_off : nullptr,
+      e.packets_off != 0 ? data + e.packets_off : nullptr,
+      e.packets_len,
+    };
+  }
+
+  free(images_);
+  images_ = images;
+  count_ = header.num_signs;
+  return ESP_OK;
+}
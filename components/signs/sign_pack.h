@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <esp_err.h>
+
+#include "signs.h"
+
+namespace PRNM::Signs {
+
+// Signs read from an asset pack written by gen.py --pack. The pack is
+// mapped and read in place, only the image table is built in RAM.
+class SignPack {
+public:
+  SignPack() = default;
+  ~SignPack();
+
+  // Map and load a pack, the partition of that label on the device or
+  // the file of that path on the linux target
+  esp_err_t Open(const char* name);
+  void Close();
+
+  // Load a pack already in memory, images point into data. Sections are
+  // checked to lie within size, plans to cover every row and packet
+  // streams to be whole row packets. Row tokens are trusted.
+  esp_err_t Load(const uint8_t* data, size_t size);
+
+  size_t Count() const { return count_; }
+  const RleImage* Get(size_t i) const { return &images_[i]; }
+
+private:
+  // Non-copyable
+  SignPack(const SignPack&) = delete;
+  SignPack& operator=(const SignPack&) = delete;
+
+  // Platform mapping, in sign_pack_partition.cc and sign_pack_file.cc
+  esp_err_t Map(const char* name);
+  void Unmap();
+
+  // Mapped pack
+  const uint8_t* map_ = nullptr;
+  size_t map_size_ = 0;
+  // esp_partition_mmap handle on the device
+  uint32_t map_handle_ = 0;
+
+  RleImage* images_ = nullptr;
+  size_t count_ = 0;
+};
+
+}
@@ -0,0 +1,38 @@
+#include "sign_pack.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <esp_check.h>
+
+using namespace PRNM::Signs;
+
+namespace {
+  static constexpr const char* kLogTag = "prnm::signs";
+}
+
+esp_err_t SignPack::Map(const char* name)
+{
+  int fd = open(name, O_RDONLY);
+  ESP_RETURN_ON_FALSE(fd >= 0, ESP_ERR_NOT_FOUND, kLogTag, "Failed to open %s", name);
+
+  struct stat st;
+  void* ptr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  // The mapping keeps the file open
+  close(fd);
+  ESP_RETURN_ON_FALSE(ptr != MAP_FAILED, ESP_FAIL, kLogTag, "Failed to map %s", name);
+
+  map_ = static_cast<const uint8_t*>(ptr);
+  map_size_ = st.st_size;
+  return ESP_OK;
+}
+
+void SignPack::Unmap()
+{
+  munmap(const_cast<uint8_t*>(map_), map_size_);
+}
@@ -0,0 +1,33 @@
+#include "sign_pack.h"
+
+#include <esp_check.h>
+#include <esp_partition.h>
+
+using namespace PRNM::Signs;
+
+namespace {
+  static constexpr const char* kLogTag = "prnm::signs";
+}
+
+esp_err_t SignPack::Map(const char* name)
+{
+  const esp_partition_t* partition =
+    esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+  ESP_RETURN_ON_FALSE(partition, ESP_ERR_NOT_FOUND, kLogTag, "No %s partition", name);
+
+  // Read through the flash cache like the app's own rodata
+  const void* ptr = nullptr;
+  esp_partition_mmap_handle_t handle;
+  ESP_RETURN_ON_ERROR(esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &ptr, &handle),
+                      kLogTag, "Failed to map the %s partition", name);
+
+  map_ = static_cast<const uint8_t*>(ptr);
+  map_size_ = partition->size;
+  map_handle_ = handle;
+  return ESP_OK;
+}
+
+void SignPack::Unmap()
+{
+  esp_partition_munmap(map_handle_);
+}
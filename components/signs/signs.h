@@ -2,21 +2,135 @@
 
 #include <cstdint>
 
+#include <esp_err.h>
+
 namespace PRNM::Signs {
 
+// Size every sign is rendered at
+constexpr uint16_t kWidth = 384;
+constexpr uint16_t kHeight = 240;
+
+// Rows are coded as runs of pixels. A run token holds the colour in bit 7
+// and the length in the low 7 bits, a length of 127 adds the byte
+// after the token.
+enum class Codec : uint8_t {
+  // Every row run-length encoded on its own
+  Rle,
+  // Rows XORed with the row above and run-length encoded, set runs flip
+  // pixels and a 0x00 token ends a row early. Keyframe rows are coded
+  // against a white row. At most kWidth wide.
+  Delta,
+};
+
 struct RleImage {
   uint16_t w, h;
-  const uint32_t* row_offs;
+  // Offset of every keyframe_interval-th stored row, rows repeated within
+  // or across signs are stored once in the shared pool that offsets with
+  // kSharedRow set point into
+  const uint16_t* row_offs;
   const uint8_t* data;
+  const uint8_t* shared = nullptr;
+  Codec codec = Codec::Rle;
+  uint8_t keyframe_interval = 1;
+  // Only the pixels within the box are stored, the rest is white
+  uint16_t box_x = 0, box_y = 0, box_w = w, box_h = h;
+  // Print plan, null when the printer has to work it out
+  const uint8_t* plan = nullptr;
+  // Framed row packets printing all h rows, ready to send
+  const uint8_t* packets = nullptr;
+  uint32_t packets_len = 0;
 };
 
-void Initialize();
+constexpr uint16_t kSharedRow = 0x8000;
+
+// Load the signs, compiled in or from the sign pack partition with
+// PRNM_SIGNS_PARTITION. Next() does it on first use.
+esp_err_t Initialize();
+// Signs in shuffled order, null when they failed to load
 const RleImage* Next();
 
+// Black pixel run [x, x + len) within a row
+struct RleRun {
+  uint16_t x, len;
+};
+
 void decode_rle_row_1bpp(
   const RleImage& img,
   uint16_t y,
   uint8_t* row_data,
   uint16_t row_bytes);
 
+// Walks the RLE runs of row y without expanding it. Stores up to
+// max_runs black runs, sets num_runs to the total number of black runs
+// in the row and returns the number of black pixels.
+uint16_t rle_row_black_runs(
+  const RleImage& img,
+  uint16_t y,
+  RleRun* runs,
+  uint16_t max_runs,
+  uint16_t* num_runs);
+
+// Reads the rows of an image. The last delta coded row read is kept, so
+// rows read in order are decoded once, others are decoded from the
+// nearest keyframe.
+class RowReader {
+public:
+  explicit RowReader(const RleImage& img) : img_(img) {}
+
+  // Same as decode_rle_row_1bpp and rle_row_black_runs
+  void Decode(uint16_t y, uint8_t* row_data, uint16_t row_bytes);
+  uint16_t BlackRuns(uint16_t y, RleRun* runs, uint16_t max_runs, uint16_t* num_runs);
+
+private:
+  static constexpr uint16_t kNoRow = UINT16_MAX;
+
+  // Bring words_ to stored row y of a delta coded image
+  void Seek(uint16_t y);
+
+  const RleImage& img_;
+  // Row y_, pixel x being bit 31 - (x & 31) of word x >> 5
+  uint32_t words_[kWidth / 32] = {};
+  uint16_t y_ = kNoRow;
+  // Tokens of row y_ + 1
+  const uint8_t* next_ = nullptr;
+};
+
+// Row packet kinds of a print plan
+enum class RowKind : uint8_t {
+  Empty,
+  // Rows with up to kPlanMaxIndexedPixels black pixels
+  Indexed,
+  Bitmap,
+};
+
+constexpr uint16_t kPlanMaxIndexedPixels = 23;
+// Bit counts split rows into chunks this wide
+constexpr uint8_t kPlanChunks = 3;
+constexpr uint16_t kPlanChunkWidth = 128;
+
+// Rows [row, row + rows) are identical and go as one packet of kind
+struct PlanStep {
+  uint16_t row;
+  uint8_t rows;
+  RowKind kind;
+  // Black pixels per chunk, bitmap steps only
+  uint8_t counts[kPlanChunks];
+};
+
+// Walks the print plan of an image, steps cover its rows in order
+class PlanReader {
+public:
+  explicit PlanReader(const RleImage& img) : img_(img), p_(img.plan) {}
+
+  bool HasPlan() const { return img_.plan != nullptr; }
+  // Next step, false past the last row, without a plan or on a step
+  // of no rows
+  bool Next(PlanStep* step);
+
+private:
+  const RleImage& img_;
+  const uint8_t* p_;
+  uint16_t row_ = 0;
+};
+
 }
@@ -0,0 +1,75 @@
+// Commands built from constexpr packets and typed layouts send the bytes
+// BuildPacket builds from the payloads they replaced
+#include <functional>
+#include <vector>
+
+#include "host_test.h"
+#include "printer.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  using RequestCode = NiimbotPrinter::RequestCode;
+  using Bytes = std::vector<uint8_t>;
+
+  Bytes Expected(RequestCode code, const Bytes& data)
+  {
+    uint8_t buf[UINT8_MAX + 7];
+    size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), static_cast<uint8_t>(code), data.data(), data.size());
+    return Bytes(buf, buf + len);
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_NONE);
+
+  NiimbotPrinter printer;
+  std::vector<Bytes> writes;
+  printer.SetSendCallback([&printer, &writes](const uint8_t* data, size_t len, bool) {
+    writes.emplace_back(data, data + len);
+    printer.OnWriteComplete();
+    return ESP_OK;
+  });
+
+  // Sends one command and returns its only write
+  auto sent = [&writes](const std::function<esp_err_t()>& command) {
+    writes.clear();
+    CHECK_EQ(command(), ESP_OK);
+    CHECK_EQ(writes.size(), 1);
+    return writes.empty() ? Bytes() : writes[0];
+  };
+
+  // Fixed packets
+  CHECK(sent([&] { return printer.SendHeartbeat(); }) == Expected(RequestCode::HEARTBEAT, {0x01}));
+  CHECK(sent([&] { return printer.GetPrintStatus(); }) == Expected(RequestCode::GET_PRINT_STATUS, {0x01}));
+  CHECK(sent([&] { return printer.StartPagePrint(); }) == Expected(RequestCode::START_PAGE_PRINT, {0x01}));
+  CHECK(sent([&] { return printer.EndPagePrint(); }) == Expected(RequestCode::END_PAGE_PRINT, {0x01}));
+  CHECK(sent([&] { return printer.EndPrint(); }) == Expected(RequestCode::END_PRINT, {0x01}));
+
+  // Single byte parameters
+  CHECK(sent([&] { return printer.SetLabelDensity(3); }) == Expected(RequestCode::SET_LABEL_DENSITY, {3}));
+  CHECK(sent([&] { return printer.SetLabelType(1); }) == Expected(RequestCode::SET_LABEL_TYPE, {1}));
+  CHECK(sent([&] { return printer.GetDeviceInfo(NiimbotPrinter::InfoKey::BATTERY); }) ==
+        Expected(RequestCode::GET_INFO, {10}));
+
+  // Big-endian fields, across byte boundaries
+  static constexpr uint16_t kValues[] = {0, 1, 0x00FF, 0x0100, 0x1234, 0xFFFF};
+  for (uint16_t a : kValues) {
+    for (uint16_t b : kValues) {
+      uint8_t color = static_cast<uint8_t>(b);
+      CHECK(sent([&] { return printer.StartPrint(a, color); }) ==
+            Expected(RequestCode::START_PRINT,
+                     {static_cast<uint8_t>(a >> 8), static_cast<uint8_t>(a), 0, 0, 0, 0, color}));
+
+      uint16_t copies = static_cast<uint16_t>(a ^ b);
+      CHECK(sent([&] { return printer.SetPageSize(a, b, copies); }) ==
+            Expected(RequestCode::SET_DIMENSION,
+                     {static_cast<uint8_t>(a >> 8), static_cast<uint8_t>(a), static_cast<uint8_t>(b >> 8),
+                      static_cast<uint8_t>(b), static_cast<uint8_t>(copies >> 8), static_cast<uint8_t>(copies)}));
+    }
+  }
+
+  return Result();
+}
@@ -0,0 +1,386 @@
+#include "fake_printer.h"
+
+#include <cstring>
+
+#include <sdkconfig.h>
+
+using namespace PRNM::HostTest;
+
+namespace {
+  using RequestCode = PRNM::NiimbotPrinter::RequestCode;
+  using ResponseCode = PRNM::NiimbotPrinter::ResponseCode;
+
+  // Commands acked with a success flag
+  struct Ack {
+    RequestCode request;
+    ResponseCode response;
+  };
+  static constexpr Ack kAcks[] = {
+    {RequestCode::SET_LABEL_DENSITY, ResponseCode::SET_LABEL_DENSITY},
+    {RequestCode::SET_LABEL_TYPE, ResponseCode::SET_LABEL_TYPE},
+    {RequestCode::START_PRINT, ResponseCode::START_PRINT},
+    {RequestCode::START_PAGE_PRINT, ResponseCode::START_PAGE_PRINT},
+    {RequestCode::SET_DIMENSION, ResponseCode::SET_DIMENSION},
+    {RequestCode::END_PAGE_PRINT, ResponseCode::END_PAGE_PRINT},
+    {RequestCode::END_PRINT, ResponseCode::END_PRINT},
+  };
+
+  static constexpr size_t kHeartbeatLen = 13;
+  static constexpr size_t kPrintStatusLen = 10;
+
+  uint16_t BigEndian16(const uint8_t* data)
+  {
+    return (data[0] << 8) | data[1];
+  }
+
+  uint16_t RowNumber(const std::vector<uint8_t>& data)
+  {
+    return (data[0] << 8) | data[1];
+  }
+}
+
+FakePrinter::FakePrinter(NiimbotPrinter& printer, LinkTiming timing)
+  : printer_(printer), timing_(timing)
+{
+  printer_.SetSendCallback([this](const uint8_t* data, size_t len, bool wait_for_response) {
+    return Receive(data, len, wait_for_response);
+  });
+  // As negotiated on connect
+  SetWriteSize(CONFIG_PRNM_BT_MTU - 3);
+  Send(static_cast<uint8_t>(ResponseCode::HEARTBEAT), std::vector<uint8_t>(kHeartbeatLen, 0));
+
+  if (timing_.event_ms > 0) {
+    link_thread_ = std::thread(&FakePrinter::LinkTask, this);
+  }
+}
+
+FakePrinter::~FakePrinter()
+{
+  if (link_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(link_mutex_);
+      stopping_ = true;
+    }
+    link_cv_.notify_all();
+    link_thread_.join();
+  }
+}
+
+void FakePrinter::SetWriteSize(size_t size)
+{
+  write_size_ = size;
+  printer_.SetMaxWriteSize(size);
+}
+
+void FakePrinter::FailWrite(size_t n)
+{
+  fail_in_ = n;
+}
+
+void FakePrinter::Congest(size_t n, uint32_t ms)
+{
+  congest_ms_ = ms;
+  congest_in_ = n;
+  if (n == 0) {
+    SetCongested(true);
+  }
+}
+
+void FakePrinter::Disconnect(size_t n)
+{
+  disconnect_in_ = n;
+}
+
+void FakePrinter::Connect()
+{
+  connected_ = true;
+  SetWriteSize(CONFIG_PRNM_BT_MTU - 3);
+  Send(static_cast<uint8_t>(ResponseCode::HEARTBEAT), std::vector<uint8_t>(kHeartbeatLen, 0));
+}
+
+void FakePrinter::Clear()
+{
+  packets_.clear();
+  writes_ = 0;
+  bytes_ = 0;
+  oversized_writes_ = 0;
+  failed_writes_ = 0;
+  congested_writes_ = 0;
+
+  std::lock_guard<std::mutex> lock(link_mutex_);
+  max_in_flight_ = in_flight_;
+  events_ = 0;
+}
+
+size_t FakePrinter::MaxInFlight() const
+{
+  std::lock_guard<std::mutex> lock(link_mutex_);
+  return max_in_flight_;
+}
+
+size_t FakePrinter::Events() const
+{
+  std::lock_guard<std::mutex> lock(link_mutex_);
+  return events_;
+}
+
+size_t FakePrinter::LabelsPrinted() const
+{
+  auto now = std::chrono::steady_clock::now();
+  size_t printed = 0;
+  while (printed < labels_.size() && labels_[printed] <= now) {
+    printed++;
+  }
+  return printed;
+}
+
+size_t FakePrinter::RowPackets() const
+{
+  size_t count = 0;
+  for (const Packet& packet : packets_) {
+    if (packet.type >= static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW_INDEXED) &&
+        packet.type <= static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW)) {
+      count++;
+    }
+  }
+  return count;
+}
+
+size_t FakePrinter::RowBytes() const
+{
+  size_t bytes = 0;
+  for (const Packet& packet : packets_) {
+    if (packet.type >= static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW_INDEXED) &&
+        packet.type <= static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW)) {
+      bytes += packet.data.size() + 7;
+    }
+  }
+  return bytes;
+}
+
+bool FakePrinter::Render(uint16_t height, std::vector<Row>* rows) const
+{
+  rows->assign(height, Row{});
+  std::vector<uint8_t> sent(height, 0);
+  auto mark = [&](uint16_t row, uint16_t count) {
+    for (uint16_t i = 0; i < count && row + i < height; i++) {
+      sent[row + i]++;
+    }
+    return row + count <= height;
+  };
+
+  bool ok = true;
+  for (const Packet& packet : packets_) {
+    switch (static_cast<RequestCode>(packet.type)) {
+    case RequestCode::PRINT_EMPTY_ROW:
+      ok &= mark(RowNumber(packet.data), packet.data[2]);
+      break;
+    case RequestCode::PRINT_BITMAP_ROW: {
+      // Row, 3 bit counts, repeat, then the bitmap
+      uint16_t row = RowNumber(packet.data);
+      uint8_t repeat = packet.data[5];
+      ok &= packet.data.size() == 6 + kRowBytes && mark(row, repeat);
+      for (uint8_t i = 0; i < repeat && row + i < height; i++) {
+        memcpy((*rows)[row + i].data(), &packet.data[6], kRowBytes);
+      }
+      break;
+    }
+    case RequestCode::PRINT_BITMAP_ROW_INDEXED: {
+      // Row, 3 bit counts, repeat, then the x of every black pixel
+      uint16_t row = RowNumber(packet.data);
+      uint8_t repeat = packet.data[5];
+      ok &= mark(row, repeat);
+      for (uint8_t i = 0; i < repeat && row + i < height; i++) {
+        for (size_t k = 6; k + 1 < packet.data.size(); k += 2) {
+          uint16_t x = (packet.data[k] << 8) | packet.data[k + 1];
+          (*rows)[row + i][x >> 3] |= 0x80 >> (x & 7);
+        }
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  for (uint8_t count : sent) {
+    ok &= count == 1;
+  }
+  return ok;
+}
+
+esp_err_t FakePrinter::Receive(const uint8_t* data, size_t len, bool wait_for_response)
+{
+  if (fail_in_ > 0 && --fail_in_ == 0) {
+    failed_writes_++;
+    return ESP_FAIL;
+  }
+  if (!connected_) {
+    // No characteristic to write to
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  writes_++;
+  bytes_ += len;
+  if (!wait_for_response && len > write_size_) {
+    // A write command is a single ATT packet, the rest is lost
+    oversized_writes_++;
+    len = write_size_;
+  }
+
+  // Answers go out once the write completed
+  std::vector<Reply> replies;
+  for (size_t off = 0; off + 7 <= len && off + data[off + 3] + 7 <= len; off += data[off + 3] + 7) {
+    uint8_t type = data[off + 2];
+    const uint8_t* payload = data + off + 4;
+    packets_.push_back({type, std::vector<uint8_t>(payload, payload + data[off + 3]), wait_for_response});
+
+    for (const Ack& ack : kAcks) {
+      if (type == static_cast<uint8_t>(ack.request)) {
+        replies.push_back({static_cast<uint8_t>(ack.response), {1}});
+      }
+    }
+    if (type == static_cast<uint8_t>(RequestCode::START_PRINT)) {
+      labels_.clear();
+    }
+    if (type == static_cast<uint8_t>(RequestCode::SET_DIMENSION) && data[off + 3] >= 6) {
+      // Rows, columns, copies
+      copies_ = BigEndian16(payload + 4);
+    }
+    if (type == static_cast<uint8_t>(RequestCode::END_PAGE_PRINT)) {
+      // The page's copies come out one after another
+      auto start = std::chrono::steady_clock::now();
+      for (uint16_t i = 0; i < copies_; i++) {
+        if (!labels_.empty() && labels_.back() > start) {
+          start = labels_.back();
+        }
+        labels_.push_back(start + std::chrono::milliseconds(timing_.feed_ms));
+      }
+    }
+    if (type == static_cast<uint8_t>(RequestCode::END_PRINT)) {
+      labels_at_end_print_ = LabelsPrinted();
+    }
+    if (type == static_cast<uint8_t>(RequestCode::GET_PRINT_STATUS)) {
+      // Labels out, then print and feed progress of the last one out.
+      // Progress is complete after every label, only the count tells
+      // the session is done.
+      size_t printed = LabelsPrinted();
+      std::vector<uint8_t> status(kPrintStatusLen, 0);
+      status[0] = static_cast<uint8_t>(printed >> 8);
+      status[1] = static_cast<uint8_t>(printed);
+      status[2] = printed > 0 ? 100 : 50;
+      status[3] = printed > 0 ? 100 : 50;
+      replies.push_back({static_cast<uint8_t>(ResponseCode::PRINT_STATUS), status});
+    }
+    if (type == static_cast<uint8_t>(RequestCode::HEARTBEAT)) {
+      replies.push_back({static_cast<uint8_t>(ResponseCode::HEARTBEAT), std::vector<uint8_t>(kHeartbeatLen, 0)});
+    }
+  }
+
+  if (timing_.event_ms == 0) {
+    if (wait_for_response && timing_.write_ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(timing_.write_ms));
+    }
+    Complete(replies);
+    return ESP_OK;
+  }
+
+  // Queued in the stack until a connection event sends it
+  {
+    std::lock_guard<std::mutex> lock(link_mutex_);
+    if (congested_ && !wait_for_response) {
+      congested_writes_++;
+    }
+    link_queue_.push_back({wait_for_response, std::move(replies)});
+    if (!wait_for_response) {
+      in_flight_++;
+      max_in_flight_ = in_flight_ > max_in_flight_ ? in_flight_ : max_in_flight_;
+    }
+  }
+  if (congest_in_ > 0 && --congest_in_ == 0) {
+    SetCongested(true);
+  }
+  if (disconnect_in_ > 0 && --disconnect_in_ == 0) {
+    std::lock_guard<std::mutex> lock(link_mutex_);
+    disconnecting_ = true;
+  }
+  return ESP_OK;
+}
+
+void FakePrinter::Complete(const std::vector<Reply>& replies)
+{
+  printer_.OnWriteComplete();
+  for (const Reply& reply : replies) {
+    Send(reply.first, reply.second);
+  }
+}
+
+void FakePrinter::Send(uint8_t type, const std::vector<uint8_t>& data)
+{
+  uint8_t buf[UINT8_MAX + 7];
+  size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), type, data.data(), data.size());
+  printer_.ProcessReceivedData(buf, len);
+}
+
+void FakePrinter::SetCongested(bool congested)
+{
+  {
+    std::lock_guard<std::mutex> lock(link_mutex_);
+    congested_ = congested;
+    congested_until_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(congest_ms_);
+  }
+  printer_.OnCongestion(congested);
+}
+
+void FakePrinter::LinkTask()
+{
+  std::unique_lock<std::mutex> lock(link_mutex_);
+  while (!stopping_) {
+    link_cv_.wait_for(lock, std::chrono::milliseconds(timing_.event_ms));
+    if (congested_ && std::chrono::steady_clock::now() >= congested_until_) {
+      // Cleared before telling the printer, writes may follow at once
+      congested_ = false;
+      lock.unlock();
+      printer_.OnCongestion(false);
+      lock.lock();
+    }
+    if (disconnecting_) {
+      // Queued writes never complete
+      disconnecting_ = false;
+      connected_ = false;
+      congested_ = false;
+      link_queue_.clear();
+      in_flight_ = 0;
+      lock.unlock();
+      printer_.Reset();
+      lock.lock();
+      continue;
+    }
+    if (stopping_ || congested_ || link_queue_.empty()) {
+      continue;
+    }
+
+    // Writes of this event, a write with response takes a whole one
+    std::vector<PendingWrite> sent;
+    while (!link_queue_.empty() && sent.size() < timing_.writes_per_event) {
+      if (link_queue_.front().wait_for_response && !sent.empty()) {
+        break;
+      }
+      sent.push_back(std::move(link_queue_.front()));
+      link_queue_.pop_front();
+      if (!sent.back().wait_for_response) {
+        in_flight_--;
+      } else {
+        break;
+      }
+    }
+    events_++;
+
+    // Completions come from the BLE task, in order
+    lock.unlock();
+    for (const PendingWrite& write : sent) {
+      Complete(write.replies);
+    }
+    lock.lock();
+  }
+}
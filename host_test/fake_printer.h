@@ -0,0 +1,147 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "printer.h"
+
+namespace PRNM::HostTest {
+
+// How long the fake printer takes
+struct LinkTiming {
+  // Writes with response take this long to complete
+  uint32_t write_ms = 0;
+  // Each label prints and feeds this long, starting at its
+  // END_PAGE_PRINT or when the one before it is out
+  uint32_t feed_ms = 0;
+  // Connection interval. When set, writes complete from a link task at
+  // connection events instead of inline: up to writes_per_event writes
+  // without response per event, and a write with response takes an
+  // event of its own for the ATT response.
+  uint32_t event_ms = 0;
+  uint32_t writes_per_event = 4;
+};
+
+// The printer end of the BLE link. Writes are split into packets and
+// recorded, commands are answered the way a B1 answers them once their
+// write completed.
+class FakePrinter {
+public:
+  static constexpr size_t kRowBytes = NiimbotPrinter::kPaperWidthDots / 8;
+
+  struct Packet {
+    uint8_t type;
+    std::vector<uint8_t> data;
+    bool wait_for_response;
+  };
+
+  using Row = std::array<uint8_t, kRowBytes>;
+
+  // Takes over the printer's send callback, sets the write size of the
+  // default MTU and reports the printer ready
+  explicit FakePrinter(NiimbotPrinter& printer, LinkTiming timing = LinkTiming());
+  ~FakePrinter();
+
+  // Write size negotiated on connect (MTU - 3). Longer writes without
+  // response are cut to it, as the stack does.
+  void SetWriteSize(size_t size);
+
+  // Refuse the nth write from now, as when the stack can't queue it
+  void FailWrite(size_t n);
+  // Report congestion for ms from the nth write from now (0 = right
+  // away). Writes wait in the stack meanwhile. Needs event_ms.
+  void Congest(size_t n, uint32_t ms);
+
+  // Drop the connection at the nth write from now. Writes queued in the
+  // stack are lost, later ones are refused, and the printer is reset
+  // from the link task as main does on disconnect. Needs event_ms.
+  void Disconnect(size_t n);
+  // Connect again, negotiating the write size and reporting ready
+  void Connect();
+
+  // Forget the recorded writes
+  void Clear();
+
+  const std::vector<Packet>& Packets() const { return packets_; }
+  size_t Writes() const { return writes_; }
+  size_t Bytes() const { return bytes_; }
+  // Writes without response longer than the write size
+  size_t OversizedWrites() const { return oversized_writes_; }
+  // Writes the fake refused
+  size_t FailedWrites() const { return failed_writes_; }
+  // Writes without response received while congested
+  size_t CongestedWrites() const { return congested_writes_; }
+  // Most writes without response waiting in the stack at once
+  size_t MaxInFlight() const;
+  // Connection events that carried writes
+  size_t Events() const;
+  // Labels out of the printer in this print session, and how many were
+  // out when it was ended with END_PRINT
+  size_t LabelsPrinted() const;
+  size_t LabelsAtEndPrint() const { return labels_at_end_print_; }
+  // Row packets, 0x83 to 0x85, and their framed bytes
+  size_t RowPackets() const;
+  size_t RowBytes() const;
+
+  // Rows printed by the recorded row packets, false when a row was
+  // sent more than once or not at all
+  bool Render(uint16_t height, std::vector<Row>* rows) const;
+
+private:
+  using Reply = std::pair<uint8_t, std::vector<uint8_t>>;
+
+  // Write queued in the stack until a connection event completes it
+  struct PendingWrite {
+    bool wait_for_response;
+    std::vector<Reply> replies;
+  };
+
+  esp_err_t Receive(const uint8_t* data, size_t len, bool wait_for_response);
+  void Complete(const std::vector<Reply>& replies);
+  void Send(uint8_t type, const std::vector<uint8_t>& data);
+  void SetCongested(bool congested);
+  void LinkTask();
+
+  NiimbotPrinter& printer_;
+  LinkTiming timing_;
+  std::vector<Packet> packets_;
+  size_t writes_ = 0;
+  size_t bytes_ = 0;
+  size_t write_size_ = 0;
+  size_t oversized_writes_ = 0;
+  size_t failed_writes_ = 0;
+  size_t congested_writes_ = 0;
+  size_t fail_in_ = 0;
+  size_t congest_in_ = 0;
+  uint32_t congest_ms_ = 0;
+  size_t disconnect_in_ = 0;
+  std::atomic<bool> connected_{true};
+  // When each label of the session is out, copies from SET_DIMENSION
+  std::vector<std::chrono::steady_clock::time_point> labels_;
+  uint16_t copies_ = 1;
+  size_t labels_at_end_print_ = 0;
+
+  // Connection events, guarded by link_mutex_
+  mutable std::mutex link_mutex_;
+  std::condition_variable link_cv_;
+  std::deque<PendingWrite> link_queue_;
+  std::thread link_thread_;
+  bool stopping_ = false;
+  bool congested_ = false;
+  bool disconnecting_ = false;
+  std::chrono::steady_clock::time_point congested_until_;
+  size_t in_flight_ = 0;
+  size_t max_in_flight_ = 0;
+  size_t events_ = 0;
+};
+
+}
@@ -0,0 +1,203 @@
+// FrameReader fed byte by byte and in bursts must deliver the same
+// frames, timed per received byte
+#include <random>
+#include <vector>
+
+#include "frame_reader.h"
+#include "host_test.h"
+#include "printer.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  struct Frame {
+    uint8_t type;
+    std::vector<uint8_t> data;
+
+    bool operator==(const Frame& other) const { return type == other.type && data == other.data; }
+  };
+
+  // Frames found in stream fed chunk bytes at a time
+  std::vector<Frame> Parse(const std::vector<uint8_t>& stream, size_t chunk, double* ns_per_byte = nullptr)
+  {
+    std::vector<Frame> frames;
+    FrameReader reader;
+    reader.SetFrameCallback([&frames](const PacketView& packet) {
+      frames.push_back({packet.type, std::vector<uint8_t>(packet.data, packet.data + packet.len)});
+    });
+
+    Stopwatch watch;
+    for (size_t off = 0; off < stream.size(); off += chunk) {
+      reader.Feed(stream.data() + off, std::min(chunk, stream.size() - off));
+    }
+    if (ns_per_byte) {
+      *ns_per_byte = watch.ElapsedNs() / stream.size();
+    }
+    return frames;
+  }
+
+  void Append(std::vector<uint8_t>* stream, uint8_t type, const std::vector<uint8_t>& data)
+  {
+    uint8_t buf[UINT8_MAX + 7];
+    size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), type, data.data(), data.size());
+    stream->insert(stream->end(), buf, buf + len);
+  }
+
+  enum class Link {
+    Clean,
+    // Garbage between frames and corrupted frames
+    Noisy,
+    // Runs of stray start markers claiming long frames, as when a
+    // notification is cut short
+    Hostile,
+  };
+
+  // Replies as the printer sends them, returns the intact frames
+  std::vector<Frame> MakeStream(Link link, std::vector<uint8_t>* stream)
+  {
+    // Reply types with their payload lengths
+    static constexpr std::pair<uint8_t, uint8_t> kReplies[] = {
+      {0xDD, 13}, {0xB3, 10}, {0x31, 1}, {0x33, 1}, {0x02, 1}, {0x04, 1}, {0x14, 2}, {0xE4, 1}, {0xF4, 1}, {0x48, 2},
+    };
+    static constexpr size_t kFrames = 20000;
+
+    std::mt19937 rng(1);
+    std::vector<Frame> frames;
+    for (size_t i = 0; i < kFrames; i++) {
+      if (link == Link::Noisy) {
+        while (rng() % 10 < 3) {
+          stream->push_back(rng() % 2 ? 0x55 : rng());
+        }
+      }
+      if (link == Link::Hostile && i % 4 == 0) {
+        for (int j = 0; j < 60; j++) {
+          stream->insert(stream->end(), {0x55, 0x55, static_cast<uint8_t>(0xC0 | (rng() & 0x3F)),
+                                         static_cast<uint8_t>(0xF0 | (rng() & 0x0F))});
+        }
+      }
+
+      const auto& reply = kReplies[rng() % std::size(kReplies)];
+      std::vector<uint8_t> data(reply.second);
+      for (uint8_t& byte : data) {
+        byte = rng();
+      }
+      size_t start = stream->size();
+      Append(stream, reply.first, data);
+      if (link == Link::Noisy && rng() % 20 == 0) {
+        (*stream)[start + 4 + rng() % (data.size() + 1)] ^= 0x5A;
+      } else {
+        frames.push_back({reply.first, data});
+      }
+    }
+    return frames;
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_ERROR);
+
+  // A stray marker in front of a frame, then another in front of the
+  // next one. Found on the first frame, the second must not be missed.
+  {
+    const std::vector<uint8_t> stream = {
+      0x55,
+      0x55, 0x55, 0x8E, 0x00, 0x8E, 0xAA, 0xAA,
+      0x55,
+      0x55, 0x55, 0xBD, 0x00, 0xBD, 0xAA, 0xAA,
+    };
+    const std::vector<Frame> expected = {{0x8E, {}}, {0xBD, {}}};
+    CHECK(Parse(stream, 1) == expected);
+    CHECK(Parse(stream, stream.size()) == expected);
+  }
+
+  // A cut-short frame whose length ends on the next frame's end passes
+  // as valid, the frame inside it shows it started on a stray marker
+  {
+    std::vector<uint8_t> status;
+    Append(&status, 0xB3, {0, 1, 100, 100, 0, 0, 0, 0, 0, 0});
+    // Type and length cancel, the status frame XORs to zero
+    uint8_t len = static_cast<uint8_t>(status.size() - 3);
+    std::vector<uint8_t> stream = {0x55, 0x55, len, len};
+    stream.insert(stream.end(), status.begin(), status.end());
+
+    const std::vector<Frame> expected = {{0xB3, {0, 1, 100, 100, 0, 0, 0, 0, 0, 0}}};
+    for (size_t chunk = 1; chunk <= stream.size(); chunk++) {
+      CHECK(Parse(stream, chunk) == expected);
+    }
+  }
+
+  // The trade-off: a valid frame carrying a whole valid frame is
+  // dropped for the one inside, however it is fed
+  {
+    std::vector<uint8_t> inner;
+    Append(&inner, 0xB3, {0, 1, 100, 100, 0, 0, 0, 0, 0, 0});
+    std::vector<uint8_t> stream;
+    Append(&stream, 0x4B, inner);
+
+    const std::vector<Frame> expected = {{0xB3, {0, 1, 100, 100, 0, 0, 0, 0, 0, 0}}};
+    for (size_t chunk = 1; chunk <= stream.size(); chunk++) {
+      CHECK(Parse(stream, chunk) == expected);
+    }
+  }
+
+  // Every split of a few frames behind stray markers
+  {
+    std::vector<uint8_t> stream = {0x55, 0x55, 0x55};
+    Append(&stream, 0xB3, {0, 1, 100, 100, 0, 0, 0, 0, 0, 0});
+    stream.insert(stream.end(), {0x55, 0x55, 0x55, 0x20});
+    Append(&stream, 0x02, {1});
+    Append(&stream, 0xDD, std::vector<uint8_t>(13, 0x55));
+    std::vector<Frame> expected = Parse(stream, 1);
+    CHECK_EQ(expected.size(), 3);
+    for (size_t chunk = 2; chunk <= stream.size(); chunk++) {
+      CHECK(Parse(stream, chunk) == expected);
+    }
+  }
+
+  // Short frames behind stray markers, fed in random bursts
+  {
+    std::mt19937 rng(2);
+    for (int i = 0; i < 5000; i++) {
+      std::vector<uint8_t> stream;
+      for (int j = 0; j < 4; j++) {
+        for (uint32_t strays = rng() % 3; strays > 0; strays--) {
+          stream.push_back(0x55);
+        }
+        std::vector<uint8_t> data(rng() % 3);
+        for (uint8_t& byte : data) {
+          byte = rng() % 4 == 0 ? 0xAA : rng();
+        }
+        Append(&stream, rng(), data);
+      }
+      std::vector<Frame> expected = Parse(stream, 1);
+      CHECK(Parse(stream, stream.size()) == expected);
+      CHECK(Parse(stream, 1 + rng() % stream.size()) == expected);
+    }
+  }
+
+  for (Link link : {Link::Clean, Link::Noisy, Link::Hostile}) {
+    std::vector<uint8_t> stream;
+    std::vector<Frame> sent = MakeStream(link, &stream);
+    const char* name = link == Link::Clean ? "clean" : link == Link::Noisy ? "noisy" : "hostile";
+
+    std::vector<Frame> bytewise;
+    for (size_t chunk : {1, 20, 197, 4096}) {
+      double ns_per_byte;
+      std::vector<Frame> frames = Parse(stream, chunk, &ns_per_byte);
+      printf("%-8s %5zu byte feeds %6.1f ns/byte, %zu of %zu frames\n", name, chunk, ns_per_byte, frames.size(),
+             sent.size());
+      if (chunk == 1) {
+        bytewise = frames;
+      }
+      CHECK(frames == bytewise);
+    }
+    // Garbage on the noisy link may pass for a frame
+    if (link != Link::Noisy) {
+      CHECK(bytewise == sent);
+    }
+  }
+
+  return Result();
+}
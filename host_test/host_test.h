@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+
+#include <esp_log.h>
+
+#include "sign_pack.h"
+
+// Checks for the host tests. A failed check is reported and fails the
+// test when main returns HostTest::Result().
+#define CHECK(cond) do {                                                        \
+    if (!(cond)) {                                                              \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);  \
+      PRNM::HostTest::Failures()++;                                             \
+    }                                                                           \
+  } while (0)
+
+#define CHECK_EQ(a, b) do {                                                     \
+    long long a_ = static_cast<long long>(a);                                   \
+    long long b_ = static_cast<long long>(b);                                   \
+    if (a_ != b_) {                                                             \
+      fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n",         \
+              __FILE__, __LINE__, #a, #b, a_, b_);                              \
+      PRNM::HostTest::Failures()++;                                             \
+    }                                                                           \
+  } while (0)
+
+namespace PRNM::HostTest {
+
+inline int& Failures()
+{
+  static int failures = 0;
+  return failures;
+}
+
+// Exit code of a test
+inline int Result()
+{
+  if (Failures() > 0) {
+    fprintf(stderr, "%d checks failed\n", Failures());
+    return 1;
+  }
+  return 0;
+}
+
+// The sign pack gen.py wrote next to signs.cc, every sign in index order
+inline bool OpenSigns(Signs::SignPack* pack)
+{
+  return pack->Open(PRNM_SIGNS_BIN) == ESP_OK && pack->Count() > 0;
+}
+
+// The same signs with their row packets stored, written by gen.py
+// --packets into signs_packets.bin here
+inline bool OpenPacketSigns(Signs::SignPack* pack)
+{
+  return pack->Open(PRNM_SIGNS_PACKETS_BIN) == ESP_OK && pack->Count() > 0;
+}
+
+// Wall time since construction
+class Stopwatch {
+public:
+  Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+
+  double ElapsedMs() const
+  {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+  }
+  double ElapsedNs() const { return ElapsedMs() * 1e6; }
+
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+}
@@ -0,0 +1,126 @@
+// Printing over a simulated BLE link that completes writes at
+// connection events: the stream window, writes the stack refuses and
+// congestion
+#include <algorithm>
+
+#include "fake_printer.h"
+#include "host_test.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  static constexpr size_t kLabels = 12;
+  static constexpr size_t kFailedPrints = 20;
+  static constexpr uint32_t kCongestionMs = 300;
+
+  // 4 writes without response per 2 ms connection event
+  static constexpr LinkTiming kTiming = {0, 0, 2, 4};
+
+  // Every row came out as decoded
+  bool PrintedRows(const FakePrinter& fake, const Signs::RleImage& image)
+  {
+    std::vector<FakePrinter::Row> rows;
+    bool ok = fake.Render(image.h, &rows);
+    for (uint16_t y = 0; y < image.h; y++) {
+      FakePrinter::Row expected = {};
+      Signs::decode_rle_row_1bpp(image, y, expected.data(), expected.size());
+      ok &= rows[y] == expected;
+    }
+    return ok;
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_NONE);
+
+  Signs::SignPack pack;
+  CHECK(OpenSigns(&pack));
+
+  NiimbotPrinter printer;
+  FakePrinter fake(printer, kTiming);
+  CHECK(printer.IsReady());
+
+  // Row writes fill the window, and wait for it
+  {
+    size_t events = 0;
+    size_t writes = 0;
+    size_t max_in_flight = 0;
+    for (size_t i = 0; i < kLabels; i++) {
+      const Signs::RleImage& image = *pack.Get(i % pack.Count());
+      fake.Clear();
+      CHECK_EQ(printer.Print(image), ESP_OK);
+      CHECK(PrintedRows(fake, image));
+      CHECK(fake.MaxInFlight() <= CONFIG_PRNM_PRINT_STREAM_WINDOW);
+      max_in_flight = std::max(max_in_flight, fake.MaxInFlight());
+      events += fake.Events();
+      writes += fake.Writes();
+    }
+    printf("%zu labels, %.1f connection events and %.1f writes per label\n", kLabels,
+           static_cast<double>(events) / kLabels, static_cast<double>(writes) / kLabels);
+    CHECK_EQ(max_in_flight, CONFIG_PRNM_PRINT_STREAM_WINDOW);
+  }
+
+  // A write the stack refuses fails the print wherever it happens, and
+  // leaves the window whole for the next one
+  {
+    // Long enough to fill the window
+    const Signs::RleImage& image = *pack.Get(1);
+    fake.Clear();
+    CHECK_EQ(printer.Print(image), ESP_OK);
+    size_t writes = fake.Writes();
+
+    for (size_t i = 0; i < kFailedPrints; i++) {
+      fake.Clear();
+      fake.FailWrite(1 + i * (writes - 1) / (kFailedPrints - 1));
+      CHECK(printer.Print(image) != ESP_OK);
+      CHECK_EQ(fake.FailedWrites(), 1);
+    }
+
+    fake.Clear();
+    CHECK_EQ(printer.Print(image), ESP_OK);
+    CHECK(PrintedRows(fake, image));
+    CHECK_EQ(fake.MaxInFlight(), CONFIG_PRNM_PRINT_STREAM_WINDOW);
+  }
+
+  // Nothing is streamed while the link is congested, from the middle of
+  // the rows and from before the print
+  for (size_t congest_at : {10, 0}) {
+    const Signs::RleImage& image = *pack.Get(2);
+    fake.Clear();
+    fake.Congest(congest_at, kCongestionMs);
+    Stopwatch watch;
+    CHECK_EQ(printer.Print(image), ESP_OK);
+    double ms = watch.ElapsedMs();
+    printf("congested from write %zu for %lu ms, printed in %.0f ms\n", congest_at,
+           static_cast<unsigned long>(kCongestionMs), ms);
+    CHECK(ms >= kCongestionMs);
+    CHECK_EQ(fake.CongestedWrites(), 0);
+    CHECK(PrintedRows(fake, image));
+  }
+
+  // A disconnect in the middle of the rows fails the print. Once
+  // connected again, the next print doesn't wait on writes that were
+  // lost with the connection.
+  {
+    const Signs::RleImage& image = *pack.Get(1);
+    fake.Clear();
+    fake.Disconnect(20);
+    CHECK(printer.Print(image) != ESP_OK);
+    CHECK(!printer.IsReady());
+
+    fake.Connect();
+    CHECK(printer.IsReady());
+    fake.Clear();
+    Stopwatch watch;
+    CHECK_EQ(printer.Print(image), ESP_OK);
+    double ms = watch.ElapsedMs();
+    printf("printed in %.0f ms after reconnecting\n", ms);
+    CHECK(PrintedRows(fake, image));
+    CHECK_EQ(fake.MaxInFlight(), CONFIG_PRNM_PRINT_STREAM_WINDOW);
+    CHECK(ms < 500);
+  }
+
+  return Result();
+}
@@ -0,0 +1,169 @@
+// Reply views decode what the printer sends, heartbeats the way the
+// length switch they replaced did
+#include <vector>
+
+#include "host_test.h"
+#include "packet_view.h"
+#include "printer.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  using Status = NiimbotPrinter::Status;
+
+  static constexpr size_t kMaxHeartbeatLen = 24;
+
+  // Heartbeat decoding as HandleResponse switched on the length before
+  // the views
+  void ReferenceHeartbeat(const uint8_t* data, size_t data_len, Status* status)
+  {
+    switch (data_len) {
+      case 20:
+        status->paper_state = data[18];
+        status->rfid_read_state = data[19];
+        break;
+      case 13:
+        status->closing_state = data[9];
+        status->power_level = data[10];
+        status->paper_state = data[11];
+        status->rfid_read_state = data[12];
+        break;
+      case 19:
+        status->closing_state = data[15];
+        status->power_level = data[16];
+        status->paper_state = data[17];
+        status->rfid_read_state = data[18];
+        break;
+      case 10:
+        status->closing_state = data[8];
+        status->power_level = data[9];
+        break;
+      case 9:
+        status->closing_state = data[8];
+        break;
+    }
+  }
+
+  bool SameStatus(const Status& a, const Status& b)
+  {
+    return a.closing_state == b.closing_state && a.power_level == b.power_level && a.paper_state == b.paper_state &&
+           a.rfid_read_state == b.rfid_read_state;
+  }
+
+  void Feed(NiimbotPrinter& printer, uint8_t type, const std::vector<uint8_t>& data)
+  {
+    uint8_t buf[UINT8_MAX + 7];
+    size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), type, data.data(), data.size());
+    printer.ProcessReceivedData(buf, len);
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_NONE);
+
+  // Every heartbeat length, through the view and through the printer
+  for (size_t len = 0; len <= kMaxHeartbeatLen; len++) {
+    std::vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++) {
+      data[i] = static_cast<uint8_t>(0x10 + i);
+    }
+
+    // Fields a layout doesn't carry keep their value
+    static constexpr uint8_t kUnset = 0xEE;
+    Status expected = {kUnset, kUnset, kUnset, kUnset};
+    if (len >= 9) {
+      ReferenceHeartbeat(data.data(), len, &expected);
+    }
+
+    HeartbeatView view(PacketView{HeartbeatView::kType, data.data(), len});
+    CHECK_EQ(view.IsValid(), len >= 9);
+    Status decoded = {kUnset, kUnset, kUnset, kUnset};
+    using Field = HeartbeatView::Field;
+    view.Get(Field::ClosingState, &decoded.closing_state);
+    view.Get(Field::PowerLevel, &decoded.power_level);
+    view.Get(Field::PaperState, &decoded.paper_state);
+    view.Get(Field::RfidReadState, &decoded.rfid_read_state);
+    CHECK(SameStatus(decoded, expected));
+
+    NiimbotPrinter printer;
+    Feed(printer, HeartbeatView::kType, data);
+    CHECK_EQ(printer.IsReady(), len >= 9);
+    Status from_zero;
+    if (len >= 9) {
+      ReferenceHeartbeat(data.data(), len, &from_zero);
+    }
+    CHECK(SameStatus(printer.GetStatus(), from_zero));
+  }
+
+  // A heartbeat only decodes from its own type
+  {
+    std::vector<uint8_t> data(13, 1);
+    CHECK(!HeartbeatView(PacketView{0xDE, data.data(), data.size()}).IsValid());
+  }
+
+  // Print status: page, then print and feed progress
+  {
+    const std::vector<uint8_t> data = {0x01, 0x02, 60, 40, 0, 0, 0, 0, 0, 0};
+    PrintStatusView view(PacketView{PrintStatusView::kType, data.data(), data.size()});
+    CHECK(view.IsValid());
+    CHECK_EQ(view.Page(), 0x0102);
+    CHECK_EQ(view.Print(), 60);
+    CHECK_EQ(view.Feed(), 40);
+    CHECK(!PrintStatusView(PacketView{PrintStatusView::kType, data.data(), 3}).IsValid());
+    CHECK(!PrintStatusView(PacketView{0xB4, data.data(), data.size()}).IsValid());
+
+    NiimbotPrinter printer;
+    Feed(printer, PrintStatusView::kType, data);
+    CHECK_EQ(printer.GetPrintProgress().page, 0x0102);
+    CHECK_EQ(printer.GetPrintProgress().print, 60);
+    CHECK_EQ(printer.GetPrintProgress().feed, 40);
+  }
+
+  // Info replies are typed by their key
+  {
+    const std::vector<uint8_t> data = {0x10, 0x00};
+    InfoView view(PacketView{InfoView::kTypeBase + 8, data.data(), data.size()});
+    CHECK(view.IsValid());
+    CHECK_EQ(view.Key(), 8);
+    CHECK_EQ(view.U8(), 0x10);
+    CHECK_EQ(view.U16(), 4096);
+    CHECK(!InfoView(PacketView{InfoView::kTypeBase, data.data(), data.size()}).IsValid());
+    CHECK(!InfoView(PacketView{InfoView::kTypeBase + InfoView::kMaxKey + 1, data.data(), data.size()}).IsValid());
+    CHECK(!InfoView(PacketView{InfoView::kTypeBase + 10, data.data(), 0}).IsValid());
+  }
+
+  // Fields read past the payload are 0
+  {
+    const uint8_t data[] = {0xAB, 0xCD};
+    PacketView packet{0x01, data, sizeof(data)};
+    CHECK_EQ(packet.U8(1), 0xCD);
+    CHECK_EQ(packet.U8(2), 0);
+    CHECK_EQ(packet.U16(0), 0xABCD);
+    CHECK_EQ(packet.U16(1), 0);
+  }
+
+  // Built packets parse back in place, damaged ones don't
+  {
+    const std::vector<uint8_t> data = {1, 2, 3, 0x55, 0xAA};
+    uint8_t buf[UINT8_MAX + 7];
+    size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), 0x85, data.data(), data.size());
+    CHECK_EQ(len, data.size() + 7);
+
+    PacketView packet;
+    CHECK(NiimbotPrinter::ParsePacket(buf, len, &packet));
+    CHECK_EQ(packet.type, 0x85);
+    CHECK(packet.data == buf + 4);
+    CHECK(std::vector<uint8_t>(packet.data, packet.data + packet.len) == data);
+
+    CHECK(!NiimbotPrinter::ParsePacket(buf, len - 1, &packet));
+    buf[len - 3] ^= 1;
+    CHECK(!NiimbotPrinter::ParsePacket(buf, len, &packet));
+    buf[len - 3] ^= 1;
+    buf[len - 1] = 0xAB;
+    CHECK(!NiimbotPrinter::ParsePacket(buf, len, &packet));
+  }
+
+  return Result();
+}
@@ -0,0 +1,75 @@
+// A print session ends only once every label is out, and is closed
+// with END_PRINT when a step fails
+#include <vector>
+
+#include "fake_printer.h"
+#include "host_test.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  // Labels take long enough that several status polls see some out
+  static constexpr LinkTiming kFeedTiming = {0, 250};
+
+  static constexpr uint8_t kStartPrint = static_cast<uint8_t>(NiimbotPrinter::RequestCode::START_PRINT);
+  static constexpr uint8_t kEndPrint = static_cast<uint8_t>(NiimbotPrinter::RequestCode::END_PRINT);
+
+  uint8_t LastCommand(const FakePrinter& fake)
+  {
+    return fake.Packets().empty() ? 0 : fake.Packets().back().type;
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_NONE);
+
+  Signs::SignPack pack;
+  CHECK(OpenSigns(&pack));
+
+  // Four labels from three pages, the session waits for the last one
+  {
+    NiimbotPrinter printer;
+    FakePrinter fake(printer, kFeedTiming);
+    const NiimbotPrinter::Page pages[] = {{pack.Get(0), 1}, {pack.Get(1), 2}, {pack.Get(2), 1}};
+    Stopwatch watch;
+    CHECK_EQ(printer.PrintPages(pages, 3), ESP_OK);
+    CHECK_EQ(fake.LabelsAtEndPrint(), 4);
+    CHECK(watch.ElapsedMs() >= 4 * kFeedTiming.feed_ms);
+    CHECK_EQ(LastCommand(fake), kEndPrint);
+  }
+
+  // A failed write anywhere after START_PRINT still closes the session
+  {
+    NiimbotPrinter printer;
+    FakePrinter fake(printer);
+    const Signs::RleImage& image = *pack.Get(1);
+    CHECK_EQ(printer.Print(image), ESP_OK);
+    size_t writes = fake.Writes();
+    size_t start_print = 0;
+    for (size_t i = 0; i < fake.Packets().size(); i++) {
+      if (fake.Packets()[i].type == kStartPrint) {
+        start_print = i + 1;
+      }
+    }
+    CHECK(start_print > 0);
+
+    for (size_t n = 1; n <= writes; n++) {
+      fake.Clear();
+      fake.FailWrite(n);
+      CHECK(printer.Print(image) != ESP_OK);
+      CHECK_EQ(fake.FailedWrites(), 1);
+      // START_PRINT and the commands before it go out one per write
+      bool session_open = n >= start_print;
+      bool end_print_failed = n == writes;
+      CHECK_EQ(LastCommand(fake) == kEndPrint, session_open && !end_print_failed);
+
+      fake.Clear();
+      CHECK_EQ(printer.Print(image), ESP_OK);
+      CHECK_EQ(LastCommand(fake), kEndPrint);
+    }
+  }
+
+  return Result();
+}
@@ -0,0 +1,115 @@
+// Reply dispatch: subscriber events and the reply counters
+#include <vector>
+
+#include "host_test.h"
+#include "printer.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  using Status = NiimbotPrinter::Status;
+  using PrintProgress = NiimbotPrinter::PrintProgress;
+  using ResponseCode = NiimbotPrinter::ResponseCode;
+
+  void Reply(NiimbotPrinter& printer, uint8_t type, const std::vector<uint8_t>& data)
+  {
+    uint8_t buf[UINT8_MAX + 7];
+    size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), type, data.data(), data.size());
+    printer.ProcessReceivedData(buf, len);
+  }
+
+  void Reply(NiimbotPrinter& printer, ResponseCode code, const std::vector<uint8_t>& data)
+  {
+    Reply(printer, static_cast<uint8_t>(code), data);
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_NONE);
+
+  NiimbotPrinter printer;
+
+  // Every subscriber gets every event, the one past kMaxSubscribers is
+  // refused
+  std::vector<Status> statuses[NiimbotPrinter::kMaxSubscribers];
+  std::vector<PrintProgress> progress[NiimbotPrinter::kMaxSubscribers];
+  std::vector<uint8_t> errors[NiimbotPrinter::kMaxSubscribers];
+  for (size_t i = 0; i < NiimbotPrinter::kMaxSubscribers; i++) {
+    CHECK_EQ(printer.SubscribeStatus([&statuses, i](const Status& status) { statuses[i].push_back(status); }), ESP_OK);
+    CHECK_EQ(printer.SubscribeProgress([&progress, i](const PrintProgress& p) { progress[i].push_back(p); }),
+             ESP_OK);
+    CHECK_EQ(printer.SubscribeError([&errors, i](uint8_t error) { errors[i].push_back(error); }), ESP_OK);
+  }
+  bool extra_called = false;
+  CHECK_EQ(printer.SubscribeStatus([&extra_called](const Status&) { extra_called = true; }), ESP_ERR_NO_MEM);
+  CHECK_EQ(printer.SubscribeProgress([&extra_called](const PrintProgress&) { extra_called = true; }),
+           ESP_ERR_NO_MEM);
+  CHECK_EQ(printer.SubscribeError([&extra_called](uint8_t) { extra_called = true; }), ESP_ERR_NO_MEM);
+
+  bool ready = false;
+  printer.SetReadyCallback([&ready]() { ready = true; });
+
+  // 13 byte heartbeat: closing, power, paper, rfid from byte 9
+  Reply(printer, ResponseCode::HEARTBEAT, {0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 4, 2, 3});
+  Reply(printer, ResponseCode::PRINT_STATUS, {0, 2, 100, 40});
+  Reply(printer, ResponseCode::PRINTER_ERROR, {0x06});
+  Reply(printer, ResponseCode::PRINTER_ERROR, {});
+
+  CHECK(ready);
+  for (size_t i = 0; i < NiimbotPrinter::kMaxSubscribers; i++) {
+    CHECK_EQ(statuses[i].size(), 1);
+    if (!statuses[i].empty()) {
+      CHECK_EQ(statuses[i][0].closing_state, 1);
+      CHECK_EQ(statuses[i][0].power_level, 4);
+      CHECK_EQ(statuses[i][0].paper_state, 2);
+      CHECK_EQ(statuses[i][0].rfid_read_state, 3);
+    }
+    CHECK_EQ(progress[i].size(), 1);
+    if (!progress[i].empty()) {
+      CHECK_EQ(progress[i][0].page, 2);
+      CHECK_EQ(progress[i][0].print, 100);
+      CHECK_EQ(progress[i][0].feed, 40);
+    }
+    // An error without a code reports 0xFF
+    CHECK(errors[i] == std::vector<uint8_t>({0x06, 0xFF}));
+  }
+  CHECK(!extra_called);
+
+  // Replies that don't decode raise no event
+  Reply(printer, ResponseCode::HEARTBEAT, {1, 2, 3});
+  Reply(printer, ResponseCode::PRINT_STATUS, {0, 1});
+  CHECK_EQ(statuses[0].size(), 1);
+  CHECK_EQ(progress[0].size(), 1);
+
+  // Acks are counted by their success flag, everything unexpected as
+  // unknown
+  NiimbotPrinter::ResponseStats expected = printer.GetResponseStats();
+  CHECK_EQ(expected.errors, 2);
+  CHECK_EQ(expected.unknown, 2);
+
+  Reply(printer, ResponseCode::SET_LABEL_DENSITY, {1});
+  Reply(printer, ResponseCode::START_PRINT, {1});
+  Reply(printer, ResponseCode::END_PAGE_PRINT, {1});
+  Reply(printer, ResponseCode::END_PRINT, {1});
+  expected.acks += 4;
+  Reply(printer, ResponseCode::SET_LABEL_TYPE, {0});
+  Reply(printer, ResponseCode::SET_DIMENSION, {0});
+  expected.failed_acks += 2;
+  // Empty ack, unlisted type, info reply without payload
+  Reply(printer, ResponseCode::SET_QUANTITY, {});
+  Reply(printer, 0x77, {1});
+  Reply(printer, 0x4A, {});
+  expected.unknown += 3;
+  // Well formed info replies are neither acks nor unknown
+  Reply(printer, 0x4A, {87});
+
+  const NiimbotPrinter::ResponseStats& stats = printer.GetResponseStats();
+  CHECK_EQ(stats.acks, expected.acks);
+  CHECK_EQ(stats.failed_acks, expected.failed_acks);
+  CHECK_EQ(stats.errors, expected.errors);
+  CHECK_EQ(stats.unknown, expected.unknown);
+
+  return Result();
+}
@@ -0,0 +1,184 @@
+// decode_rle_row_1bpp, RowReader and rle_row_black_runs against the
+// pixel at a time reference, and decoding time per row
+#include <algorithm>
+#include <memory>
+#include <random>
+
+#include "host_test.h"
+#include "rle_reference.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  static constexpr uint16_t kRowBytes = Signs::kWidth / 8;
+
+  // Check every row of img, decoded at row_bytes
+  void CheckDecode(const Signs::RleImage& img, const std::vector<Pixels>& expected, uint16_t row_bytes)
+  {
+    std::vector<uint8_t> row(row_bytes);
+    for (uint16_t y = 0; y < img.h; y++) {
+      std::fill(row.begin(), row.end(), 0xA5);
+      Signs::decode_rle_row_1bpp(img, y, row.data(), row_bytes);
+      CHECK(row == PackRow(expected[y], row_bytes));
+    }
+  }
+
+  void CheckRuns(const Signs::RleImage& img, const std::vector<Pixels>& expected)
+  {
+    Signs::RleRun runs[Signs::kWidth / 2];
+    for (uint16_t y = 0; y < img.h; y++) {
+      std::vector<Signs::RleRun> want = ReferenceRuns(expected[y]);
+      uint16_t num_runs;
+      uint16_t black = Signs::rle_row_black_runs(img, y, runs, std::size(runs), &num_runs);
+      CHECK_EQ(num_runs, want.size());
+      size_t want_black = 0;
+      for (size_t i = 0; i < want.size() && i < num_runs; i++) {
+        CHECK(runs[i].x == want[i].x && runs[i].len == want[i].len);
+        want_black += want[i].len;
+      }
+      CHECK_EQ(black, want_black);
+    }
+  }
+
+  // RowReader in order, backwards and at random
+  void CheckRowReader(const Signs::RleImage& img, const std::vector<Pixels>& expected)
+  {
+    std::vector<uint16_t> order(img.h);
+    for (uint16_t y = 0; y < img.h; y++) {
+      order[y] = y;
+    }
+    std::vector<uint16_t> backwards(order.rbegin(), order.rend());
+    std::vector<uint16_t> shuffled = order;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(img.h));
+
+    uint8_t row[kRowBytes];
+    for (const std::vector<uint16_t>* rows : {&order, &backwards, &shuffled}) {
+      Signs::RowReader reader(img);
+      for (uint16_t y : *rows) {
+        reader.Decode(y, row, sizeof(row));
+        CHECK(std::vector<uint8_t>(row, row + sizeof(row)) == PackRow(expected[y], sizeof(row)));
+      }
+    }
+  }
+
+  // Time to decode every row of every image, ns per row. decode(img, y,
+  // row) is called for the rows of each image in order.
+  template <typename Decode>
+  double TimeRows(const std::vector<const Signs::RleImage*>& images, Decode decode)
+  {
+    static constexpr int kRounds = 20;
+    uint8_t row[kRowBytes];
+    size_t rows = 0;
+    uint32_t sink = 0;
+    Stopwatch watch;
+    for (int round = 0; round < kRounds; round++) {
+      for (const Signs::RleImage* img : images) {
+        for (uint16_t y = 0; y < img->h; y++) {
+          decode(*img, y, row);
+          sink += row[y % sizeof(row)];
+        }
+        rows += img->h;
+      }
+    }
+    double ns = watch.ElapsedNs() / rows;
+    // Keep the decodes from being optimized out
+    CHECK(sink != 1u << 31);
+    return ns;
+  }
+
+  // The decoder before it filled bytes and words, a bit at a time
+  void DecodeBitwise(const Signs::RleImage& img, uint16_t y, uint8_t* row_data)
+  {
+    memset(row_data, 0x00, kRowBytes);
+    if (y < img.box_y || y >= img.box_y + img.box_h) {
+      return;
+    }
+    const uint8_t* p = img.data + img.row_offs[y - img.box_y];
+    uint16_t x = img.box_x;
+    while (x < img.box_x + img.box_w) {
+      uint8_t t = *p++;
+      uint16_t len = ReadRunLength(t, p);
+      for (uint16_t i = 0; i < len && x < img.w; i++, x++) {
+        if (t & 0x80) {
+          row_data[x >> 3] |= 0x80 >> (x & 7);
+        }
+      }
+    }
+  }
+}
+
+int main()
+{
+  Signs::SignPack pack;
+  CHECK(OpenSigns(&pack));
+
+  // Every sign as generated, and RLE coded row by row
+  std::vector<const Signs::RleImage*> signs;
+  std::vector<std::unique_ptr<RleCodedImage>> rle_signs;
+  std::vector<const Signs::RleImage*> rle_images;
+  for (size_t i = 0; i < pack.Count(); i++) {
+    const Signs::RleImage& img = *pack.Get(i);
+    std::vector<Pixels> expected = ReferenceDecode(img);
+    CheckDecode(img, expected, kRowBytes);
+    CheckDecode(img, expected, kRowBytes - 5);
+    CheckDecode(img, expected, kRowBytes + 3);
+    CheckRuns(img, expected);
+    CheckRowReader(img, expected);
+    signs.push_back(&img);
+
+    rle_signs.push_back(std::make_unique<RleCodedImage>(expected));
+    CHECK(rle_signs.back()->IsValid());
+    const Signs::RleImage& rle = rle_signs.back()->Image();
+    CheckDecode(rle, expected, kRowBytes);
+    CheckDecode(rle, expected, kRowBytes - 5);
+    CheckDecode(rle, expected, kRowBytes + 3);
+    CheckRuns(rle, expected);
+    rle_images.push_back(&rle);
+  }
+
+  // Every black run of a full width row
+  for (uint16_t x = 0; x < Signs::kWidth; x++) {
+    for (uint16_t end = x + 1; end <= Signs::kWidth; end++) {
+      std::vector<Pixels> rows(1, Pixels(Signs::kWidth, 0));
+      std::fill(rows[0].begin() + x, rows[0].begin() + end, 1);
+      RleCodedImage rle(rows);
+      CheckDecode(rle.Image(), rows, kRowBytes);
+      CheckDecode(rle.Image(), rows, kRowBytes + 1);
+      CheckRuns(rle.Image(), rows);
+    }
+  }
+
+  // Every row of up to 16 pixels
+  for (uint16_t width = 1; width <= 16; width++) {
+    for (uint32_t bits = 0; bits < (1u << width); bits++) {
+      std::vector<Pixels> rows(1, Pixels(width, 0));
+      for (uint16_t x = 0; x < width; x++) {
+        rows[0][x] = (bits >> x) & 1;
+      }
+      RleCodedImage rle(rows);
+      CheckDecode(rle.Image(), rows, (width + 7) / 8);
+      CheckRuns(rle.Image(), rows);
+    }
+  }
+
+  printf("%zu signs, ns per row\n", signs.size());
+  printf("  RLE rows, bit at a time    %6.1f\n", TimeRows(rle_images, DecodeBitwise));
+  printf("  RLE rows                   %6.1f\n", TimeRows(rle_images, [](const Signs::RleImage& img, uint16_t y, uint8_t* row) {
+    Signs::decode_rle_row_1bpp(img, y, row, kRowBytes);
+  }));
+  printf("  delta rows, each on its own %5.1f\n", TimeRows(signs, [](const Signs::RleImage& img, uint16_t y, uint8_t* row) {
+    Signs::decode_rle_row_1bpp(img, y, row, kRowBytes);
+  }));
+  Signs::RowReader* reader = nullptr;
+  printf("  delta rows, in order       %6.1f\n", TimeRows(signs, [&reader](const Signs::RleImage& img, uint16_t y, uint8_t* row) {
+    if (y == 0) {
+      delete reader;
+      reader = new Signs::RowReader(img);
+    }
+    reader->Decode(y, row, kRowBytes);
+  }));
+  delete reader;
+
+  return Result();
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "signs.h"
+
+// Pixel at a time sign codecs, the format as documented in signs.h with
+// nothing optimized, for checking the decoders against
+namespace PRNM::HostTest {
+
+// One byte per pixel, 1 = black
+using Pixels = std::vector<uint8_t>;
+
+inline uint16_t ReadRunLength(uint8_t t, const uint8_t*& p)
+{
+  uint16_t len = t & 0x7F;
+  if (len == 127) {
+    len += *p++;
+  }
+  return len;
+}
+
+// Every row of an image, pixel by pixel
+inline std::vector<Pixels> ReferenceDecode(const Signs::RleImage& img)
+{
+  std::vector<Pixels> rows(img.h, Pixels(img.w, 0));
+  const uint8_t* p = nullptr;
+  for (uint16_t stored = 0; stored < img.box_h; stored++) {
+    uint16_t y = img.box_y + stored;
+    bool keyframe = stored % img.keyframe_interval == 0;
+    if (keyframe) {
+      uint16_t off = img.row_offs[stored / img.keyframe_interval];
+      p = (off & Signs::kSharedRow) ? img.shared + (off & ~Signs::kSharedRow) : img.data + off;
+    } else if (img.codec == Signs::Codec::Delta) {
+      rows[y] = rows[y - 1];
+    }
+
+    uint16_t x = img.box_x;
+    uint16_t end = img.box_x + img.box_w;
+    while (x < end) {
+      uint8_t t = *p++;
+      if (img.codec == Signs::Codec::Delta && t == 0) {
+        break;
+      }
+      uint16_t run_end = x + ReadRunLength(t, p);
+      for (; x < run_end && x < end; x++) {
+        if (t & 0x80) {
+          rows[y][x] ^= 1;
+        }
+      }
+    }
+  }
+  return rows;
+}
+
+// A row as decode_rle_row_1bpp stores it, cut or padded to row_bytes
+inline std::vector<uint8_t> PackRow(const Pixels& row, uint16_t row_bytes)
+{
+  std::vector<uint8_t> bytes(row_bytes, 0);
+  for (size_t x = 0; x < row.size() && x < row_bytes * 8u; x++) {
+    if (row[x]) {
+      bytes[x >> 3] |= 0x80 >> (x & 7);
+    }
+  }
+  return bytes;
+}
+
+// Black runs of a row, as rle_row_black_runs finds them
+inline std::vector<Signs::RleRun> ReferenceRuns(const Pixels& row)
+{
+  std::vector<Signs::RleRun> runs;
+  for (uint16_t x = 0; x < row.size(); x++) {
+    if (row[x] && (x == 0 || !row[x - 1])) {
+      runs.push_back({x, 0});
+    }
+    if (row[x]) {
+      runs.back().len++;
+    }
+  }
+  return runs;
+}
+
+// An image RLE coded row by row, without shared rows or a box
+class RleCodedImage {
+public:
+  explicit RleCodedImage(const std::vector<Pixels>& rows)
+  {
+    for (const Pixels& row : rows) {
+      row_offs_.push_back(static_cast<uint16_t>(data_.size()));
+      size_t x = 0;
+      while (x < row.size()) {
+        size_t end = x;
+        while (end < row.size() && row[end] == row[x]) {
+          end++;
+        }
+        AppendRun(row[x], end - x);
+        x = end;
+      }
+    }
+
+    uint16_t w = rows.empty() ? 0 : rows[0].size();
+    uint16_t h = rows.size();
+    image_ = Signs::RleImage{w, h, row_offs_.data(), data_.data()};
+  }
+
+  RleCodedImage(const RleCodedImage&) = delete;
+  RleCodedImage& operator=(const RleCodedImage&) = delete;
+
+  // Row offsets only reach that far
+  bool IsValid() const { return data_.size() <= Signs::kSharedRow; }
+  const Signs::RleImage& Image() const { return image_; }
+  size_t DataLen() const { return data_.size(); }
+
+private:
+  // Tokens hold up to 126 pixels, or 127 plus the byte after
+  void AppendRun(uint8_t black, size_t len)
+  {
+    uint8_t colour = black ? 0x80 : 0x00;
+    while (len > 0) {
+      size_t n = len < 127 + 255 ? len : 127 + 255;
+      if (n >= 127) {
+        data_.push_back(colour | 127);
+        data_.push_back(n - 127);
+      } else {
+        data_.push_back(colour | n);
+      }
+      len -= n;
+    }
+  }
+
+  std::vector<uint16_t> row_offs_;
+  std::vector<uint8_t> data_;
+  Signs::RleImage image_{0, 0, nullptr, nullptr};
+};
+
+}
@@ -0,0 +1,75 @@
+// The fixed width RLE decoder against the generic one it falls back to,
+// over every sign RLE coded row by row
+#include <algorithm>
+#include <memory>
+
+#include "host_test.h"
+#include "rle_reference.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  static constexpr uint16_t kRowBytes = Signs::kWidth / 8;
+  // Rows padded past the image width take the generic path
+  static constexpr uint16_t kGenericRowBytes = kRowBytes + 1;
+
+  // Time to decode every row of every image at row_bytes, ns per row
+  double TimeRows(const std::vector<std::unique_ptr<RleCodedImage>>& images, uint16_t row_bytes)
+  {
+    static constexpr int kRounds = 10;
+    uint8_t row[kGenericRowBytes];
+    size_t rows = 0;
+    uint32_t sink = 0;
+    Stopwatch watch;
+    for (int round = 0; round < kRounds; round++) {
+      for (const auto& rle : images) {
+        const Signs::RleImage& img = rle->Image();
+        for (uint16_t y = 0; y < img.h; y++) {
+          Signs::decode_rle_row_1bpp(img, y, row, row_bytes);
+          sink += row[y % kRowBytes];
+        }
+        rows += img.h;
+      }
+    }
+    double ns = watch.ElapsedNs() / rows;
+    // Keep the decodes from being optimized out
+    CHECK(sink != 1u << 31);
+    return ns;
+  }
+}
+
+int main()
+{
+  Signs::SignPack pack;
+  CHECK(OpenSigns(&pack));
+
+  std::vector<std::unique_ptr<RleCodedImage>> images;
+  for (size_t i = 0; i < pack.Count(); i++) {
+    images.push_back(std::make_unique<RleCodedImage>(ReferenceDecode(*pack.Get(i))));
+    const Signs::RleImage& img = images.back()->Image();
+    CHECK(img.w == Signs::kWidth && images.back()->IsValid());
+
+    // Both paths give the same rows
+    uint8_t fixed[kRowBytes];
+    uint8_t generic[kGenericRowBytes];
+    for (uint16_t y = 0; y < img.h; y++) {
+      Signs::decode_rle_row_1bpp(img, y, fixed, sizeof(fixed));
+      Signs::decode_rle_row_1bpp(img, y, generic, sizeof(generic));
+      CHECK(memcmp(fixed, generic, sizeof(fixed)) == 0 && generic[kRowBytes] == 0);
+    }
+  }
+
+  // Best of a few alternating runs, the host is noisy
+  double fixed_ns = 1e9;
+  double generic_ns = 1e9;
+  for (int run = 0; run < 5; run++) {
+    fixed_ns = std::min(fixed_ns, TimeRows(images, kRowBytes));
+    generic_ns = std::min(generic_ns, TimeRows(images, kGenericRowBytes));
+  }
+  printf("%zu signs RLE coded, ns per row\n", images.size());
+  printf("  generic width  %6.1f\n", generic_ns);
+  printf("  fixed width    %6.1f  (%.2fx)\n", fixed_ns, generic_ns / fixed_ns);
+
+  return Result();
+}
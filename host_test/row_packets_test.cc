@@ -0,0 +1,144 @@
+// Row packets and bytes sent for every sign, against sending every row
+// as a full bitmap row
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "fake_printer.h"
+#include "host_test.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  // Row number, 3 bit counts, repeat and the bitmap, framed
+  static constexpr size_t kBitmapRowPacket = 6 + FakePrinter::kRowBytes + 7;
+
+  struct Totals {
+    size_t packets = 0;
+    size_t bytes = 0;
+    size_t writes = 0;
+  };
+
+  // Print image and check every row came out as decoded
+  void PrintSign(NiimbotPrinter& printer, FakePrinter& fake, const Signs::RleImage& image, Totals* totals)
+  {
+    fake.Clear();
+    CHECK_EQ(printer.Print(image), ESP_OK);
+
+    std::vector<FakePrinter::Row> rows;
+    CHECK(fake.Render(image.h, &rows));
+    for (uint16_t y = 0; y < image.h; y++) {
+      FakePrinter::Row expected = {};
+      Signs::decode_rle_row_1bpp(image, y, expected.data(), expected.size());
+      CHECK(rows[y] == expected);
+    }
+
+    totals->packets += fake.RowPackets();
+    totals->bytes += fake.RowBytes();
+    totals->writes += fake.Writes();
+  }
+
+  // Same row packets in the same order
+  void CheckSamePackets(const std::vector<FakePrinter::Packet>& packets,
+                        const std::vector<FakePrinter::Packet>& expected)
+  {
+    CHECK_EQ(packets.size(), expected.size());
+    for (size_t k = 0; k < packets.size() && k < expected.size(); k++) {
+      CHECK(packets[k].type == expected[k].type && packets[k].data == expected[k].data);
+    }
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_ERROR);
+
+  Signs::SignPack pack;
+  CHECK(OpenSigns(&pack));
+  Signs::SignPack packet_pack;
+  CHECK(OpenPacketSigns(&packet_pack));
+  CHECK_EQ(packet_pack.Count(), pack.Count());
+
+  NiimbotPrinter printer;
+  FakePrinter fake(printer);
+  CHECK(printer.IsReady());
+
+  Totals before;
+  Totals stored;
+  Totals prefetched;
+  Totals prefetched_plans;
+  Totals planned;
+  Totals encoded;
+  // Every sign without plan or packets. The prefetch cache knows images
+  // by address, so each keeps its own.
+  std::vector<Signs::RleImage> bare_images;
+  for (size_t i = 0; i < pack.Count(); i++) {
+    bare_images.push_back(*pack.Get(i));
+    bare_images.back().plan = nullptr;
+    bare_images.back().packets = nullptr;
+    bare_images.back().packets_len = 0;
+  }
+
+  for (size_t i = 0; i < pack.Count() && i < packet_pack.Count(); i++) {
+    const Signs::RleImage& image = *pack.Get(i);
+    before.packets += image.h;
+    before.bytes += image.h * kBitmapRowPacket;
+
+    // Rows encoded while printing, the plans gen.py wrote and the
+    // packets it stored all send the same packets
+    const Signs::RleImage& bare = bare_images[i];
+    PrintSign(printer, fake, bare, &encoded);
+    std::vector<FakePrinter::Packet> encoded_packets = fake.Packets();
+
+    CHECK(image.plan != nullptr);
+    PrintSign(printer, fake, image, &planned);
+    CheckSamePackets(fake.Packets(), encoded_packets);
+
+    const Signs::RleImage& with_packets = *packet_pack.Get(i);
+    CHECK(with_packets.packets != nullptr);
+    CHECK(with_packets.w == image.w && with_packets.h == image.h);
+    PrintSign(printer, fake, with_packets, &stored);
+    CheckSamePackets(fake.Packets(), encoded_packets);
+
+    // Rows encoded or planned ahead of time, then streamed from the
+    // cache
+    const std::pair<const Signs::RleImage*, Totals*> ahead_of_time[] = {
+      {&bare, &prefetched},
+      {&image, &prefetched_plans},
+    };
+    for (const auto& [ahead, totals] : ahead_of_time) {
+      NiimbotPrinter::PrefetchStats before_prefetch = printer.GetPrefetchStats();
+      CHECK_EQ(printer.Prefetch(*ahead), ESP_OK);
+      PrintSign(printer, fake, *ahead, totals);
+      CheckSamePackets(fake.Packets(), encoded_packets);
+      CHECK_EQ(printer.GetPrefetchStats().hits, before_prefetch.hits + 1);
+      CHECK_EQ(printer.GetPrefetchStats().misses, before_prefetch.misses);
+    }
+  }
+
+  // At the default MTU, before one is negotiated or when the exchange
+  // failed, bitmap rows don't fit a write without response
+  Totals small_writes;
+  fake.SetWriteSize(TxAggregator::kDefaultWriteSize);
+  for (size_t i = 0; i < pack.Count(); i++) {
+    PrintSign(printer, fake, *pack.Get(i), &small_writes);
+    CHECK_EQ(fake.OversizedWrites(), 0);
+  }
+
+  printf("%zu signs, row packets and bytes\n", pack.Count());
+  printf("  every row a bitmap  %6zu packets %8zu bytes\n", before.packets, before.bytes);
+  printf("  encoded rows        %6zu packets %8zu bytes %6zu writes\n", encoded.packets, encoded.bytes, encoded.writes);
+  printf("  planned rows        %6zu packets %8zu bytes %6zu writes\n", planned.packets, planned.bytes, planned.writes);
+  printf("  prefetched rows     %6zu packets %8zu bytes %6zu writes\n", prefetched.packets, prefetched.bytes,
+         prefetched.writes);
+  printf("  prefetched plans    %6zu packets %8zu bytes %6zu writes\n", prefetched_plans.packets,
+         prefetched_plans.bytes, prefetched_plans.writes);
+  printf("  stored packets      %6zu packets %8zu bytes %6zu writes\n", stored.packets, stored.bytes, stored.writes);
+  printf("  20 byte writes      %6zu packets %8zu bytes %6zu writes\n", small_writes.packets, small_writes.bytes,
+         small_writes.writes);
+  CHECK(encoded.packets < before.packets);
+  CHECK(encoded.bytes < before.bytes);
+
+  return Result();
+}
@@ -0,0 +1,275 @@
+// Sign packs: the generated one against the compiled in signs, and
+// corrupt packs the loader has to turn down
+#include <map>
+
+#include "fake_printer.h"
+#include "host_test.h"
+#include "rle_reference.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  // A one sign pack laid out as gen.py's write_pack() does
+  struct TestPack {
+    static constexpr size_t kHeaderLen = 24;
+    static constexpr size_t kEntryLen = 44;
+    static constexpr uint16_t kRows = 4;
+
+    std::vector<Pixels> rows = std::vector<Pixels>(kRows, Pixels(Signs::kWidth, 0));
+    std::vector<uint8_t> plan;
+    std::vector<uint8_t> packets;
+
+    TestPack()
+    {
+      // An empty row, two identical indexed rows and a bitmap row
+      rows[1][7] = rows[2][7] = 1;
+      for (uint16_t x = 0; x < 100; x++) {
+        rows[3][x] = 1;
+      }
+      plan = {0x01, 0x42, 0x81, 100, 0, 0};
+      AppendPacket(0x84, {0, 0, 1});
+      AppendPacket(0x83, {0, 1, 1, 0, 0, 2, 0, 7});
+      std::vector<uint8_t> bitmap = {0, 3, 100, 0, 0, 1};
+      for (uint16_t x = 0; x < Signs::kWidth; x += 8) {
+        bitmap.push_back(x + 8 <= 100 ? 0xFF : x < 100 ? 0xF0 : 0x00);
+      }
+      AppendPacket(0x85, bitmap);
+    }
+
+    void AppendPacket(uint8_t type, const std::vector<uint8_t>& data)
+    {
+      uint8_t buf[UINT8_MAX + 7];
+      size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), type, data.data(), data.size());
+      packets.insert(packets.end(), buf, buf + len);
+    }
+
+    std::vector<uint8_t> Build() const
+    {
+      RleCodedImage rle(rows);
+      const Signs::RleImage& img = rle.Image();
+      std::vector<uint8_t> pack(kHeaderLen + kEntryLen);
+      auto add = [&pack](const uint8_t* data, size_t len) {
+        pack.resize((pack.size() + 3) & ~size_t{3});
+        uint32_t off = pack.size();
+        pack.insert(pack.end(), data, data + len);
+        return off;
+      };
+      uint32_t row_offs_off = add(reinterpret_cast<const uint8_t*>(img.row_offs), img.h * sizeof(uint16_t));
+      uint32_t data_off = add(img.data, rle.DataLen());
+      uint32_t plan_off = plan.empty() ? 0 : add(plan.data(), plan.size());
+      uint32_t packets_off = packets.empty() ? 0 : add(packets.data(), packets.size());
+
+      auto put16 = [&pack](size_t at, uint16_t value) { memcpy(&pack[at], &value, sizeof(value)); };
+      auto put32 = [&pack](size_t at, uint32_t value) { memcpy(&pack[at], &value, sizeof(value)); };
+      memcpy(&pack[0], "PRNS", 4);
+      put16(4, 1);
+      put16(6, 1);
+      put16(8, Signs::kWidth);
+      put16(10, Signs::kHeight);
+      put32(12, kHeaderLen + kEntryLen);
+      put32(16, 0);
+      put32(20, pack.size());
+
+      size_t e = kHeaderLen;
+      put16(e, img.w);
+      put16(e + 2, img.h);
+      pack[e + 4] = static_cast<uint8_t>(Signs::Codec::Rle);
+      pack[e + 5] = 1;
+      put16(e + 6, img.h);
+      put16(e + 8, 0);
+      put16(e + 10, 0);
+      put16(e + 12, img.w);
+      put16(e + 14, img.h);
+      put32(e + 16, row_offs_off);
+      put32(e + 20, data_off);
+      put32(e + 24, rle.DataLen());
+      put32(e + 28, plan_off);
+      put32(e + 32, plan.size());
+      put32(e + 36, packets_off);
+      put32(e + 40, packets.size());
+      return pack;
+    }
+  };
+
+  esp_err_t Load(const std::vector<uint8_t>& pack)
+  {
+    Signs::SignPack loader;
+    return loader.Load(pack.data(), pack.size());
+  }
+
+  // Pixels of an image, to match signs regardless of how they're stored
+  std::vector<Pixels> Key(const Signs::RleImage& img)
+  {
+    return ReferenceDecode(img);
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_NONE);
+
+  // The generated pack holds the compiled in signs
+  {
+    Signs::SignPack pack;
+    CHECK(OpenSigns(&pack));
+    std::map<std::vector<Pixels>, int> signs;
+    for (size_t i = 0; i < pack.Count(); i++) {
+      signs[Key(*pack.Get(i))]++;
+    }
+    // The first round of Next() visits every sign once
+    for (size_t i = 0; i < pack.Count(); i++) {
+      const Signs::RleImage* img = Signs::Next();
+      CHECK(img && --signs[Key(*img)] == 0);
+    }
+
+    Signs::SignPack missing;
+    CHECK_EQ(missing.Open("no_such_pack.bin"), ESP_ERR_NOT_FOUND);
+  }
+
+  // A pack as gen.py writes it loads and prints, with the packets and
+  // with rows encoded from the plan
+  for (bool packets : {true, false}) {
+    TestPack test;
+    if (!packets) {
+      test.packets.clear();
+    }
+    std::vector<uint8_t> data = test.Build();
+    Signs::SignPack pack;
+    CHECK_EQ(pack.Load(data.data(), data.size()), ESP_OK);
+    CHECK_EQ(pack.Count(), 1);
+    CHECK((pack.Get(0)->packets != nullptr) == packets);
+
+    NiimbotPrinter printer;
+    FakePrinter fake(printer);
+    CHECK_EQ(printer.Print(*pack.Get(0)), ESP_OK);
+    std::vector<FakePrinter::Row> rows;
+    CHECK(fake.Render(TestPack::kRows, &rows));
+    CHECK_EQ(fake.RowPackets(), 3);
+    for (uint16_t y = 0; y < TestPack::kRows; y++) {
+      CHECK(std::vector<uint8_t>(rows[y].begin(), rows[y].end()) == PackRow(test.rows[y], rows[y].size()));
+    }
+
+    // A failed load keeps the signs loaded before
+    CHECK(pack.Load(data.data(), 10) != ESP_OK);
+    CHECK_EQ(pack.Count(), 1);
+  }
+
+  // Corrupt headers and entries
+  {
+    const std::vector<uint8_t> good = TestPack().Build();
+    std::vector<uint8_t> pack = good;
+    pack[0] = 'X';
+    CHECK_EQ(Load(pack), ESP_ERR_NOT_FOUND);
+
+    pack = good;
+    pack[4] = 2;
+    CHECK_EQ(Load(pack), ESP_ERR_INVALID_VERSION);
+
+    pack = good;
+    pack.pop_back();
+    CHECK_EQ(Load(pack), ESP_ERR_INVALID_SIZE);
+
+    // A row offset past the row data
+    pack = good;
+    uint32_t row_offs_off = 0;
+    memcpy(&row_offs_off, &pack[TestPack::kHeaderLen + 16], 4);
+    pack[row_offs_off] = 0xF0;
+    CHECK_EQ(Load(pack), ESP_ERR_INVALID_SIZE);
+
+    // The box past the image
+    pack = good;
+    pack[TestPack::kHeaderLen + 8] = 1;
+    CHECK_EQ(Load(pack), ESP_ERR_INVALID_SIZE);
+  }
+
+  // Corrupt plans
+  {
+    const std::vector<std::vector<uint8_t>> plans = {
+      // A step of 0 rows, written as the escape then 0
+      {0x00, 0x00, 0x01, 0x42, 0x81, 100, 0, 0},
+      // Escape cut off
+      {0x01, 0x42, 0x81, 100, 0, 0, 0x00},
+      // Bit counts cut off
+      {0x01, 0x42, 0x81, 100, 0},
+      // A row short, and a row over
+      {0x01, 0x42},
+      {0x01, 0x42, 0x82, 100, 0, 0},
+      // No such kind
+      {0x01, 0x42, 0xC1},
+    };
+    for (const std::vector<uint8_t>& plan : plans) {
+      TestPack test;
+      test.packets.clear();
+      test.plan = plan;
+      CHECK_EQ(Load(test.Build()), ESP_ERR_INVALID_SIZE);
+    }
+
+    // A plan the loader would turn down stops the reader instead of
+    // looping on no rows
+    TestPack test;
+    RleCodedImage rle(test.rows);
+    Signs::RleImage img = rle.Image();
+    img.plan = plans[0].data();
+    Signs::PlanReader reader(img);
+    Signs::PlanStep step;
+    CHECK(!reader.Next(&step));
+
+    // A row planned as indexed that has too many runs for it still
+    // prints right
+    std::vector<Pixels> sparse(1, Pixels(Signs::kWidth, 0));
+    for (uint16_t x = 0; x < Signs::kWidth; x += 4) {
+      sparse[0][x] = 1;
+    }
+    RleCodedImage sparse_rle(sparse);
+    Signs::RleImage sparse_img = sparse_rle.Image();
+    static constexpr uint8_t kWrongKind[] = {0x41};
+    sparse_img.plan = kWrongKind;
+    NiimbotPrinter printer;
+    FakePrinter fake(printer);
+    CHECK_EQ(printer.Print(sparse_img), ESP_OK);
+    std::vector<FakePrinter::Row> rows;
+    CHECK(fake.Render(1, &rows));
+    CHECK(std::vector<uint8_t>(rows[0].begin(), rows[0].end()) == PackRow(sparse[0], rows[0].size()));
+  }
+
+  // Corrupt packet streams
+  {
+    const std::vector<uint8_t> good = TestPack().packets;
+    std::vector<std::vector<uint8_t>> streams;
+    // Cut short, by a packet's length and by a few bytes
+    streams.push_back(std::vector<uint8_t>(good.begin(), good.end() - 1));
+    streams.push_back(good);
+    streams.back().insert(streams.back().end(), {0x55, 0x55, 0x84});
+    // Length past the end
+    streams.push_back(good);
+    streams.back()[3] = 200;
+    // Not a row packet
+    streams.push_back(good);
+    streams.back()[2] = 0x01;
+    // No end markers
+    streams.push_back(good);
+    streams.back()[good[3] + 6] = 0x00;
+    // Not starting on a packet
+    streams.push_back(good);
+    streams.back()[0] = 0x00;
+    for (const std::vector<uint8_t>& packets : streams) {
+      TestPack test;
+      test.packets = packets;
+      CHECK_EQ(Load(test.Build()), ESP_ERR_INVALID_SIZE);
+    }
+
+    // The printer doesn't read past a stream cut short either
+    TestPack test;
+    RleCodedImage rle(test.rows);
+    Signs::RleImage img = rle.Image();
+    img.packets = streams[0].data();
+    img.packets_len = streams[0].size();
+    NiimbotPrinter printer;
+    FakePrinter fake(printer);
+    CHECK_EQ(printer.Print(img), ESP_ERR_INVALID_SIZE);
+    CHECK_EQ(fake.RowPackets(), 2);
+  }
+
+  return Result();
+}
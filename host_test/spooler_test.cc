@@ -0,0 +1,171 @@
+// Throughput of back-to-back print jobs, printed one at a time and
+// through the spooler, and job states along the way
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "fake_printer.h"
+#include "host_test.h"
+#include "spooler.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  static constexpr size_t kJobs = 8;
+
+  // A slow enough link that session setup shows
+  static constexpr LinkTiming kTiming = {5, 300};
+
+  using JobState = PrintSpooler::JobState;
+
+  // States every job went through
+  class JobLog {
+  public:
+    void Record(const PrintSpooler::JobInfo& job)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      states_[job.id].push_back(job.state);
+      if (job.state != JobState::Queued && job.state != JobState::Sending) {
+        finished_++;
+      }
+    }
+
+    size_t Finished() const { return finished_; }
+
+    std::vector<JobState> States(PrintSpooler::JobId id)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return states_[id];
+    }
+
+    bool WaitFinished(size_t count, int timeout_ms) const
+    {
+      Stopwatch watch;
+      while (finished_ < count && watch.ElapsedMs() < timeout_ms) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      return finished_ >= count;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::map<PrintSpooler::JobId, std::vector<JobState>> states_;
+    std::atomic<size_t> finished_{0};
+  };
+
+  size_t CountPackets(const FakePrinter& fake, NiimbotPrinter::RequestCode request)
+  {
+    size_t count = 0;
+    for (const FakePrinter::Packet& packet : fake.Packets()) {
+      count += packet.type == static_cast<uint8_t>(request);
+    }
+    return count;
+  }
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_ERROR);
+
+  // One print session per job, as the main loop used to print
+  {
+    NiimbotPrinter printer;
+    FakePrinter fake(printer, kTiming);
+    Stopwatch watch;
+    for (size_t i = 0; i < kJobs; i++) {
+      CHECK_EQ(printer.Print(*Signs::Next()), ESP_OK);
+    }
+    double ms = watch.ElapsedMs();
+    printf("one at a time  %zu jobs %6.0f ms %5.1f labels/min, %zu sessions\n", kJobs, ms, kJobs * 60000.0 / ms,
+           CountPackets(fake, NiimbotPrinter::RequestCode::START_PRINT));
+  }
+
+  // The spooler task runs forever, so its printer and fake outlive main
+  NiimbotPrinter& printer = *new NiimbotPrinter;
+  std::atomic<size_t>& heartbeats = *new std::atomic<size_t>(0);
+  printer.SubscribeStatus([&heartbeats](const NiimbotPrinter::Status&) { heartbeats++; });
+  FakePrinter& fake = *new FakePrinter(printer, kTiming);
+  PrintSpooler& spooler = *new PrintSpooler(printer);
+  JobLog& log = *new JobLog;
+  spooler.SetJobCallback([&log](const PrintSpooler::JobInfo& job) { log.Record(job); });
+  CHECK_EQ(spooler.Start(), ESP_OK);
+
+  // Jobs submitted as fast as the queue takes them
+  {
+    std::vector<PrintSpooler::JobId> ids;
+    Stopwatch watch;
+    while (ids.size() < kJobs) {
+      PrintSpooler::JobId id;
+      esp_err_t err = spooler.Submit(nullptr, 1, &id);
+      if (err == ESP_ERR_NO_MEM) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        continue;
+      }
+      CHECK_EQ(err, ESP_OK);
+      ids.push_back(id);
+    }
+    CHECK(log.WaitFinished(kJobs, 30000));
+    double ms = watch.ElapsedMs();
+    printf("spooler        %zu jobs %6.0f ms %5.1f labels/min, %zu sessions\n", kJobs, ms, kJobs * 60000.0 / ms,
+           CountPackets(fake, NiimbotPrinter::RequestCode::START_PRINT));
+
+    for (PrintSpooler::JobId id : ids) {
+      CHECK(log.States(id) == std::vector<JobState>({JobState::Queued, JobState::Sending, JobState::Done}));
+    }
+    CHECK_EQ(CountPackets(fake, NiimbotPrinter::RequestCode::END_PAGE_PRINT), kJobs);
+    CHECK_EQ(spooler.Pending(), 0);
+  }
+
+  // A job cancelled while queued behind a printing one
+  {
+    size_t finished = log.Finished();
+    PrintSpooler::JobId printing;
+    PrintSpooler::JobId queued;
+    CHECK_EQ(spooler.Submit(nullptr, 1, &printing), ESP_OK);
+    while (log.States(printing).size() < 2) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK_EQ(spooler.Submit(nullptr, 1, &queued), ESP_OK);
+    CHECK_EQ(spooler.Cancel(queued), ESP_OK);
+    CHECK(log.WaitFinished(finished + 2, 10000));
+
+    CHECK(log.States(printing) == std::vector<JobState>({JobState::Queued, JobState::Sending, JobState::Done}));
+    CHECK(log.States(queued) == std::vector<JobState>({JobState::Queued, JobState::Cancelled}));
+    CHECK_EQ(spooler.Pending(), 0);
+  }
+
+  // Heartbeats requested without waiting on the printer, as on connect,
+  // go out from the spooler task, while idle or between jobs
+  {
+    auto wait_heartbeats = [&heartbeats](size_t count) {
+      Stopwatch watch;
+      while (heartbeats < count && watch.ElapsedMs() < 2000) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      return heartbeats >= count;
+    };
+
+    size_t before = heartbeats;
+    CHECK_EQ(spooler.RequestHeartbeat(), ESP_OK);
+    CHECK(wait_heartbeats(before + 1));
+
+    // Requests made before the spooler gets to them are sent once
+    size_t finished = log.Finished();
+    PrintSpooler::JobId printing;
+    CHECK_EQ(spooler.Submit(nullptr, 1, &printing), ESP_OK);
+    before = heartbeats;
+    CHECK_EQ(spooler.RequestHeartbeat(), ESP_OK);
+    CHECK_EQ(spooler.RequestHeartbeat(), ESP_OK);
+    CHECK(log.WaitFinished(finished + 1, 10000));
+    CHECK(wait_heartbeats(before + 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK_EQ(heartbeats, before + 1);
+    CHECK(log.States(printing) == std::vector<JobState>({JobState::Queued, JobState::Sending, JobState::Done}));
+    CHECK_EQ(spooler.Pending(), 0);
+  }
+
+  return Result();
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+inline void* heap_caps_malloc(size_t size, uint32_t) { return malloc(size); }
+inline void heap_caps_free(void* ptr) { free(ptr); }
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdio>
+
+typedef enum {
+  ESP_LOG_NONE,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+// One level for every tag, warnings by default
+extern esp_log_level_t g_esp_log_level;
+
+inline void esp_log_level_set(const char*, esp_log_level_t level) { g_esp_log_level = level; }
+
+#define ESP_LOG_LEVEL(level, letter, tag, format, ...) do {                    \
+    if (g_esp_log_level >= (level)) {                                           \
+      fprintf(stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__);         \
+    }                                                                           \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#define ESP_LOG_BUFFER_HEX_LEVEL(tag, buffer, len, level) do { (void)(buffer); (void)(len); } while (0)
+#define ESP_LOG_BUFFER_HEX(tag, buffer, len) ESP_LOG_BUFFER_HEX_LEVEL(tag, buffer, len, ESP_LOG_INFO)
@@ -0,0 +1,127 @@
+// esp_err, esp_log and esp_timer for the host
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+esp_log_level_t g_esp_log_level = ESP_LOG_WARN;
+
+const char* esp_err_to_name(esp_err_t code)
+{
+  switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_INVALID_VERSION: return "ESP_ERR_INVALID_VERSION";
+    case ESP_ERR_INVALID_MAC: return "ESP_ERR_INVALID_MAC";
+    case ESP_ERR_NOT_FINISHED: return "ESP_ERR_NOT_FINISHED";
+    case ESP_ERR_NOT_ALLOWED: return "ESP_ERR_NOT_ALLOWED";
+    default: return "UNKNOWN ERROR";
+  }
+}
+
+struct esp_timer {
+  esp_timer_create_args_t args;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool armed = false;
+  bool deleted = false;
+  int64_t due_us = 0;
+  uint64_t period_us = 0;
+  std::thread thread;
+};
+
+namespace {
+  void TimerTask(esp_timer_handle_t timer)
+  {
+    std::unique_lock<std::mutex> lock(timer->mutex);
+    while (!timer->deleted) {
+      if (!timer->armed) {
+        timer->cv.wait(lock);
+        continue;
+      }
+      int64_t now = esp_timer_get_time();
+      if (now < timer->due_us) {
+        timer->cv.wait_for(lock, std::chrono::microseconds(timer->due_us - now));
+        continue;
+      }
+      if (timer->period_us > 0) {
+        timer->due_us += timer->period_us;
+      } else {
+        timer->armed = false;
+      }
+
+      // Unlocked so the callback can restart or stop the timer
+      lock.unlock();
+      timer->args.callback(timer->args.arg);
+      lock.lock();
+    }
+  }
+
+  esp_err_t Start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us)
+  {
+    std::lock_guard<std::mutex> lock(timer->mutex);
+    timer->armed = true;
+    timer->due_us = esp_timer_get_time() + timeout_us;
+    timer->period_us = period_us;
+    timer->cv.notify_all();
+    return ESP_OK;
+  }
+}
+
+int64_t esp_timer_get_time()
+{
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* out_handle)
+{
+  esp_timer_handle_t timer = new esp_timer;
+  timer->args = *args;
+  timer->thread = std::thread(TimerTask, timer);
+  *out_handle = timer;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+  return Start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+  return Start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+  std::lock_guard<std::mutex> lock(timer->mutex);
+  timer->armed = false;
+  timer->cv.notify_all();
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+  {
+    std::lock_guard<std::mutex> lock(timer->mutex);
+    timer->deleted = true;
+    timer->cv.notify_all();
+  }
+  timer->thread.join();
+  delete timer;
+  return ESP_OK;
+}
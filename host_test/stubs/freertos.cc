@@ -0,0 +1,199 @@
+// FreeRTOS primitives on std::thread, enough for the printer and spooler
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct SemaphoreDefinition {
+  std::mutex mutex;
+  std::condition_variable cv;
+  UBaseType_t count;
+  UBaseType_t max_count;
+};
+
+struct QueueDefinition {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::vector<uint8_t>> items;
+  UBaseType_t length;
+  UBaseType_t item_size;
+};
+
+struct EventGroupDef_t {
+  std::mutex mutex;
+  std::condition_variable cv;
+  EventBits_t bits = 0;
+};
+
+namespace {
+  // Wait on cv until ready holds, false when the ticks ran out first
+  template <typename Predicate>
+  bool WaitFor(std::unique_lock<std::mutex>& lock, std::condition_variable& cv, TickType_t ticks,
+               Predicate ready)
+  {
+    if (ticks == portMAX_DELAY) {
+      cv.wait(lock, ready);
+      return true;
+    }
+    return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+  }
+
+  SemaphoreHandle_t CreateSemaphore(UBaseType_t max_count, UBaseType_t initial_count)
+  {
+    SemaphoreHandle_t semaphore = new SemaphoreDefinition;
+    semaphore->count = initial_count;
+    semaphore->max_count = max_count;
+    return semaphore;
+  }
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char*, uint32_t, void* param, UBaseType_t,
+                       TaskHandle_t* handle)
+{
+  std::thread(task, param).detach();
+  if (handle) {
+    *handle = reinterpret_cast<TaskHandle_t>(1);
+  }
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t)
+{
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount()
+{
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return static_cast<TickType_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return CreateSemaphore(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+  return CreateSemaphore(max_count, initial_count);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return CreateSemaphore(1, 1);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+  delete semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+  std::unique_lock<std::mutex> lock(semaphore->mutex);
+  if (!WaitFor(lock, semaphore->cv, ticks_to_wait, [&] { return semaphore->count > 0; })) {
+    return pdFALSE;
+  }
+  semaphore->count--;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  std::lock_guard<std::mutex> lock(semaphore->mutex);
+  if (semaphore->count >= semaphore->max_count) {
+    return pdFALSE;
+  }
+  semaphore->count++;
+  semaphore->cv.notify_all();
+  return pdTRUE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+  QueueHandle_t queue = new QueueDefinition;
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+  delete queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks_to_wait)
+{
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!WaitFor(lock, queue->cv, ticks_to_wait, [&] { return queue->items.size() < queue->length; })) {
+    return pdFALSE;
+  }
+  const uint8_t* bytes = static_cast<const uint8_t*>(item);
+  queue->items.emplace_back(bytes, bytes + queue->item_size);
+  queue->cv.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks_to_wait)
+{
+  std::unique_lock<std::mutex> lock(queue->mutex);
+  if (!WaitFor(lock, queue->cv, ticks_to_wait, [&] { return !queue->items.empty(); })) {
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->item_size);
+  queue->items.pop_front();
+  queue->cv.notify_all();
+  return pdTRUE;
+}
+
+EventGroupHandle_t xEventGroupCreate()
+{
+  return new EventGroupDef_t;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+  delete group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  std::lock_guard<std::mutex> lock(group->mutex);
+  group->bits |= bits;
+  group->cv.notify_all();
+  return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  std::lock_guard<std::mutex> lock(group->mutex);
+  EventBits_t previous = group->bits;
+  group->bits &= ~bits;
+  return previous;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks_to_wait)
+{
+  std::unique_lock<std::mutex> lock(group->mutex);
+  auto ready = [&] { return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0; };
+  bool set = WaitFor(lock, group->cv, ticks_to_wait, ready);
+  EventBits_t result = group->bits;
+  if (set && clear_on_exit) {
+    group->bits &= ~bits;
+  }
+  return result;
+}
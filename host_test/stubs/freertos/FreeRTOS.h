@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Ticks are milliseconds
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+
+#define portMAX_DELAY 0xFFFFFFFFu
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) (static_cast<TickType_t>(ms))
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+// Tasks are detached threads, deleting one only forgets its handle
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* param);
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char* name, uint32_t stack_depth, void* param,
+                       UBaseType_t priority, TaskHandle_t* handle);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
@@ -0,0 +1,12 @@
+#pragma once
+
+// Kconfig defaults of main/Kconfig.projbuild the host build runs with
+#define CONFIG_PRNM_BT_MTU 200
+#define CONFIG_PRNM_PRINTER_PING_MS 600000
+#define CONFIG_PRNM_PRINT_STREAM_ROWS 1
+#define CONFIG_PRNM_PRINT_STREAM_WINDOW 8
+#define CONFIG_PRNM_PRINT_STREAM_CHECKPOINT 32
+#define CONFIG_PRNM_PRINT_QUEUE_LEN 4
+#define CONFIG_PRNM_PRINT_BATCH_MS 0
+#define CONFIG_PRNM_PRINT_PREFETCH 1
+#define CONFIG_PRNM_SIGNS_PARTITION_LABEL "signs"
@@ -0,0 +1,211 @@
+// Transactions matching printer replies to the commands waiting for them
+#include <functional>
+#include <vector>
+
+#include "host_test.h"
+#include "printer.h"
+
+using namespace PRNM;
+using namespace PRNM::HostTest;
+
+namespace {
+  using Transaction = NiimbotPrinter::Transaction;
+  using Response = NiimbotPrinter::Response;
+
+  static constexpr TickType_t kTimeout = pdMS_TO_TICKS(1000);
+  static constexpr TickType_t kShortTimeout = pdMS_TO_TICKS(50);
+
+  static constexpr uint8_t kDensityReply = 0x31;
+  static constexpr uint8_t kLabelTypeReply = 0x33;
+  static constexpr uint8_t kPrintStatusReply = 0xB3;
+  static constexpr uint8_t kBatteryReply = 0x4A;
+  static constexpr uint8_t kPrinterError = 0xDB;
+
+  // Writes complete at once, replies are fed in by the test
+  class Link {
+  public:
+    explicit Link(NiimbotPrinter& printer) : printer_(printer)
+    {
+      printer_.SetSendCallback([this](const uint8_t* data, size_t len, bool) {
+        for (size_t off = 0; off + 7 <= len; off += data[off + 3] + 7) {
+          sent_.push_back(data[off + 2]);
+        }
+        if (before_ack_) {
+          before_ack_();
+        }
+        printer_.OnWriteComplete();
+        return ESP_OK;
+      });
+    }
+
+    void Reply(uint8_t type, const std::vector<uint8_t>& data)
+    {
+      uint8_t buf[UINT8_MAX + 7];
+      size_t len = NiimbotPrinter::BuildPacket(buf, sizeof(buf), type, data.data(), data.size());
+      printer_.ProcessReceivedData(buf, len);
+    }
+
+    // Runs while a write is being sent, before it is acknowledged
+    void BeforeAck(std::function<void()> callback) { before_ack_ = std::move(callback); }
+
+    const std::vector<uint8_t>& Sent() const { return sent_; }
+
+  private:
+    NiimbotPrinter& printer_;
+    std::vector<uint8_t> sent_;
+    std::function<void()> before_ack_;
+  };
+}
+
+int main()
+{
+  esp_log_level_set("*", ESP_LOG_NONE);
+
+  NiimbotPrinter printer;
+  Link link(printer);
+
+  // Replies arriving in reverse order reach the transaction expecting
+  // their type
+  {
+    Transaction density;
+    Transaction label_type;
+    Transaction status;
+    Transaction battery;
+    CHECK_EQ(printer.SetLabelDensity(3, &density), ESP_OK);
+    CHECK_EQ(printer.SetLabelType(1, &label_type), ESP_OK);
+    CHECK_EQ(printer.GetPrintStatus(&status), ESP_OK);
+    CHECK_EQ(printer.GetDeviceInfo(NiimbotPrinter::InfoKey::BATTERY, &battery), ESP_OK);
+
+    link.Reply(kBatteryReply, {87});
+    link.Reply(kPrintStatusReply, {0, 1, 100, 100, 0, 0, 0, 0, 0, 0});
+    link.Reply(kLabelTypeReply, {0});
+    link.Reply(kDensityReply, {1});
+
+    Response response;
+    CHECK_EQ(printer.Wait(density, kTimeout, &response), ESP_OK);
+    CHECK_EQ(response.type, kDensityReply);
+    CHECK(response.Succeeded());
+    CHECK_EQ(printer.Wait(label_type, kTimeout, &response), ESP_OK);
+    CHECK_EQ(response.type, kLabelTypeReply);
+    CHECK(!response.Succeeded());
+    CHECK_EQ(printer.Wait(status, kTimeout, &response), ESP_OK);
+    CHECK_EQ(response.type, kPrintStatusReply);
+    CHECK_EQ(response.len, 10);
+    CHECK_EQ(response.data[1], 1);
+    CHECK_EQ(printer.Wait(battery, kTimeout, &response), ESP_OK);
+    CHECK_EQ(response.type, kBatteryReply);
+    CHECK_EQ(response.data[0], 87);
+
+    // A finished transaction can't be waited on twice
+    CHECK_EQ(printer.Wait(density, kShortTimeout), ESP_ERR_INVALID_STATE);
+  }
+
+  // Two transactions of one type take their replies oldest first
+  {
+    Transaction first;
+    Transaction second;
+    CHECK_EQ(printer.GetPrintStatus(&first), ESP_OK);
+    CHECK_EQ(printer.GetPrintStatus(&second), ESP_OK);
+    link.Reply(kPrintStatusReply, {0, 1, 50, 0});
+    link.Reply(kPrintStatusReply, {0, 2, 100, 100});
+
+    Response response;
+    CHECK_EQ(printer.Wait(second, kTimeout, &response), ESP_OK);
+    CHECK_EQ(response.data[1], 2);
+    CHECK_EQ(printer.Wait(first, kTimeout, &response), ESP_OK);
+    CHECK_EQ(response.data[1], 1);
+  }
+
+  // A reply sent before the write is acknowledged isn't lost
+  {
+    link.BeforeAck([&link]() { link.Reply(kDensityReply, {1}); });
+    Transaction tx;
+    CHECK_EQ(printer.SetLabelDensity(3, &tx), ESP_OK);
+    link.BeforeAck(nullptr);
+    CHECK_EQ(printer.Wait(tx, kShortTimeout), ESP_OK);
+  }
+
+  // Printer errors don't name their command, they fail the oldest open
+  // transaction whatever it expects
+  {
+    Transaction status;
+    Transaction density;
+    CHECK_EQ(printer.GetPrintStatus(&status), ESP_OK);
+    CHECK_EQ(printer.SetLabelDensity(3, &density), ESP_OK);
+    link.Reply(kPrinterError, {0x05});
+
+    Response response;
+    CHECK_EQ(printer.Wait(status, kTimeout, &response), ESP_ERR_INVALID_RESPONSE);
+    CHECK_EQ(response.type, kPrinterError);
+    CHECK_EQ(response.data[0], 0x05);
+    CHECK_EQ(printer.Wait(density, kShortTimeout), ESP_ERR_TIMEOUT);
+  }
+
+  // Without a reply the wait times out and frees the slot
+  {
+    Transaction tx;
+    CHECK_EQ(printer.GetPrintStatus(&tx), ESP_OK);
+    Stopwatch watch;
+    CHECK_EQ(printer.Wait(tx, kShortTimeout), ESP_ERR_TIMEOUT);
+    CHECK(watch.ElapsedMs() >= kShortTimeout);
+    CHECK_EQ(printer.Wait(tx, kShortTimeout), ESP_ERR_INVALID_STATE);
+  }
+
+  // A cancelled transaction takes no reply, the next one does
+  {
+    Transaction cancelled;
+    CHECK_EQ(printer.GetPrintStatus(&cancelled), ESP_OK);
+    printer.Cancel(cancelled);
+    CHECK_EQ(printer.Wait(cancelled, kShortTimeout), ESP_ERR_INVALID_STATE);
+    link.Reply(kPrintStatusReply, {0, 1, 100, 100});
+
+    Transaction next;
+    CHECK_EQ(printer.GetPrintStatus(&next), ESP_OK);
+    CHECK_EQ(printer.Wait(next, kShortTimeout), ESP_ERR_TIMEOUT);
+  }
+
+  // Every slot taken, the next command is refused before it is sent
+  {
+    Transaction open[NiimbotPrinter::kMaxTransactions];
+    for (Transaction& tx : open) {
+      CHECK_EQ(printer.GetPrintStatus(&tx), ESP_OK);
+    }
+    size_t sent = link.Sent().size();
+    Transaction refused;
+    CHECK_EQ(printer.GetPrintStatus(&refused), ESP_ERR_NO_MEM);
+    CHECK_EQ(link.Sent().size(), sent);
+    CHECK_EQ(printer.Wait(refused, kShortTimeout), ESP_ERR_INVALID_ARG);
+
+    printer.Cancel(open[0]);
+    Transaction reused;
+    CHECK_EQ(printer.GetPrintStatus(&reused), ESP_OK);
+    CHECK_EQ(reused.slot, open[0].slot);
+    // The old handle doesn't reach the new transaction
+    printer.Cancel(open[0]);
+    CHECK_EQ(printer.Wait(open[0], kShortTimeout), ESP_ERR_INVALID_STATE);
+
+    // Replies go to the oldest open ones
+    for (size_t i = 0; i < NiimbotPrinter::kMaxTransactions; i++) {
+      link.Reply(kPrintStatusReply, {0, static_cast<uint8_t>(i), 100, 100});
+    }
+    Response response;
+    for (size_t i = 1; i < NiimbotPrinter::kMaxTransactions; i++) {
+      CHECK_EQ(printer.Wait(open[i], kTimeout, &response), ESP_OK);
+      CHECK_EQ(response.data[1], i - 1);
+    }
+    CHECK_EQ(printer.Wait(reused, kTimeout, &response), ESP_OK);
+    CHECK_EQ(response.data[1], NiimbotPrinter::kMaxTransactions - 1);
+  }
+
+  // Reset fails whatever is still waiting
+  {
+    Transaction tx;
+    CHECK_EQ(printer.GetPrintStatus(&tx), ESP_OK);
+    printer.Reset();
+    Stopwatch watch;
+    CHECK_EQ(printer.Wait(tx, kTimeout), ESP_ERR_INVALID_STATE);
+    CHECK(watch.ElapsedMs() < kTimeout);
+  }
+
+  return Result();
+}
@@ -186,12 +186,22 @@ void BLEClient::SetConnectedCallback(ConnectedCallback callback)
   connected_callback_ = std::move(callback);
 }
 
-void BLEClient::SendData(const uint8_t* data, size_t len, bool wait_for_response)
+void BLEClient::SetDisconnectedCallback(DisconnectedCallback callback)
+{
+  disconnected_callback_ = std::move(callback);
+}
+
+void BLEClient::SetCongestionCallback(CongestionCallback callback)
+{
+  congestion_callback_ = std::move(callback);
+}
+
+esp_err_t BLEClient::SendData(const uint8_t* data, size_t len, bool wait_for_response)
 {
   auto& profile = profiles_[kProfileAppId];
   if (profile.char_handle == kInvalidHandle) {
     ESP_LOGE(kLogTag, "Characteristic not available");
-    return;
+    return ESP_ERR_INVALID_STATE;
   }
 
   esp_err_t err = esp_ble_gattc_write_char(
@@ -203,6 +213,7 @@ void BLEClient::SendData(const uint8_t* data, size_t len, bool wait_for_response
   if (err != ESP_OK) {
     ESP_LOGE(kLogTag, "Write failed: %s", esp_err_to_name(err));
   }
+  return err;
 }
 
 // Static callbacks that delegate to instance methods
@@ -391,6 +402,9 @@ void BLEClient::HandleGattcEvent(esp_gattc_cb_event_t event, esp_gatt_if_t gattc
 
   case ESP_GATTC_CFG_MTU_EVT: {
     ESP_LOGI(kLogTag, "MTU configured: %d", param->cfg_mtu.mtu);
+    if (param->cfg_mtu.status == ESP_GATT_OK) {
+      mtu_ = param->cfg_mtu.mtu;
+    }
     esp_ble_gattc_search_service(gattc_if, param->cfg_mtu.conn_id, &service_uuid_);
     break;
   }
@@ -525,6 +539,14 @@ void BLEClient::HandleGattcEvent(esp_gattc_cb_event_t event, esp_gatt_if_t gattc
     break;
   }
 
+  case ESP_GATTC_CONGEST_EVT: {
+    ESP_LOGD(kLogTag, "Congestion %s", param->congest.congested ? "on" : "off");
+    if (congestion_callback_) {
+      congestion_callback_(param->congest.congested);
+    }
+    break;
+  }
+
   case ESP_GATTC_SRVC_CHG_EVT: {
     ESP_LOGI(kLogTag, "Service changed");
     break;
@@ -535,11 +557,20 @@ void BLEClient::HandleGattcEvent(esp_gattc_cb_event_t event, esp_gatt_if_t gattc
     connected_ = false;
     has_service_ = false;
     gattc_if_ = ESP_GATT_IF_NONE;
+    mtu_ = ESP_GATT_DEF_BLE_MTU_SIZE;
 
     profile.service_start_handle = 0;
     profile.service_end_handle = 0;
     profile.char_handle = 0;
 
+    // Congestion ends with the connection
+    if (congestion_callback_) {
+      congestion_callback_(false);
+    }
+    if (disconnected_callback_) {
+      disconnected_callback_();
+    }
+
     ESP_LOGI(kLogTag, "Restarting scan...");
     esp_ble_gap_start_scanning(0);
     break;
@@ -15,6 +15,8 @@ public:
   using DataReceivedCallback = std::function<void(const uint8_t* data, size_t len)>;
   using WriteCompleteCallback = std::function<void()>;
   using ConnectedCallback = std::function<void()>;
+  using DisconnectedCallback = std::function<void()>;
+  using CongestionCallback = std::function<void(bool congested)>;
 
   static BLEClient& Instance();
   esp_err_t Initialize();
@@ -23,13 +25,20 @@ public:
   void SetDataReceivedCallback(DataReceivedCallback callback);
   void SetWriteCompleteCallback(WriteCompleteCallback callback);
   void SetConnectedCallback(ConnectedCallback callback);
+  // Called when the connection is lost, writes in flight are gone
+  void SetDisconnectedCallback(DisconnectedCallback callback);
+  // Called when the stack's transmit queue fills up and drains again
+  void SetCongestionCallback(CongestionCallback callback);
 
-  // Send data to the printer
-  void SendData(const uint8_t* data, size_t len, bool wait_for_response);
+  // Send data to the printer, fails when the write couldn't be queued
+  esp_err_t SendData(const uint8_t* data, size_t len, bool wait_for_response);
 
   // Check connection status
   bool IsConnected() const { return connected_; }
 
+  // Largest payload of a single write (negotiated MTU - 3)
+  size_t MaxWriteSize() const { return mtu_ - kAttHeaderSize; }
+
   static void GapCallback(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
   static void GattcCallback(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
                             esp_ble_gattc_cb_param_t* param);
@@ -40,6 +49,7 @@ private:
   static constexpr int kProfileNum = 1;
   static constexpr int kProfileAppId = 0;
   static constexpr uint16_t kInvalidHandle = 0;
+  static constexpr uint16_t kAttHeaderSize = 3;
 
   struct GattcProfile {
     esp_gattc_cb_t callback;
@@ -69,11 +79,14 @@ private:
   DataReceivedCallback data_received_callback_;
   WriteCompleteCallback write_complete_callback_;
   ConnectedCallback connected_callback_;
+  DisconnectedCallback disconnected_callback_;
+  CongestionCallback congestion_callback_;
 
   GattcProfile profiles_[kProfileNum] = {};
   esp_bd_addr_t target_bda_ = {};
   esp_bt_uuid_t service_uuid_ = {};
 
+  uint16_t mtu_ = ESP_GATT_DEF_BLE_MTU_SIZE;
   bool connected_ = false;
   bool has_service_ = false;
   esp_gatt_if_t gattc_if_ = ESP_GATT_IF_NONE;
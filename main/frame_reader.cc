@@ -0,0 +1,215 @@
+#include "frame_reader.h"
+
+#include <cstring>
+
+#include <esp_log.h>
+
+using namespace PRNM;
+
+namespace {
+  static constexpr const char* kLogTag = "prnm::rx";
+
+  static constexpr uint8_t kPacketStart = 0x55;
+  static constexpr uint8_t kPacketEnd = 0xAA;
+
+  // Start markers, type, length, checksum and end markers
+  static constexpr size_t kFrameOverhead = 7;
+
+  // Writes up to this size are copied bytewise, cheaper than memcpy calls
+  static constexpr size_t kSmallWrite = 8;
+
+  // Offset of the first start marker pair, or of a trailing start byte
+  // that may begin one
+  size_t FindStartMarker(const uint8_t* buf, size_t len)
+  {
+    // Usually we're already in sync
+    if (len >= 2 && buf[0] == kPacketStart && buf[1] == kPacketStart) {
+      return 0;
+    }
+
+    size_t i = 0;
+    while (i + 1 < len) {
+      const void* found = memchr(buf + i, kPacketStart, len - 1 - i);
+      if (!found) {
+        i = len - 1;
+        break;
+      }
+      i = static_cast<const uint8_t*>(found) - buf;
+      if (buf[i + 1] == kPacketStart) {
+        return i;
+      }
+      i++;
+    }
+    return (len > 0 && buf[len - 1] == kPacketStart) ? len - 1 : len;
+  }
+
+  // Check end markers and checksum of a complete frame at buf
+  bool IsValidFrame(const uint8_t* buf, size_t frame_len)
+  {
+    size_t data_len = frame_len - kFrameOverhead;
+    if (buf[5 + data_len] != kPacketEnd || buf[6 + data_len] != kPacketEnd) {
+      return false;
+    }
+
+    uint8_t checksum = buf[2] ^ buf[3];
+    for (size_t i = 0; i < data_len; i++) {
+      checksum ^= buf[4 + i];
+    }
+    return checksum == buf[4 + data_len];
+  }
+
+  // Offset of the first valid frame starting after the first byte of buf
+  // and ending within len, 0 if there is none
+  size_t FindFrameWithin(const uint8_t* buf, size_t len)
+  {
+    size_t off = 1;
+    while (true) {
+      off += FindStartMarker(buf + off, len - off);
+      if (off + kFrameOverhead > len) {
+        return 0;
+      }
+      size_t frame_len = buf[off + 3] + kFrameOverhead;
+      if (off + frame_len <= len && IsValidFrame(buf + off, frame_len)) {
+        return off;
+      }
+      off++;
+    }
+  }
+
+  // Whether an end marker pair ends in buf[from, len)
+  bool HasEndMarker(const uint8_t* buf, size_t from, size_t len)
+  {
+    size_t i = from > 0 ? from - 1 : 0;
+    while (i + 1 < len) {
+      const void* found = memchr(buf + i, kPacketEnd, len - 1 - i);
+      if (!found) {
+        return false;
+      }
+      i = static_cast<const uint8_t*>(found) - buf;
+      if (buf[i + 1] == kPacketEnd) {
+        return true;
+      }
+      i++;
+    }
+    return false;
+  }
+}
+
+void FrameReader::SetFrameCallback(FrameCallback callback)
+{
+  frame_callback_ = std::move(callback);
+}
+
+void FrameReader::Feed(const uint8_t* data, size_t len)
+{
+  // Parsing leaves at most one partial frame behind, so every pass
+  // makes room for more
+  while (len > 0) {
+    size_t written = Write(data, len);
+    data += written;
+    len -= written;
+    Parse();
+  }
+}
+
+void FrameReader::Reset()
+{
+  head_ = 0;
+  size_ = 0;
+  nested_at_ = 0;
+  end_checked_ = 0;
+}
+
+size_t FrameReader::Write(const uint8_t* data, size_t len)
+{
+  if (len > kCapacity - size_) {
+    len = kCapacity - size_;
+  }
+
+  // Store every byte at its ring position and its mirror
+  size_t tail = (head_ + size_) % kCapacity;
+  size_t first = len < kCapacity - tail ? len : kCapacity - tail;
+  if (len <= kSmallWrite) {
+    for (size_t i = 0; i < len; i++) {
+      size_t pos = (tail + i) % kCapacity;
+      buf_[pos] = data[i];
+      buf_[pos + kCapacity] = data[i];
+    }
+  } else {
+    memcpy(buf_ + tail, data, first);
+    memcpy(buf_ + kCapacity + tail, data, first);
+    memcpy(buf_, data + first, len - first);
+    memcpy(buf_ + kCapacity, data + first, len - first);
+  }
+
+  size_ += len;
+  return len;
+}
+
+void FrameReader::Parse()
+{
+  while (size_ > 0) {
+    // Buffered bytes are contiguous thanks to the mirror
+    const uint8_t* frame = buf_ + head_;
+
+    size_t skip = FindStartMarker(frame, size_);
+    if (skip > 0) {
+      stats_.skipped_bytes += skip;
+      Consume(skip);
+      continue;
+    }
+
+    if (size_ < kFrameOverhead) {
+      break;  // Wait for the header
+    }
+
+    // Frames XOR to zero, so a stray marker in front of a few real frames
+    // can pass as one long valid frame. A valid frame inside this one
+    // means it started on a stray marker.
+    size_t frame_len = frame[3] + kFrameOverhead;
+    if (size_ >= frame_len) {
+      if (nested_at_ == 0 && IsValidFrame(frame, frame_len) && FindFrameWithin(frame, frame_len) == 0) {
+        stats_.frames++;
+        if (frame_callback_) {
+          frame_callback_(PacketView{frame[2], frame + 4, frame[3]});
+        }
+        Consume(frame_len);
+        continue;
+      }
+    } else {
+      // Don't hold complete frames back while waiting on a stray marker.
+      // Only a new end marker pair can complete one.
+      if (nested_at_ == 0 && HasEndMarker(frame, end_checked_, size_)) {
+        nested_at_ = FindFrameWithin(frame, size_);
+      }
+      end_checked_ = size_;
+      if (nested_at_ == 0) {
+        break;  // Wait for the rest of the frame
+      }
+    }
+
+    // Started on a stray marker, resync past it so the frames behind it
+    // aren't lost
+    stats_.bad_frames++;
+    ESP_LOGD(kLogTag, "Bad frame type=0x%02x len=%zu, resyncing", frame[2], frame_len);
+    Consume(1);
+  }
+}
+
+void FrameReader::Consume(size_t len)
+{
+  head_ = (head_ + len) % kCapacity;
+  size_ -= len;
+
+  if (nested_at_ > 0 && nested_at_ <= len) {
+    // Reached the frame found inside the old one. The search stopped
+    // there, frames behind it may end on markers already checked.
+    nested_at_ = 0;
+    end_checked_ = 0;
+    return;
+  }
+
+  // What was found about the bytes still buffered holds for the new head
+  nested_at_ = nested_at_ > len ? nested_at_ - len : 0;
+  end_checked_ = end_checked_ > len ? end_checked_ - len : 0;
+}
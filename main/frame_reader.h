@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#include "packet_view.h"
+
+namespace PRNM {
+
+// Splits a received byte stream into Niimbot frames. Bytes are kept in a
+// mirrored ring (every byte is stored twice, N apart), so any buffered
+// window is contiguous and nothing is moved while syncing.
+//
+// A frame with a valid frame inside it, complete or still partial, is
+// taken to start on a stray marker, and the reader resyncs to the inner
+// one. Frames XOR to zero, so a cut-short frame whose length lands on
+// the end of a later frame often passes its checksum and would swallow
+// the real frames behind it. The cost is that a valid frame carrying a
+// whole valid frame in its payload is dropped for the inner one. Printer
+// replies are short status and info payloads, so that's not expected.
+class FrameReader {
+public:
+  // Holds the largest frame (255 data bytes + 7) with room to spare
+  static constexpr size_t kCapacity = 512;
+  static_assert((kCapacity & (kCapacity - 1)) == 0, "ring capacity must be a power of two");
+
+  // Called for every valid frame, the packet points into the ring and is
+  // only valid during the call
+  using FrameCallback = std::function<void(const PacketView& packet)>;
+
+  struct Stats {
+    uint32_t frames = 0;
+    // Start markers that didn't begin a valid frame
+    uint32_t bad_frames = 0;
+    // Bytes skipped while looking for a start marker
+    uint32_t skipped_bytes = 0;
+  };
+
+  FrameReader() = default;
+
+  void SetFrameCallback(FrameCallback callback);
+
+  // Feed received bytes, complete frames are handed to the callback
+  void Feed(const uint8_t* data, size_t len);
+
+  // Drop buffered bytes (e.g., on disconnect)
+  void Reset();
+
+  const Stats& GetStats() const { return stats_; }
+
+private:
+  // Non-copyable
+  FrameReader(const FrameReader&) = delete;
+  FrameReader& operator=(const FrameReader&) = delete;
+
+  // Append up to the free space, returns bytes stored
+  size_t Write(const uint8_t* data, size_t len);
+  // Parse every complete frame buffered
+  void Parse();
+  void Consume(size_t len);
+
+  FrameCallback frame_callback_;
+
+  uint8_t buf_[2 * kCapacity];
+  size_t head_ = 0;
+  size_t size_ = 0;
+  // Offset of a known valid frame inside the partial frame at head
+  size_t nested_at_ = 0;
+  // Bytes of the partial frame at head searched for end markers
+  size_t end_checked_ = 0;
+
+  Stats stats_;
+};
+
+}
@@ -1,3 +1,5 @@
+#include <atomic>
+
 #include <esp_check.h>
 #include <esp_log.h>
 #include <esp_sleep.h>
@@ -14,6 +16,7 @@
 #include "ble.h"
 #include "leds.h"
 #include "printer.h"
+#include "spooler.h"
 #include "touch.h"
 #include "signs.h"
 
@@ -21,6 +24,14 @@ namespace {
 const char* kLogTag = "prnm::main";
 
 PRNM::NiimbotPrinter g_printer;
+PRNM::PrintSpooler g_spooler(g_printer);
+
+// Touch wait between checks for failed jobs. A touch still held when
+// the wait times out is finished by the next wait.
+constexpr int kTouchPollMs = 200;
+// Set by the spooler when a job failed, shown by the main loop so the
+// spooler doesn't stall on the LED feedback
+std::atomic<bool> g_print_failed{false};
 
 }
 
@@ -56,6 +67,12 @@ void app_main(void)
     ESP_SHUTDOWN_ON_ERROR(err, kLogTag, "initialize nvs");
   }
 
+  ESP_LOGI(kLogTag, "Initialize signs");
+  {
+    err = PRNM::Signs::Initialize();
+    ESP_SHUTDOWN_ON_ERROR(err, kLogTag, "initialize signs");
+  }
+
   ESP_LOGI(kLogTag, "Initialize touch sensor");
   {
     err = PRNM::Touch::Instance().Initialize();
@@ -74,7 +91,7 @@ void app_main(void)
 
     // Set up printer callbacks
     g_printer.SetSendCallback([&ble](const uint8_t* data, size_t len, bool wait) {
-      ble.SendData(data, len, wait);
+      return ble.SendData(data, len, wait);
     });
 
     // Set up BLE callbacks
@@ -86,11 +103,23 @@ void app_main(void)
       g_printer.OnWriteComplete();
     });
 
-    ble.SetConnectedCallback([]() {
+    ble.SetCongestionCallback([](bool congested) {
+      g_printer.OnCongestion(congested);
+    });
+
+    // Writes in flight and pending replies are lost with the connection
+    ble.SetDisconnectedCallback([]() {
+      g_printer.Reset();
+    });
+
+    ble.SetConnectedCallback([&ble]() {
       ESP_LOGI(kLogTag, "BLE connected, querying printer...");
-      esp_err_t err = g_printer.SendHeartbeat();
+      g_printer.SetMaxWriteSize(ble.MaxWriteSize());
+      // The heartbeat waits for its write to complete, which this task
+      // reports, so the spooler sends it
+      esp_err_t err = g_spooler.RequestHeartbeat();
       if (err != ESP_OK) {
-        ESP_LOGE(kLogTag, "failed to send heartbeat: %s", esp_err_to_name(err));
+        ESP_LOGE(kLogTag, "failed to request heartbeat: %s", esp_err_to_name(err));
       }
     });
   }
@@ -101,17 +130,52 @@ void app_main(void)
     ESP_SHUTDOWN_ON_ERROR(err, kLogTag, "initialize BLE");
   }
 
-  ESP_LOGI(kLogTag, "Initialized, running main loop!");
-  while (true) {
-    bool touched = PRNM::Touch::Instance().Wait(CONFIG_PRNM_PRINTER_PING_MS);
-    if (!touched) {
-      if (g_printer.IsReady()) {
-        esp_err_t err = g_printer.GetPrintStatus();
-        if (err != ESP_OK) {
-          ESP_LOGE(kLogTag, "failed to ping printer: %s", esp_err_to_name(err));
+  ESP_LOGI(kLogTag, "Initialize print spooler");
+  {
+    g_spooler.SetJobCallback([](const PRNM::PrintSpooler::JobInfo& job) {
+      using JobState = PRNM::PrintSpooler::JobState;
+      switch (job.state) {
+        case JobState::Queued:
+          break;
+
+        case JobState::Sending: {
+          // Jobs of one print session share the animation
+          if (PRNM::Leds::Instance().IsRunning()) {
+            break;
+          }
+          uint8_t animId = 1 + (esp_random() % PRNM::kNumRandomAnimations);
+          ESP_LOGI(kLogTag, "Starting LED animation %d", animId);
+          PRNM::Leds::Instance().StartAnimation(animId);
+          break;
         }
+
+        case JobState::Failed:
+          ESP_LOGE(kLogTag, "Failed to print sign: %s", esp_err_to_name(job.result));
+          g_print_failed = true;
+          break;
+
+        case JobState::Done:
+        case JobState::Cancelled:
+          // Keep animating while more labels are queued
+          if (g_spooler.Pending() == 0) {
+            PRNM::Leds::Instance().Stop();
+          }
+          break;
       }
+    });
+
+    err = g_spooler.Start();
+    ESP_SHUTDOWN_ON_ERROR(err, kLogTag, "start print spooler");
+  }
+
+  ESP_LOGI(kLogTag, "Initialized, running main loop!");
+  while (true) {
+    if (g_print_failed.exchange(false)) {
+      showError();
+    }
 
+    bool touched = PRNM::Touch::Instance().Wait(kTouchPollMs);
+    if (!touched) {
       continue;
     }
 
@@ -122,24 +186,12 @@ void app_main(void)
       continue;
     }
 
-    ESP_LOGI(kLogTag, "Printer ready");
-
-    uint8_t animId = 1 + (esp_random() % PRNM::kNumRandomAnimations);
-    ESP_LOGI(kLogTag, "Starting LED animation %d", animId);
-    PRNM::Leds::Instance().StartAnimation(animId);
-
-    ESP_LOGI(kLogTag, "Printing next sign...");
-    const PRNM::Signs::RleImage* sign = PRNM::Signs::Next();
-    assert(sign);
-    err = g_printer.Print(*sign);
+    // Touches during a print queue another label
+    ESP_LOGI(kLogTag, "Queueing next sign...");
+    err = g_spooler.Submit(nullptr);
     if (err != ESP_OK) {
-      ESP_LOGE(kLogTag, "Failed to print sign: %s", esp_err_to_name(err));
-      showError();
-      continue;
+      ESP_LOGW(kLogTag, "Failed to queue sign: %s", esp_err_to_name(err));
     }
-
-    vTaskDelay(pdMS_TO_TICKS(2000));
-    PRNM::Leds::Instance().Stop();
   }
 }
 
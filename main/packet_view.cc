@@ -0,0 +1,55 @@
+#include "packet_view.h"
+
+using namespace PRNM;
+
+namespace {
+  // Shortest heartbeat any printer sends
+  static constexpr size_t kMinHeartbeatLen = 9;
+
+  // Field not carried by a heartbeat layout
+  static constexpr uint8_t kNoField = UINT8_MAX;
+
+  struct HeartbeatLayout {
+    uint8_t len;
+    uint8_t offsets[4];  // In HeartbeatView::Field order
+  };
+
+  static constexpr HeartbeatLayout kHeartbeatLayouts[] = {
+    {20, {kNoField, kNoField, 18, 19}},
+    {19, {15, 16, 17, 18}},
+    {13, {9, 10, 11, 12}},
+    {10, {8, 9, kNoField, kNoField}},
+    {9, {8, kNoField, kNoField, kNoField}},
+  };
+}
+
+HeartbeatView::HeartbeatView(const PacketView& packet)
+  : packet_(packet)
+{
+  valid_ = packet.type == kType && packet.len >= kMinHeartbeatLen;
+  if (!valid_) {
+    return;
+  }
+
+  for (const HeartbeatLayout& layout : kHeartbeatLayouts) {
+    if (layout.len == packet.len) {
+      offsets_ = layout.offsets;
+      break;
+    }
+  }
+}
+
+bool HeartbeatView::Get(Field field, uint8_t* value) const
+{
+  if (!offsets_) {
+    return false;
+  }
+
+  uint8_t offset = offsets_[static_cast<size_t>(field)];
+  if (offset == kNoField) {
+    return false;
+  }
+
+  *value = packet_.data[offset];
+  return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace PRNM {
+
+// A received packet. Data points straight into the receive buffer and is
+// only valid while the packet is being handled.
+struct PacketView {
+  uint8_t type = 0;
+  const uint8_t* data = nullptr;
+  size_t len = 0;
+
+  // Payload fields, big-endian. Reads past the end return 0.
+  uint8_t U8(size_t offset) const { return offset < len ? data[offset] : 0; }
+  uint16_t U16(size_t offset) const
+  {
+    return offset + 2 <= len ? static_cast<uint16_t>((data[offset] << 8) | data[offset + 1]) : 0;
+  }
+};
+
+// Heartbeat reply. Printer models send different layouts, told apart by
+// their length.
+class HeartbeatView {
+public:
+  static constexpr uint8_t kType = 0xDD;
+
+  enum class Field : uint8_t {
+    ClosingState,
+    PowerLevel,
+    PaperState,
+    RfidReadState,
+  };
+
+  explicit HeartbeatView(const PacketView& packet);
+
+  bool IsValid() const { return valid_; }
+  // Read a field, fails when the layout doesn't carry it
+  bool Get(Field field, uint8_t* value) const;
+
+private:
+  PacketView packet_;
+  bool valid_ = false;
+  // Field offsets of the matched layout, in Field order
+  const uint8_t* offsets_ = nullptr;
+};
+
+// Print status reply: page being printed and print/feed progress
+class PrintStatusView {
+public:
+  static constexpr uint8_t kType = 0xB3;
+
+  explicit PrintStatusView(const PacketView& packet) : packet_(packet) {}
+
+  bool IsValid() const { return packet_.type == kType && packet_.len >= 4; }
+  uint16_t Page() const { return packet_.U16(0); }
+  uint8_t Print() const { return packet_.U8(2); }
+  uint8_t Feed() const { return packet_.U8(3); }
+
+private:
+  PacketView packet_;
+};
+
+// Device info reply, typed 0x40 + the requested info key
+class InfoView {
+public:
+  static constexpr uint8_t kTypeBase = 0x40;
+  // Highest info key the printer answers
+  static constexpr uint8_t kMaxKey = 12;
+
+  explicit InfoView(const PacketView& packet) : packet_(packet) {}
+
+  bool IsValid() const { return packet_.type > kTypeBase && packet_.type <= kTypeBase + kMaxKey && packet_.len > 0; }
+  uint8_t Key() const { return packet_.type - kTypeBase; }
+  uint8_t U8() const { return packet_.U8(0); }
+  uint16_t U16() const { return packet_.U16(0); }
+
+private:
+  PacketView packet_;
+};
+
+}
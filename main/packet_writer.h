@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+#include <type_traits>
+
+namespace PRNM {
+
+// Builds a Niimbot packet in place. Header space is reserved up front,
+// the payload is written straight into the destination and the checksum
+// is accumulated while writing it. Usable in constant expressions.
+class PacketWriter {
+public:
+  // Start markers, type, length, checksum and end markers
+  static constexpr size_t kOverhead = 7;
+  static constexpr size_t kMaxDataLen = UINT8_MAX;
+  static constexpr size_t kMaxPacketLen = kMaxDataLen + kOverhead;
+
+  constexpr PacketWriter(uint8_t* buf, size_t size, uint8_t type)
+    : buf_(buf), size_(size), checksum_(type)
+  {
+    if (size < kOverhead) {
+      overflow_ = true;
+      return;
+    }
+    buf_[0] = kPacketStart;
+    buf_[1] = kPacketStart;
+    buf_[2] = type;
+  }
+
+  constexpr void PutU8(uint8_t value)
+  {
+    if (Reserve(1)) {
+      buf_[len_++] = value;
+      checksum_ ^= value;
+    }
+  }
+
+  // Big endian, like every multi-byte field of the protocol
+  template <typename T>
+  constexpr void PutBe(T value)
+  {
+    static_assert(std::is_unsigned<T>::value, "fields are unsigned integers");
+    for (size_t shift = sizeof(T) * 8; shift > 0; shift -= 8) {
+      PutU8(static_cast<uint8_t>(value >> (shift - 8)));
+    }
+  }
+
+  constexpr void PutU16(uint16_t value) { PutBe(value); }
+
+  constexpr void Put(const uint8_t* data, size_t len)
+  {
+    if (Reserve(len)) {
+      for (size_t i = 0; i < len; i++) {
+        buf_[len_ + i] = data[i];
+        checksum_ ^= data[i];
+      }
+      len_ += len;
+    }
+  }
+
+  // Put data whose XOR is already known, a plain copy
+  void Put(const uint8_t* data, size_t len, uint8_t data_xor)
+  {
+    if (Reserve(len)) {
+      memcpy(buf_ + len_, data, len);
+      len_ += len;
+      checksum_ ^= data_xor;
+    }
+  }
+
+  // Fill in length, checksum and end markers. Returns the packet length,
+  // 0 when the payload didn't fit.
+  constexpr size_t Finish()
+  {
+    size_t data_len = len_ - kHeaderLen;
+    if (overflow_ || data_len > kMaxDataLen) {
+      return 0;
+    }
+
+    buf_[3] = static_cast<uint8_t>(data_len);
+    checksum_ ^= static_cast<uint8_t>(data_len);
+    buf_[len_++] = checksum_;
+    buf_[len_++] = kPacketEnd;
+    buf_[len_++] = kPacketEnd;
+    return len_;
+  }
+
+private:
+  static constexpr uint8_t kPacketStart = 0x55;
+  static constexpr uint8_t kPacketEnd = 0xAA;
+  static constexpr size_t kHeaderLen = 4;
+  static constexpr size_t kTrailerLen = 3;
+
+  // Whether len more payload bytes fit with the trailer
+  constexpr bool Reserve(size_t len)
+  {
+    if (overflow_ || len_ + len + kTrailerLen > size_) {
+      overflow_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  uint8_t* buf_;
+  size_t size_;
+  size_t len_ = kHeaderLen;
+  uint8_t checksum_;
+  bool overflow_ = false;
+};
+
+// Payload made of big-endian fields, sized by their types. Packets are
+// built into exactly sized arrays, at compile time for constant fields.
+template <typename... Fields>
+struct PacketLayout {
+  static constexpr size_t kDataLen = (sizeof(Fields) + ... + 0);
+  static constexpr size_t kPacketLen = kDataLen + PacketWriter::kOverhead;
+  static_assert(kDataLen <= PacketWriter::kMaxDataLen, "payload too long for one packet");
+
+  using Packet = std::array<uint8_t, kPacketLen>;
+
+  static constexpr Packet Build(uint8_t type, Fields... fields)
+  {
+    Packet pkt = {};
+    PacketWriter writer(pkt.data(), pkt.size(), type);
+    (writer.PutBe(fields), ...);
+    writer.Finish();
+    return pkt;
+  }
+};
+
+}
@@ -1,12 +1,17 @@
 #include "printer.h"
 
+#include <sdkconfig.h>
 #include <cstring>
+#include <utility>
 
 #include <esp_check.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
+#include "packet_writer.h"
 #include "signs.h"
 
 using namespace PRNM;
@@ -19,11 +24,348 @@ namespace {
   static constexpr uint8_t kPacketStart2 = 0x55;
   static constexpr uint8_t kPacketEnd1 = 0xAA;
   static constexpr uint8_t kPacketEnd2 = 0xAA;
+
+  // Row streaming window and checkpoint interval
+  static constexpr UBaseType_t kStreamWindow = CONFIG_PRNM_PRINT_STREAM_WINDOW;
+  static constexpr uint8_t kStreamCheckpoint = CONFIG_PRNM_PRINT_STREAM_CHECKPOINT;
+  // Stream event bit set while the transport takes writes
+  static constexpr EventBits_t kStreamOpen = 1 << 0;
+
+  // Reply type the printer answers a request with (0 = none)
+  uint8_t ResponseFor(NiimbotPrinter::RequestCode code, const uint8_t* data, size_t data_len)
+  {
+    using RequestCode = NiimbotPrinter::RequestCode;
+    switch (code) {
+      case RequestCode::GET_INFO:
+        // Info replies are keyed by the requested info
+        return data_len > 0 ? data[0] + 0x40 : 0;
+      case RequestCode::GET_RFID:
+      case RequestCode::HEARTBEAT:
+      case RequestCode::START_PRINT:
+      case RequestCode::START_PAGE_PRINT:
+      case RequestCode::SET_DIMENSION:
+      case RequestCode::SET_QUANTITY:
+      case RequestCode::END_PAGE_PRINT:
+      case RequestCode::END_PRINT:
+        return static_cast<uint8_t>(code) + 1;
+      case RequestCode::SET_LABEL_TYPE:
+      case RequestCode::SET_LABEL_DENSITY:
+      case RequestCode::ALLOW_PRINT_CLEAR:
+      case RequestCode::GET_PRINT_STATUS:
+        return static_cast<uint8_t>(code) + 0x10;
+      case RequestCode::PRINT_BITMAP_ROW_INDEXED:
+      case RequestCode::PRINT_EMPTY_ROW:
+      case RequestCode::PRINT_BITMAP_ROW:
+        return 0;
+    }
+    return 0;
+  }
+
+  // Command payload layouts
+  using ByteLayout = PacketLayout<uint8_t>;
+  // Total pages, reserved zeros, page color
+  using StartPrintLayout = PacketLayout<uint16_t, uint32_t, uint8_t>;
+  // Rows, columns, copies
+  using SetDimensionLayout = PacketLayout<uint16_t, uint16_t, uint16_t>;
+  static_assert(StartPrintLayout::kDataLen == 7, "START_PRINT takes 7 bytes");
+  static_assert(SetDimensionLayout::kDataLen == 6, "SET_DIMENSION takes 6 bytes");
+
+  constexpr ByteLayout::Packet FixedCommand(NiimbotPrinter::RequestCode code)
+  {
+    return ByteLayout::Build(static_cast<uint8_t>(code), 0x01);
+  }
+
+  // Commands without parameters always send the same bytes, built at
+  // compile time
+  static constexpr ByteLayout::Packet kHeartbeatPacket = FixedCommand(NiimbotPrinter::RequestCode::HEARTBEAT);
+  static constexpr ByteLayout::Packet kStartPagePacket = FixedCommand(NiimbotPrinter::RequestCode::START_PAGE_PRINT);
+  static constexpr ByteLayout::Packet kEndPagePacket = FixedCommand(NiimbotPrinter::RequestCode::END_PAGE_PRINT);
+  static constexpr ByteLayout::Packet kEndPrintPacket = FixedCommand(NiimbotPrinter::RequestCode::END_PRINT);
+  static constexpr ByteLayout::Packet kPrintStatusPacket = FixedCommand(NiimbotPrinter::RequestCode::GET_PRINT_STATUS);
+  // 55 55 DC 01 01 DC AA AA
+  static_assert(kHeartbeatPacket[4] == 0x01 && kHeartbeatPacket[5] == 0xDC && kHeartbeatPacket[7] == 0xAA,
+                "heartbeat packet");
+
+  // Print job timeouts
+  static constexpr TickType_t kCommandTimeout = pdMS_TO_TICKS(1000);
+  // Per label, from the last page sent
+  static constexpr TickType_t kPrintedTimeout = pdMS_TO_TICKS(10000);
+  static constexpr TickType_t kStatusPollInterval = pdMS_TO_TICKS(100);
+
+  // Row data: 384 pixels = 48 bytes
+  static constexpr size_t kRowBytes = NiimbotPrinter::kPaperWidthDots / 8;
+  // Signs rendered at the printhead width take the fixed width decoder
+  static_assert(Signs::kWidth == NiimbotPrinter::kPaperWidthDots, "signs must match the printhead width");
+
+  // Indexed rows carry 2 bytes per black pixel, so they only win over
+  // a full bitmap row up to this many pixels
+  static constexpr uint16_t kMaxIndexedPixels = kRowBytes / 2 - 1;
+
+  // Bit count fields split the printhead into three equal chunks
+  static constexpr uint16_t kBitCountChunk = NiimbotPrinter::kPaperWidthDots / 3;
+  static_assert(kBitCountChunk % 8 == 0, "bit count chunks must be whole bytes");
+
+  // Sign print plans are made for the same row packets
+  static_assert(Signs::kPlanMaxIndexedPixels == kMaxIndexedPixels, "plans must pick indexed rows as we do");
+  static_assert(Signs::kPlanChunks == 3 && Signs::kPlanChunkWidth == kBitCountChunk,
+                "plans must count bits per printhead chunk");
+
+  // Largest row packet: header, row number, bit counts, repeat and bitmap
+  static constexpr size_t kRowPacketHeader = 6;
+  static constexpr size_t kMaxRowPacketLen = kRowPacketHeader + kRowBytes + PacketWriter::kOverhead;
+
+  // Prefetch cache fits a full page of worst case rows
+  static constexpr size_t kPrefetchCapacity = NiimbotPrinter::kPaperHeightDots * kMaxRowPacketLen;
+
+  void CountChunkPixels(const Signs::RleRun* runs, size_t num_runs, uint8_t counts[3])
+  {
+    counts[0] = counts[1] = counts[2] = 0;
+    for (size_t i = 0; i < num_runs; i++) {
+      uint16_t x = runs[i].x;
+      uint16_t end = runs[i].x + runs[i].len;
+      while (x < end && x < NiimbotPrinter::kPaperWidthDots) {
+        uint16_t chunk = x / kBitCountChunk;
+        uint16_t chunk_end = (chunk + 1) * kBitCountChunk;
+        uint16_t n = (end < chunk_end ? end : chunk_end) - x;
+        counts[chunk] += n;
+        x += n;
+      }
+    }
+  }
+
+  void CountBitmapPixels(const uint8_t* row_data, uint8_t counts[3])
+  {
+    for (size_t chunk = 0; chunk < 3; chunk++) {
+      uint16_t n = 0;
+      const uint8_t* p = row_data + chunk * (kBitCountChunk / 8);
+      for (size_t i = 0; i < kBitCountChunk / 8; i++) {
+        n += __builtin_popcount(p[i]);
+      }
+      counts[chunk] = n;
+    }
+  }
+
+  bool IsCancelled(const std::atomic<bool>* cancel)
+  {
+    return cancel && cancel->load();
+  }
+
+  // XOR of all bytes, folded a word at a time
+  uint8_t XorBytes(const uint8_t* data, size_t len)
+  {
+    uint32_t acc = 0;
+    size_t i = 0;
+    for (; i + sizeof(acc) <= len; i += sizeof(acc)) {
+      uint32_t word;
+      memcpy(&word, data + i, sizeof(word));
+      acc ^= word;
+    }
+    uint8_t result = static_cast<uint8_t>(acc ^ (acc >> 8) ^ (acc >> 16) ^ (acc >> 24));
+    for (; i < len; i++) {
+      result ^= data[i];
+    }
+    return result;
+  }
+
+  // Row packet payloads start with the row number (big endian). The
+  // writer goes into overflow when the payload doesn't fit.
+  void BitmapRowData(PacketWriter& pkt, uint16_t row_num, const uint8_t counts[3], const uint8_t* row_data,
+                     size_t row_len, uint8_t row_xor, uint8_t repeat)
+  {
+    pkt.PutU16(row_num);
+
+    // Bit counts per printhead chunk
+    pkt.Put(counts, 3);
+
+    // Repeat count
+    pkt.PutU8(repeat);
+
+    // Row data, its checksum share is already known
+    pkt.Put(row_data, row_len, row_xor);
+  }
+
+  void EmptyRowData(PacketWriter& pkt, uint16_t row_num, uint8_t count)
+  {
+    pkt.PutU16(row_num);
+    pkt.PutU8(count);
+  }
+
+  void IndexedRowData(PacketWriter& pkt, uint16_t row_num, const Signs::RleRun* runs, size_t num_runs,
+                      uint8_t repeat)
+  {
+    pkt.PutU16(row_num);
+
+    // Bit counts per printhead chunk
+    uint8_t counts[3];
+    CountChunkPixels(runs, num_runs, counts);
+    pkt.Put(counts, sizeof(counts));
+
+    // Repeat count
+    pkt.PutU8(repeat);
+
+    // Black pixel indexes (big endian)
+    for (size_t i = 0; i < num_runs; i++) {
+      for (uint16_t x = runs[i].x; x < runs[i].x + runs[i].len; x++) {
+        pkt.PutU16(x);
+      }
+    }
+  }
+
+  template <typename Subscribers, typename Callback>
+  esp_err_t AddSubscriber(Subscribers& subscribers, Callback callback)
+  {
+    if (subscribers.count == NiimbotPrinter::kMaxSubscribers) {
+      return ESP_ERR_NO_MEM;
+    }
+    subscribers.callbacks[subscribers.count++] = std::move(callback);
+    return ESP_OK;
+  }
+
+  template <typename Subscribers, typename Event>
+  void Notify(const Subscribers& subscribers, const Event& event)
+  {
+    for (size_t i = 0; i < subscribers.count; i++) {
+      subscribers.callbacks[i](event);
+    }
+  }
 }
 
+// Row encodings, smallest first
+enum class NiimbotPrinter::RowEncoding : uint8_t {
+  Empty,
+  Indexed,
+  Bitmap,
+};
+
+// Row classified from its black runs, only bitmap rows get decoded
+struct NiimbotPrinter::EncodedRow {
+  RowEncoding encoding;
+  uint16_t black_pixels;
+  uint16_t num_runs;
+  Signs::RleRun runs[kMaxIndexedPixels];
+  uint8_t bitmap[kRowBytes];
+  uint8_t bitmap_counts[3];
+  uint8_t bitmap_xor;
+
+  void Encode(Signs::RowReader& reader, uint16_t y)
+  {
+    black_pixels = reader.BlackRuns(y, runs, kMaxIndexedPixels, &num_runs);
+    if (black_pixels == 0) {
+      encoding = RowEncoding::Empty;
+    } else if (black_pixels <= kMaxIndexedPixels) {
+      // Every run has at least one pixel, so all of them fit
+      encoding = RowEncoding::Indexed;
+    } else {
+      encoding = RowEncoding::Bitmap;
+      reader.Decode(y, bitmap, kRowBytes);
+      CountBitmapPixels(bitmap, bitmap_counts);
+      bitmap_xor = XorBytes(bitmap, kRowBytes);
+    }
+  }
+
+  // Encode the first row of a plan step, the plan already knows its
+  // kind and bit counts
+  void Encode(Signs::RowReader& reader, const Signs::PlanStep& step)
+  {
+    switch (step.kind) {
+      case Signs::RowKind::Empty:
+        encoding = RowEncoding::Empty;
+        black_pixels = 0;
+        num_runs = 0;
+        break;
+      case Signs::RowKind::Indexed:
+        // Classified from the runs like any row, so a wrong plan can't
+        // index more pixels than runs holds
+        Encode(reader, step.row);
+        break;
+      case Signs::RowKind::Bitmap:
+        encoding = RowEncoding::Bitmap;
+        black_pixels = step.counts[0] + step.counts[1] + step.counts[2];
+        reader.Decode(step.row, bitmap, kRowBytes);
+        memcpy(bitmap_counts, step.counts, sizeof(bitmap_counts));
+        bitmap_xor = XorBytes(bitmap, kRowBytes);
+        break;
+    }
+  }
+
+  // Upper bound of the packet length, for reserving write space
+  size_t MaxPacketLen() const
+  {
+    switch (encoding) {
+      case RowEncoding::Empty:
+        return 3 + PacketWriter::kOverhead;
+      case RowEncoding::Indexed:
+        return kRowPacketHeader + 2 * black_pixels + PacketWriter::kOverhead;
+      case RowEncoding::Bitmap:
+        break;
+    }
+    return kMaxRowPacketLen;
+  }
+
+  bool SameAs(const EncodedRow& other) const
+  {
+    if (encoding != other.encoding || black_pixels != other.black_pixels) {
+      return false;
+    }
+
+    switch (encoding) {
+      case RowEncoding::Empty:
+        return true;
+      case RowEncoding::Indexed:
+        return num_runs == other.num_runs &&
+               memcmp(runs, other.runs, num_runs * sizeof(runs[0])) == 0;
+      case RowEncoding::Bitmap:
+        return memcmp(bitmap, other.bitmap, kRowBytes) == 0;
+    }
+    return false;
+  }
+
+  // Build the packet printing this row `count` times from row_num
+  // straight into buf, returns 0 when it doesn't fit
+  size_t BuildPacket(uint16_t row_num, uint8_t count, uint8_t* buf, size_t size) const
+  {
+    switch (encoding) {
+      case RowEncoding::Empty: {
+        PacketWriter pkt(buf, size, static_cast<uint8_t>(RequestCode::PRINT_EMPTY_ROW));
+        EmptyRowData(pkt, row_num, count);
+        return pkt.Finish();
+      }
+      case RowEncoding::Indexed: {
+        PacketWriter pkt(buf, size, static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW_INDEXED));
+        IndexedRowData(pkt, row_num, runs, num_runs, count);
+        return pkt.Finish();
+      }
+      case RowEncoding::Bitmap: {
+        PacketWriter pkt(buf, size, static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW));
+        BitmapRowData(pkt, row_num, bitmap_counts, bitmap, kRowBytes, bitmap_xor, count);
+        return pkt.Finish();
+      }
+    }
+    return 0;
+  }
+};
+
 NiimbotPrinter::NiimbotPrinter()
 {
   write_semaphore_ = xSemaphoreCreateBinary();
+  stream_credits_ = xSemaphoreCreateCounting(kStreamWindow, kStreamWindow);
+  stream_events_ = xEventGroupCreate();
+  if (stream_events_) {
+    xEventGroupSetBits(stream_events_, kStreamOpen);
+  }
+  transactions_mutex_ = xSemaphoreCreateMutex();
+  for (auto& txn : transactions_) {
+    txn.done_semaphore = xSemaphoreCreateBinary();
+  }
+
+  tx_.SetWriteCallback([this](const uint8_t* data, size_t len, bool wait_for_response, TickType_t timeout) {
+    return Write(data, len, wait_for_response, timeout);
+  });
+
+  rx_.SetFrameCallback([this](const PacketView& packet) {
+    HandleResponse(packet);
+    CompleteTransaction(packet);
+  });
 }
 
 NiimbotPrinter::~NiimbotPrinter()
@@ -31,6 +373,23 @@ NiimbotPrinter::~NiimbotPrinter()
   if (write_semaphore_) {
     vSemaphoreDelete(write_semaphore_);
   }
+  if (stream_credits_) {
+    vSemaphoreDelete(stream_credits_);
+  }
+  if (stream_events_) {
+    vEventGroupDelete(stream_events_);
+  }
+  for (auto& txn : transactions_) {
+    if (txn.done_semaphore) {
+      vSemaphoreDelete(txn.done_semaphore);
+    }
+  }
+  if (transactions_mutex_) {
+    vSemaphoreDelete(transactions_mutex_);
+  }
+  if (prefetch_.buf) {
+    heap_caps_free(prefetch_.buf);
+  }
 }
 
 void NiimbotPrinter::SetSendCallback(SendPacketCallback callback)
@@ -43,48 +402,108 @@ void NiimbotPrinter::SetReadyCallback(ReadyCallback callback)
   ready_callback_ = std::move(callback);
 }
 
+void NiimbotPrinter::SetMaxWriteSize(size_t size)
+{
+  tx_.SetMaxWriteSize(size);
+}
+
+esp_err_t NiimbotPrinter::SubscribeStatus(StatusCallback callback)
+{
+  return AddSubscriber(status_subscribers_, std::move(callback));
+}
+
+esp_err_t NiimbotPrinter::SubscribeProgress(ProgressCallback callback)
+{
+  return AddSubscriber(progress_subscribers_, std::move(callback));
+}
+
+esp_err_t NiimbotPrinter::SubscribeError(ErrorCallback callback)
+{
+  return AddSubscriber(error_subscribers_, std::move(callback));
+}
+
 void NiimbotPrinter::Reset()
 {
   ready_ = false;
-  packet_buf_len_ = 0;
+  rx_.Reset();
   status_ = {};
+  progress_ = {};
+
+  // Replies to pending transactions won't arrive anymore
+  xSemaphoreTake(transactions_mutex_, portMAX_DELAY);
+  for (auto& txn : transactions_) {
+    if (txn.expected != 0 && !txn.done) {
+      txn.done = true;
+      txn.result = ESP_ERR_INVALID_STATE;
+      xSemaphoreGive(txn.done_semaphore);
+    }
+  }
+  xSemaphoreGive(transactions_mutex_);
+
+  // Writes in flight are gone with the connection. Their credits come
+  // back first, a writer waiting for one holds the aggregator.
+  stream_in_flight_ = 0;
+  if (stream_credits_) {
+    while (xSemaphoreGive(stream_credits_) == pdTRUE) {
+    }
+  }
+  if (stream_events_) {
+    xEventGroupSetBits(stream_events_, kStreamOpen);
+  }
+  tx_.Reset();
 }
 
 void NiimbotPrinter::OnWriteComplete()
 {
+  // Writes complete in order and writes with response are only issued
+  // once the stream drained, so streamed writes always complete first
+  if (ReturnStreamCredit()) {
+    return;
+  }
+
   if (write_semaphore_) {
     xSemaphoreGive(write_semaphore_);
   }
 }
 
-size_t NiimbotPrinter::BuildPacket(uint8_t* buf, size_t buf_size, uint8_t type, const uint8_t* data, size_t data_len)
+bool NiimbotPrinter::ReturnStreamCredit()
 {
-  if (buf_size < data_len + 7) {
-    ESP_LOGE(kLogTag, "Buffer too small for packet");
-    return 0;
+  // Reset may zero the count meanwhile, it never goes below zero
+  uint32_t in_flight = stream_in_flight_;
+  while (in_flight > 0 && !stream_in_flight_.compare_exchange_weak(in_flight, in_flight - 1)) {
   }
+  if (in_flight == 0) {
+    return false;
+  }
+  xSemaphoreGive(stream_credits_);
+  return true;
+}
 
-  buf[0] = kPacketStart1;
-  buf[1] = kPacketStart2;
-  buf[2] = type;
-  buf[3] = static_cast<uint8_t>(data_len);
-
-  // Calculate checksum: XOR of type, length, and all data bytes
-  uint8_t checksum = type ^ static_cast<uint8_t>(data_len);
-  for (size_t i = 0; i < data_len; i++) {
-    buf[4 + i] = data[i];
-    checksum ^= data[i];
+void NiimbotPrinter::OnCongestion(bool congested)
+{
+  if (!stream_events_) {
+    return;
+  }
+  if (congested) {
+    xEventGroupClearBits(stream_events_, kStreamOpen);
+  } else {
+    xEventGroupSetBits(stream_events_, kStreamOpen);
   }
+}
 
-  buf[4 + data_len] = checksum;
-  buf[5 + data_len] = kPacketEnd1;
-  buf[6 + data_len] = kPacketEnd2;
+size_t NiimbotPrinter::BuildPacket(uint8_t* buf, size_t buf_size, uint8_t type, const uint8_t* data, size_t data_len)
+{
+  PacketWriter pkt(buf, buf_size, type);
+  pkt.Put(data, data_len);
 
-  return data_len + 7;
+  size_t pkt_len = pkt.Finish();
+  if (pkt_len == 0) {
+    ESP_LOGE(kLogTag, "Buffer too small for packet");
+  }
+  return pkt_len;
 }
 
-bool NiimbotPrinter::ParsePacket(const uint8_t* buf, size_t len, uint8_t* type,
-                                 uint8_t* data, size_t* data_len)
+bool NiimbotPrinter::ParsePacket(const uint8_t* buf, size_t len, PacketView* packet)
 {
   if (len < 7) {
     return false;
@@ -95,7 +514,7 @@ bool NiimbotPrinter::ParsePacket(const uint8_t* buf, size_t len, uint8_t* type,
     return false;
   }
 
-  *type = buf[2];
+  uint8_t type = buf[2];
   size_t pkt_data_len = buf[3];
 
   if (len < pkt_data_len + 7) {
@@ -109,9 +528,8 @@ bool NiimbotPrinter::ParsePacket(const uint8_t* buf, size_t len, uint8_t* type,
   }
 
   // Verify checksum
-  uint8_t checksum = *type ^ static_cast<uint8_t>(pkt_data_len);
+  uint8_t checksum = type ^ static_cast<uint8_t>(pkt_data_len);
   for (size_t i = 0; i < pkt_data_len; i++) {
-    data[i] = buf[4 + i];
     checksum ^= buf[4 + i];
   }
 
@@ -121,34 +539,71 @@ bool NiimbotPrinter::ParsePacket(const uint8_t* buf, size_t len, uint8_t* type,
     return false;
   }
 
-  *data_len = pkt_data_len;
+  packet->type = type;
+  packet->data = buf + 4;
+  packet->len = pkt_data_len;
   return true;
 }
 
-esp_err_t NiimbotPrinter::SendPacket(RequestCode code, const uint8_t* data, size_t data_len,
-                                     bool wait_for_response)
+esp_err_t NiimbotPrinter::QueuePacket(const uint8_t* pkt, size_t pkt_len, bool wait_for_response)
+{
+  ESP_LOG_BUFFER_HEX_LEVEL(kLogTag, pkt, pkt_len, ESP_LOG_DEBUG);
+
+  // Packets without response are packed into shared writes, a packet
+  // with response flushes them all in one write
+  ESP_RETURN_ON_ERROR(tx_.Append(pkt, pkt_len), kLogTag, "failed to queue packet");
+  if (wait_for_response) {
+    return tx_.Flush(true);
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t NiimbotPrinter::Write(const uint8_t* data, size_t len, bool wait_for_response, TickType_t timeout)
 {
   if (!send_callback_) {
     ESP_LOGE(kLogTag, "Send callback not set");
     return ESP_ERR_INVALID_STATE;
   }
 
-  uint8_t type = static_cast<uint8_t>(code);
-  uint8_t pkt[256];
-  size_t pkt_len = BuildPacket(pkt, sizeof(pkt), type, data, data_len);
-  if (pkt_len == 0) {
-    return ESP_ERR_INVALID_SIZE;
-  }
-
-  ESP_LOGD(kLogTag, "Sending packet type=0x%02x len=%zu", type, data_len);
-  ESP_LOG_BUFFER_HEX_LEVEL(kLogTag, pkt, pkt_len, ESP_LOG_DEBUG);
+  if (wait_for_response) {
+    ESP_RETURN_ON_ERROR(DrainStream(), kLogTag, "stream drain timeout");
 
-  // Clear any pending signals
-  if (wait_for_response && write_semaphore_) {
-    xSemaphoreTake(write_semaphore_, 0);
+    // Clear any pending signals
+    if (write_semaphore_) {
+      xSemaphoreTake(write_semaphore_, 0);
+    }
+  } else if (stream_credits_) {
+    // Write without response: wait out congestion, then for a free slot
+    // in the window
+    if (timeout > kWriteTimeout) {
+      timeout = kWriteTimeout;
+    }
+    if (stream_events_ &&
+        (xEventGroupWaitBits(stream_events_, kStreamOpen, pdFALSE, pdTRUE, timeout) & kStreamOpen) == 0) {
+      if (timeout > 0) {
+        ESP_LOGW(kLogTag, "Write timeout waiting for congestion to clear");
+      }
+      return ESP_ERR_TIMEOUT;
+    }
+    if (xSemaphoreTake(stream_credits_, timeout) != pdTRUE) {
+      if (timeout > 0) {
+        ESP_LOGW(kLogTag, "Write timeout waiting for stream window");
+      }
+      return ESP_ERR_TIMEOUT;
+    }
+    stream_in_flight_++;
   }
 
-  send_callback_(pkt, pkt_len, wait_for_response);
+  esp_err_t err = send_callback_(data, len, wait_for_response);
+  if (err != ESP_OK) {
+    // Nothing went out, so no completion returns the credit
+    if (!wait_for_response && stream_credits_) {
+      ReturnStreamCredit();
+    }
+    ESP_LOGE(kLogTag, "Failed to send %zu bytes: %s", len, esp_err_to_name(err));
+    return err;
+  }
 
   // Wait for write completion
   if (wait_for_response && write_semaphore_) {
@@ -161,356 +616,807 @@ esp_err_t NiimbotPrinter::SendPacket(RequestCode code, const uint8_t* data, size
   return ESP_OK;
 }
 
-void NiimbotPrinter::HandleResponse(uint8_t type, const uint8_t* data, size_t data_len)
+esp_err_t NiimbotPrinter::StreamRowPacket(const uint8_t* pkt, size_t pkt_len)
 {
-  ESP_LOGI(kLogTag, "Response type=0x%02x len=%zu", type, data_len);
+  ESP_RETURN_ON_ERROR(tx_.Append(pkt, pkt_len), kLogTag, "failed to queue row packet");
+  return PaceRowStream();
+}
 
-  // Error response (0xDB = 219)
-  if (type == 0xDB) {
-    ESP_LOGE(kLogTag, "Printer error: 0x%02x", data_len > 0 ? data[0] : 0xFF);
-    return;
+esp_err_t NiimbotPrinter::StreamRowPacket(size_t max_len, const TxAggregator::BuildCallback& build)
+{
+  ESP_RETURN_ON_ERROR(tx_.Emplace(max_len, build), kLogTag, "failed to queue row packet");
+  return PaceRowStream();
+}
+
+esp_err_t NiimbotPrinter::PaceRowStream()
+{
+#if CONFIG_PRNM_PRINT_STREAM_ROWS
+  // Every kStreamCheckpoint rows go out with response to pace the stream
+  if (++stream_rows_ < kStreamCheckpoint) {
+    return ESP_OK;
   }
+  stream_rows_ = 0;
+#endif
+  return tx_.Flush(true);
+}
 
-  // Heartbeat response (0xDC + 1 = 0xDD)
-  if (type == 0xDD && data_len >= 9) {
-    switch (data_len) {
-      case 20:
-        status_.paper_state = data[18];
-        status_.rfid_read_state = data[19];
-        break;
-      case 13:
-        status_.closing_state = data[9];
-        status_.power_level = data[10];
-        status_.paper_state = data[11];
-        status_.rfid_read_state = data[12];
-        break;
-      case 19:
-        status_.closing_state = data[15];
-        status_.power_level = data[16];
-        status_.paper_state = data[17];
-        status_.rfid_read_state = data[18];
-        break;
-      case 10:
-        status_.closing_state = data[8];
-        status_.power_level = data[9];
-        break;
-      case 9:
-        status_.closing_state = data[8];
-        break;
-    }
-    ESP_LOGI(kLogTag, "Heartbeat: closing=%d power=%d paper=%d rfid=%d",
-             status_.closing_state, status_.power_level,
-             status_.paper_state, status_.rfid_read_state);
+esp_err_t NiimbotPrinter::DrainStream()
+{
+  if (!stream_credits_) {
+    return ESP_OK;
+  }
 
-    if (!ready_) {
-      ready_ = true;
-      ESP_LOGI(kLogTag, "Printer ready!");
-      if (ready_callback_) {
-        ready_callback_();
+  // Holding every credit means nothing is in flight
+  for (UBaseType_t i = 0; i < kStreamWindow; i++) {
+    if (xSemaphoreTake(stream_credits_, kWriteTimeout) != pdTRUE) {
+      while (i-- > 0) {
+        xSemaphoreGive(stream_credits_);
       }
+      return ESP_ERR_TIMEOUT;
     }
-    return;
   }
 
-  // Info responses (key + 0x40)
-  if (type == static_cast<uint8_t>(InfoKey::BATTERY) + 0x40) {
-    if (data_len > 0) {
-      ESP_LOGI(kLogTag, "Battery: %d%%", data[0]);
+  for (UBaseType_t i = 0; i < kStreamWindow; i++) {
+    xSemaphoreGive(stream_credits_);
+  }
+  return ESP_OK;
+}
+
+esp_err_t NiimbotPrinter::SendCommand(const uint8_t* pkt, size_t pkt_len, Transaction* tx)
+{
+  uint8_t type = pkt[2];
+  ESP_LOGD(kLogTag, "Sending packet type=0x%02x len=%d", type, pkt[3]);
+  if (!tx) {
+    return QueuePacket(pkt, pkt_len, true);
+  }
+
+  uint8_t expected = ResponseFor(static_cast<RequestCode>(type), pkt + 4, pkt[3]);
+  if (expected == 0) {
+    ESP_LOGE(kLogTag, "Command 0x%02x has no reply", type);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  // Open the transaction before sending, the reply may beat the write ack
+  xSemaphoreTake(transactions_mutex_, portMAX_DELAY);
+  size_t slot = kMaxTransactions;
+  for (size_t i = 0; i < kMaxTransactions; i++) {
+    if (transactions_[i].expected == 0) {
+      slot = i;
+      break;
     }
-    return;
   }
 
-  if (type == static_cast<uint8_t>(InfoKey::DEVICETYPE) + 0x40) {
-    if (data_len >= 2) {
-      uint16_t device_type = (data[0] << 8) | data[1];
-      ESP_LOGI(kLogTag, "Device type: %d (B1 = 4096)", device_type);
+  if (slot == kMaxTransactions) {
+    xSemaphoreGive(transactions_mutex_);
+    ESP_LOGE(kLogTag, "Too many pending transactions");
+    return ESP_ERR_NO_MEM;
+  }
+
+  auto& txn = transactions_[slot];
+  xSemaphoreTake(txn.done_semaphore, 0);
+  txn.expected = expected;
+  txn.done = false;
+  txn.seq = ++transaction_seq_;
+  txn.result = ESP_OK;
+  txn.response = {};
+  tx->slot = static_cast<uint8_t>(slot);
+  tx->seq = txn.seq;
+  xSemaphoreGive(transactions_mutex_);
+
+  esp_err_t err = QueuePacket(pkt, pkt_len, true);
+  if (err != ESP_OK) {
+    Cancel(*tx);
+  }
+  return err;
+}
+
+esp_err_t NiimbotPrinter::Wait(const Transaction& tx, TickType_t timeout, Response* response)
+{
+  if (tx.slot >= kMaxTransactions) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  // The reply may land right after the timeout, so check under the lock
+  auto& txn = transactions_[tx.slot];
+  xSemaphoreTake(txn.done_semaphore, timeout);
+
+  xSemaphoreTake(transactions_mutex_, portMAX_DELAY);
+  if (txn.seq != tx.seq || txn.expected == 0) {
+    xSemaphoreGive(transactions_mutex_);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  esp_err_t err = ESP_ERR_TIMEOUT;
+  if (txn.done) {
+    err = txn.result;
+    if (response) {
+      *response = txn.response;
     }
-    return;
+  } else {
+    ESP_LOGW(kLogTag, "Timeout waiting for response 0x%02x", txn.expected);
   }
 
-  // Print status response (0xA3 + 16 = 0xB3)
-  if (type == 0xB3 && data_len >= 4) {
-    uint16_t page = (data[0] << 8) | data[1];
-    uint8_t progress1 = data[2];
-    uint8_t progress2 = data[3];
-    ESP_LOGI(kLogTag, "Print status: page=%d progress=%d/%d", page, progress1, progress2);
+  txn.expected = 0;
+  xSemaphoreGive(transactions_mutex_);
+  return err;
+}
+
+void NiimbotPrinter::Cancel(const Transaction& tx)
+{
+  if (tx.slot >= kMaxTransactions) {
     return;
   }
 
-  // Config responses (SET_LABEL_TYPE, SET_LABEL_DENSITY)
-  if ((type == 0x31 || type == 0x33) && data_len > 0) {
-    ESP_LOGI(kLogTag, "Config response (0x%02x): success=%d", type, data[0]);
-    return;
+  xSemaphoreTake(transactions_mutex_, portMAX_DELAY);
+  auto& txn = transactions_[tx.slot];
+  if (txn.seq == tx.seq) {
+    txn.expected = 0;
   }
+  xSemaphoreGive(transactions_mutex_);
+}
 
-  // START_PRINT response (0x01 + 1 = 0x02)
-  if (type == 0x02 && data_len > 0) {
-    ESP_LOGI(kLogTag, "Start print: success=%d", data[0]);
-    return;
+void NiimbotPrinter::CompleteTransaction(const PacketView& packet)
+{
+  bool is_error = packet.type == static_cast<uint8_t>(ResponseCode::PRINTER_ERROR);
+
+  xSemaphoreTake(transactions_mutex_, portMAX_DELAY);
+
+  // The printer answers in order: the oldest matching transaction wins,
+  // errors don't name their command so they go to the oldest one
+  PendingTransaction* match = nullptr;
+  for (auto& txn : transactions_) {
+    if (txn.expected == 0 || txn.done) {
+      continue;
+    }
+    if (txn.expected != packet.type && !is_error) {
+      continue;
+    }
+    if (!match || static_cast<int32_t>(txn.seq - match->seq) < 0) {
+      match = &txn;
+    }
   }
 
-  // START_PAGE_PRINT response (0x03 + 1 = 0x04)
-  if (type == 0x04 && data_len > 0) {
-    ESP_LOGI(kLogTag, "Start page: success=%d", data[0]);
-    return;
+  if (match) {
+    size_t len = packet.len < kMaxResponseLen ? packet.len : kMaxResponseLen;
+    match->response.type = packet.type;
+    match->response.len = static_cast<uint8_t>(len);
+    memcpy(match->response.data, packet.data, len);
+    match->result = is_error ? ESP_ERR_INVALID_RESPONSE : ESP_OK;
+    match->done = true;
+    xSemaphoreGive(match->done_semaphore);
   }
 
-  // SET_DIMENSION response (0x13 + 1 = 0x14)
-  if (type == 0x14 && data_len > 0) {
-    ESP_LOGI(kLogTag, "Set dimension: success=%d", data[0]);
-    return;
+  xSemaphoreGive(transactions_mutex_);
+}
+
+constexpr NiimbotPrinter::ResponseHandlers NiimbotPrinter::MakeResponseHandlers()
+{
+  ResponseHandlers handlers = {};
+  for (auto& handler : handlers) {
+    handler = &NiimbotPrinter::HandleUnknown;
   }
 
-  // END_PAGE_PRINT response (0xE3 + 1 = 0xE4)
-  if (type == 0xE4 && data_len > 0) {
-    ESP_LOGI(kLogTag, "End page: success=%d", data[0]);
-    return;
+  auto set = [&handlers](ResponseCode code, ResponseHandler handler) {
+    handlers[static_cast<uint8_t>(code)] = handler;
+  };
+  set(ResponseCode::PRINTER_ERROR, &NiimbotPrinter::HandleError);
+  set(ResponseCode::HEARTBEAT, &NiimbotPrinter::HandleHeartbeat);
+  set(ResponseCode::PRINT_STATUS, &NiimbotPrinter::HandlePrintStatus);
+  set(ResponseCode::SET_LABEL_DENSITY, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::SET_LABEL_TYPE, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::START_PRINT, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::START_PAGE_PRINT, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::SET_DIMENSION, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::SET_QUANTITY, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::ALLOW_PRINT_CLEAR, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::END_PAGE_PRINT, &NiimbotPrinter::HandleAck);
+  set(ResponseCode::END_PRINT, &NiimbotPrinter::HandleAck);
+
+  // Info replies are keyed by the requested info
+  for (uint8_t key = 1; key <= InfoView::kMaxKey; key++) {
+    handlers[InfoView::kTypeBase + key] = &NiimbotPrinter::HandleInfo;
   }
+  return handlers;
+}
+
+constexpr NiimbotPrinter::ResponseHandlers NiimbotPrinter::kResponseHandlers = MakeResponseHandlers();
 
-  // END_PRINT response (0xF3 + 1 = 0xF4)
-  if (type == 0xF4 && data_len > 0) {
-    ESP_LOGI(kLogTag, "End print: success=%d", data[0]);
+void NiimbotPrinter::HandleResponse(const PacketView& packet)
+{
+  ESP_LOGD(kLogTag, "Response type=0x%02x len=%zu", packet.type, packet.len);
+  (this->*kResponseHandlers[packet.type])(packet);
+}
+
+void NiimbotPrinter::HandleError(const PacketView& packet)
+{
+  uint8_t error = packet.len > 0 ? packet.data[0] : 0xFF;
+  response_stats_.errors++;
+  ESP_LOGE(kLogTag, "Printer error: 0x%02x", error);
+  Notify(error_subscribers_, error);
+}
+
+void NiimbotPrinter::HandleHeartbeat(const PacketView& packet)
+{
+  HeartbeatView heartbeat(packet);
+  if (!heartbeat.IsValid()) {
+    HandleUnknown(packet);
     return;
   }
 
-  ESP_LOGI(kLogTag, "Unknown response type 0x%02x", type);
-  ESP_LOG_BUFFER_HEX_LEVEL(kLogTag, data, data_len, ESP_LOG_INFO);
+  using Field = HeartbeatView::Field;
+  heartbeat.Get(Field::ClosingState, &status_.closing_state);
+  heartbeat.Get(Field::PowerLevel, &status_.power_level);
+  heartbeat.Get(Field::PaperState, &status_.paper_state);
+  heartbeat.Get(Field::RfidReadState, &status_.rfid_read_state);
+  ESP_LOGI(kLogTag, "Heartbeat: closing=%d power=%d paper=%d rfid=%d",
+           status_.closing_state, status_.power_level,
+           status_.paper_state, status_.rfid_read_state);
+  Notify(status_subscribers_, status_);
+
+  if (!ready_) {
+    ready_ = true;
+    ESP_LOGI(kLogTag, "Printer ready!");
+    if (ready_callback_) {
+      ready_callback_();
+    }
+  }
 }
 
-void NiimbotPrinter::ProcessReceivedData(const uint8_t* data, size_t len)
+void NiimbotPrinter::HandleInfo(const PacketView& packet)
 {
-  // Append to buffer
-  if (packet_buf_len_ + len > sizeof(packet_buf_)) {
-    ESP_LOGW(kLogTag, "Packet buffer overflow, resetting");
-    packet_buf_len_ = 0;
-  }
-  memcpy(packet_buf_ + packet_buf_len_, data, len);
-  packet_buf_len_ += len;
-
-  // Try to parse packets
-  while (packet_buf_len_ >= 7) {
-    uint8_t type;
-    uint8_t pkt_data[256];
-    size_t pkt_data_len;
-
-    // Find start markers
-    size_t start_idx = 0;
-    while (start_idx < packet_buf_len_ - 1) {
-      if (packet_buf_[start_idx] == kPacketStart1 &&
-          packet_buf_[start_idx + 1] == kPacketStart2) {
-        break;
-      }
-      start_idx++;
-    }
+  InfoView info(packet);
+  if (!info.IsValid()) {
+    HandleUnknown(packet);
+    return;
+  }
 
-    if (start_idx > 0) {
-      // Remove garbage before start markers
-      memmove(packet_buf_, packet_buf_ + start_idx, packet_buf_len_ - start_idx);
-      packet_buf_len_ -= start_idx;
-    }
+  switch (static_cast<InfoKey>(info.Key())) {
+    case InfoKey::BATTERY:
+      ESP_LOGI(kLogTag, "Battery: %d%%", info.U8());
+      break;
+    case InfoKey::DEVICETYPE:
+      ESP_LOGI(kLogTag, "Device type: %d (B1 = 4096)", info.U16());
+      break;
+    default:
+      ESP_LOGI(kLogTag, "Info %d:", info.Key());
+      ESP_LOG_BUFFER_HEX_LEVEL(kLogTag, packet.data, packet.len, ESP_LOG_INFO);
+      break;
+  }
+}
 
-    if (packet_buf_len_ < 7) {
-      break;  // Not enough data
-    }
+void NiimbotPrinter::HandlePrintStatus(const PacketView& packet)
+{
+  PrintStatusView print_status(packet);
+  if (!print_status.IsValid()) {
+    HandleUnknown(packet);
+    return;
+  }
 
-    if (ParsePacket(packet_buf_, packet_buf_len_, &type, pkt_data, &pkt_data_len)) {
-      HandleResponse(type, pkt_data, pkt_data_len);
+  progress_.page = print_status.Page();
+  progress_.print = print_status.Print();
+  progress_.feed = print_status.Feed();
+  ESP_LOGD(kLogTag, "Print status: page=%d progress=%d/%d", progress_.page, progress_.print, progress_.feed);
+  Notify(progress_subscribers_, progress_);
+}
 
-      // Remove processed packet from buffer
-      size_t pkt_total_len = pkt_data_len + 7;
-      memmove(packet_buf_, packet_buf_ + pkt_total_len, packet_buf_len_ - pkt_total_len);
-      packet_buf_len_ -= pkt_total_len;
-    } else {
-      // Check if we have the length byte and know the expected packet size
-      if (packet_buf_len_ >= 4) {
-        size_t expected_len = packet_buf_[3] + 7;
-        if (packet_buf_len_ < expected_len) {
-          break;  // Wait for more data
-        }
-        // Packet complete but invalid, skip first byte and try again
-        memmove(packet_buf_, packet_buf_ + 1, packet_buf_len_ - 1);
-        packet_buf_len_--;
-      } else {
-        break;  // Wait for more data
-      }
-    }
+void NiimbotPrinter::HandleAck(const PacketView& packet)
+{
+  if (packet.len == 0) {
+    HandleUnknown(packet);
+    return;
+  }
+
+  // Command acks carry a success flag in the first byte, the waiting
+  // transaction reports failures
+  if (packet.data[0] != 0) {
+    response_stats_.acks++;
+    ESP_LOGD(kLogTag, "Ack 0x%02x", packet.type);
+  } else {
+    response_stats_.failed_acks++;
+    ESP_LOGW(kLogTag, "Command rejected (reply 0x%02x)", packet.type);
   }
 }
 
+void NiimbotPrinter::HandleUnknown(const PacketView& packet)
+{
+  response_stats_.unknown++;
+  ESP_LOGI(kLogTag, "Unknown response type 0x%02x", packet.type);
+  ESP_LOG_BUFFER_HEX_LEVEL(kLogTag, packet.data, packet.len, ESP_LOG_INFO);
+}
+
+void NiimbotPrinter::ProcessReceivedData(const uint8_t* data, size_t len)
+{
+  rx_.Feed(data, len);
+}
+
 // Commands
 
-esp_err_t NiimbotPrinter::SendHeartbeat()
+esp_err_t NiimbotPrinter::SendHeartbeat(Transaction* tx)
 {
-  uint8_t data[] = {0x01};
   ESP_LOGI(kLogTag, "Sending heartbeat...");
-  return SendPacket(RequestCode::HEARTBEAT, data, sizeof(data));
+  return SendCommand(kHeartbeatPacket, tx);
 }
 
-esp_err_t NiimbotPrinter::GetDeviceInfo(InfoKey key)
+esp_err_t NiimbotPrinter::GetDeviceInfo(InfoKey key, Transaction* tx)
 {
-  uint8_t data[] = {static_cast<uint8_t>(key)};
   ESP_LOGI(kLogTag, "Requesting info key=%d", static_cast<int>(key));
-  return SendPacket(RequestCode::GET_INFO, data, sizeof(data));
+  return SendCommand(ByteLayout::Build(static_cast<uint8_t>(RequestCode::GET_INFO), static_cast<uint8_t>(key)), tx);
 }
 
-esp_err_t NiimbotPrinter::SetLabelDensity(uint8_t density)
+esp_err_t NiimbotPrinter::SetLabelDensity(uint8_t density, Transaction* tx)
 {
-  uint8_t data[] = {density};
   ESP_LOGI(kLogTag, "Setting label density to %d", density);
-  return SendPacket(RequestCode::SET_LABEL_DENSITY, data, sizeof(data));
+  return SendCommand(ByteLayout::Build(static_cast<uint8_t>(RequestCode::SET_LABEL_DENSITY), density), tx);
 }
 
-esp_err_t NiimbotPrinter::SetLabelType(uint8_t type)
+esp_err_t NiimbotPrinter::SetLabelType(uint8_t type, Transaction* tx)
 {
-  uint8_t data[] = {type};
   ESP_LOGI(kLogTag, "Setting label type to %d", type);
-  return SendPacket(RequestCode::SET_LABEL_TYPE, data, sizeof(data));
+  return SendCommand(ByteLayout::Build(static_cast<uint8_t>(RequestCode::SET_LABEL_TYPE), type), tx);
 }
 
-esp_err_t NiimbotPrinter::StartPrint(uint16_t total_pages, uint8_t page_color)
+esp_err_t NiimbotPrinter::StartPrint(uint16_t total_pages, uint8_t page_color, Transaction* tx)
 {
-  uint8_t data[] = {
-      static_cast<uint8_t>(total_pages >> 8),
-      static_cast<uint8_t>(total_pages & 0xFF),
-      0x00, 0x00, 0x00, 0x00,  // Reserved zeros
-      page_color};
   ESP_LOGI(kLogTag, "Starting print (pages=%d, color=%d)", total_pages, page_color);
-  return SendPacket(RequestCode::START_PRINT, data, sizeof(data));
+  return SendCommand(StartPrintLayout::Build(static_cast<uint8_t>(RequestCode::START_PRINT),
+                                             total_pages, 0, page_color), tx);
 }
 
-esp_err_t NiimbotPrinter::StartPagePrint()
+esp_err_t NiimbotPrinter::StartPagePrint(Transaction* tx)
 {
-  uint8_t data[] = {0x01};
   ESP_LOGI(kLogTag, "Starting page...");
-  return SendPacket(RequestCode::START_PAGE_PRINT, data, sizeof(data));
+  return SendCommand(kStartPagePacket, tx);
 }
 
-esp_err_t NiimbotPrinter::SetPageSize(uint16_t rows, uint16_t cols, uint16_t copies)
+esp_err_t NiimbotPrinter::SetPageSize(uint16_t rows, uint16_t cols, uint16_t copies, Transaction* tx)
 {
-  uint8_t data[] = {
-      static_cast<uint8_t>(rows >> 8),
-      static_cast<uint8_t>(rows & 0xFF),
-      static_cast<uint8_t>(cols >> 8),
-      static_cast<uint8_t>(cols & 0xFF),
-      static_cast<uint8_t>(copies >> 8),
-      static_cast<uint8_t>(copies & 0xFF),
-  };
   ESP_LOGI(kLogTag, "Setting page size: %dx%d, copies=%d", rows, cols, copies);
-  return SendPacket(RequestCode::SET_DIMENSION, data, sizeof(data));
+  return SendCommand(SetDimensionLayout::Build(static_cast<uint8_t>(RequestCode::SET_DIMENSION),
+                                               rows, cols, copies), tx);
 }
 
-esp_err_t NiimbotPrinter::SendBitmapRow(uint16_t row_num, const uint8_t* row_data, size_t row_len)
+esp_err_t NiimbotPrinter::SendBitmapRow(uint16_t row_num, const uint8_t* row_data, size_t row_len,
+                                        uint8_t repeat)
 {
-  uint8_t pkt_data[256];
+  // Bit counts are only known for full rows, the printer takes 0,0,0 too
+  uint8_t counts[3] = {0, 0, 0};
+  if (row_len == kRowBytes) {
+    CountBitmapPixels(row_data, counts);
+  }
+  uint8_t row_xor = XorBytes(row_data, row_len);
+  return StreamRowPacket(kRowPacketHeader + row_len + PacketWriter::kOverhead, [&](uint8_t* buf, size_t size) {
+    PacketWriter pkt(buf, size, static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW));
+    BitmapRowData(pkt, row_num, counts, row_data, row_len, row_xor, repeat);
+    return pkt.Finish();
+  });
+}
 
-  // Row number (big endian)
-  pkt_data[0] = static_cast<uint8_t>(row_num >> 8);
-  pkt_data[1] = static_cast<uint8_t>(row_num & 0xFF);
+esp_err_t NiimbotPrinter::SendEmptyRow(uint16_t row_num, uint8_t count)
+{
+  return StreamRowPacket(3 + PacketWriter::kOverhead, [&](uint8_t* buf, size_t size) {
+    PacketWriter pkt(buf, size, static_cast<uint8_t>(RequestCode::PRINT_EMPTY_ROW));
+    EmptyRowData(pkt, row_num, count);
+    return pkt.Finish();
+  });
+}
 
-  // Bit counts (can be 0,0,0)
-  pkt_data[2] = 0;
-  pkt_data[3] = 0;
-  pkt_data[4] = 0;
+esp_err_t NiimbotPrinter::SendIndexedRow(uint16_t row_num, const Signs::RleRun* runs, size_t num_runs,
+                                         uint8_t repeat)
+{
+  size_t pixels = 0;
+  for (size_t i = 0; i < num_runs; i++) {
+    pixels += runs[i].len;
+  }
 
-  // Repeat count
-  pkt_data[5] = 1;
+  return StreamRowPacket(kRowPacketHeader + 2 * pixels + PacketWriter::kOverhead, [&](uint8_t* buf, size_t size) {
+    PacketWriter pkt(buf, size, static_cast<uint8_t>(RequestCode::PRINT_BITMAP_ROW_INDEXED));
+    IndexedRowData(pkt, row_num, runs, num_runs, repeat);
+    return pkt.Finish();
+  });
+}
 
-  // Copy row data
-  memcpy(pkt_data + 6, row_data, row_len);
+esp_err_t NiimbotPrinter::EndPagePrint(Transaction* tx)
+{
+  ESP_LOGI(kLogTag, "Ending page...");
+  return SendCommand(kEndPagePacket, tx);
+}
 
-  return SendPacket(RequestCode::PRINT_BITMAP_ROW, pkt_data, 6 + row_len);
+esp_err_t NiimbotPrinter::EndPrint(Transaction* tx)
+{
+  ESP_LOGI(kLogTag, "Ending print...");
+  return SendCommand(kEndPrintPacket, tx);
 }
 
-esp_err_t NiimbotPrinter::SendEmptyRow(uint16_t row_num, uint8_t count)
+esp_err_t NiimbotPrinter::GetPrintStatus(Transaction* tx)
 {
-  uint8_t data[] = {
-      static_cast<uint8_t>(row_num >> 8),
-      static_cast<uint8_t>(row_num & 0xFF),
-      count};
-  return SendPacket(RequestCode::PRINT_EMPTY_ROW, data, sizeof(data));
+  return SendCommand(kPrintStatusPacket, tx);
 }
 
-esp_err_t NiimbotPrinter::EndPagePrint()
+esp_err_t NiimbotPrinter::WaitAck(esp_err_t send_err, const Transaction& tx)
 {
-  uint8_t data[] = {0x01};
-  ESP_LOGI(kLogTag, "Ending page...");
-  return SendPacket(RequestCode::END_PAGE_PRINT, data, sizeof(data));
+  if (send_err != ESP_OK) {
+    return send_err;
+  }
+
+  Response response;
+  ESP_RETURN_ON_ERROR(Wait(tx, kCommandTimeout, &response), kLogTag, "no ack from printer");
+  if (!response.Succeeded()) {
+    ESP_LOGW(kLogTag, "Printer rejected command (response 0x%02x)", response.type);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+  return ESP_OK;
 }
 
-esp_err_t NiimbotPrinter::EndPrint()
+esp_err_t NiimbotPrinter::WaitPrinted(uint16_t total_pages)
 {
-  uint8_t data[] = {0x01};
-  ESP_LOGI(kLogTag, "Ending print...");
-  return SendPacket(RequestCode::END_PRINT, data, sizeof(data));
+  TickType_t start = xTaskGetTickCount();
+  while (true) {
+    Transaction tx;
+    ESP_RETURN_ON_ERROR(GetPrintStatus(&tx), kLogTag, "failed to get print status");
+    ESP_RETURN_ON_ERROR(Wait(tx, kCommandTimeout), kLogTag, "failed to get print status");
+
+    if (progress_.page >= total_pages && progress_.print == 100 && progress_.feed == 100) {
+      return ESP_OK;
+    }
+
+    if (xTaskGetTickCount() - start > kPrintedTimeout * total_pages) {
+      ESP_LOGW(kLogTag, "Timeout waiting for page %d to print", total_pages);
+      return ESP_ERR_TIMEOUT;
+    }
+    vTaskDelay(kStatusPollInterval);
+  }
+}
+
+esp_err_t NiimbotPrinter::EncodeRows(const Signs::RleImage& image, uint16_t print_height,
+                                     const std::atomic<bool>* cancel, const RowPacketSink& sink,
+                                     size_t* packets)
+{
+  if (image.plan) {
+    return EncodePlannedRows(image, print_height, cancel, sink, packets);
+  }
+
+  // Rows are read in order, delta coded ones build on the row before
+  Signs::RowReader reader(image);
+
+  // Runs of identical rows are collapsed into a single packet
+  EncodedRow row_bufs[2];
+  EncodedRow* run_row = &row_bufs[0];
+  EncodedRow* row = &row_bufs[1];
+  uint16_t run_start = 0;
+  uint8_t run_count = 0;
+  *packets = 0;
+
+  // Packets are built straight into the sink's buffer
+  TxAggregator::BuildCallback build = [&](uint8_t* buf, size_t size) {
+    return run_row->BuildPacket(run_start, run_count, buf, size);
+  };
+  auto emit_run = [&]() {
+    (*packets)++;
+    return sink(run_row->MaxPacketLen(), build);
+  };
+
+  for (uint16_t y = 0; y < print_height; y++) {
+    if (IsCancelled(cancel)) {
+      ESP_LOGW(kLogTag, "Image data cancelled at row %d", y);
+      return ESP_ERR_NOT_FINISHED;
+    }
+
+    row->Encode(reader, y);
+
+    if (run_count > 0 && run_count < UINT8_MAX && row->SameAs(*run_row)) {
+      run_count++;
+    } else {
+      if (run_count > 0) {
+        ESP_RETURN_ON_ERROR(emit_run(), kLogTag, "failed to encode rows");
+      }
+
+      std::swap(run_row, row);
+      run_start = y;
+      run_count = 1;
+    }
+  }
+
+  if (run_count > 0) {
+    ESP_RETURN_ON_ERROR(emit_run(), kLogTag, "failed to encode rows");
+  }
+  return ESP_OK;
 }
 
-esp_err_t NiimbotPrinter::GetPrintStatus()
+esp_err_t NiimbotPrinter::EncodePlannedRows(const Signs::RleImage& image, uint16_t print_height,
+                                            const std::atomic<bool>* cancel, const RowPacketSink& sink,
+                                            size_t* packets)
 {
-  uint8_t data[] = {0x01};
-  return SendPacket(RequestCode::GET_PRINT_STATUS, data, sizeof(data));
+  // Every step is one packet, only its first row is read
+  Signs::RowReader reader(image);
+  Signs::PlanReader plan(image);
+  Signs::PlanStep step;
+  EncodedRow row;
+  uint8_t count = 0;
+  *packets = 0;
+
+  TxAggregator::BuildCallback build = [&](uint8_t* buf, size_t size) {
+    return row.BuildPacket(step.row, count, buf, size);
+  };
+
+  while (plan.Next(&step) && step.row < print_height) {
+    if (IsCancelled(cancel)) {
+      ESP_LOGW(kLogTag, "Image data cancelled at row %d", step.row);
+      return ESP_ERR_NOT_FINISHED;
+    }
+
+    count = step.rows < print_height - step.row ? step.rows : print_height - step.row;
+    row.Encode(reader, step);
+    (*packets)++;
+    ESP_RETURN_ON_ERROR(sink(row.MaxPacketLen(), build), kLogTag, "failed to encode rows");
+  }
+  return ESP_OK;
+}
+
+esp_err_t NiimbotPrinter::Prefetch(const Signs::RleImage& image)
+{
+  if (image.packets) {
+    return ESP_OK;  // Nothing to encode, rows go straight from flash
+  }
+
+  if (!prefetch_.buf) {
+    // The cache is only read sequentially, so PSRAM is fine when present
+    prefetch_.buf = static_cast<uint8_t*>(heap_caps_malloc(kPrefetchCapacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));
+    if (!prefetch_.buf) {
+      prefetch_.buf = static_cast<uint8_t*>(heap_caps_malloc(kPrefetchCapacity, MALLOC_CAP_8BIT));
+    }
+    if (!prefetch_.buf) {
+      ESP_LOGE(kLogTag, "Failed to allocate prefetch cache");
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  int64_t start = esp_timer_get_time();
+  uint16_t print_height = image.h < kPaperHeightDots ? image.h : kPaperHeightDots;
+
+  prefetch_.image = nullptr;
+  prefetch_.len = 0;
+  size_t packets = 0;
+  esp_err_t err = EncodeRows(image, print_height, nullptr, [this](size_t, const TxAggregator::BuildCallback& build) {
+    size_t pkt_len = build(prefetch_.buf + prefetch_.len, kPrefetchCapacity - prefetch_.len);
+    if (pkt_len == 0) {
+      return ESP_ERR_NO_MEM;
+    }
+    prefetch_.len += pkt_len;
+    return ESP_OK;
+  }, &packets);
+  ESP_RETURN_ON_ERROR(err, kLogTag, "failed to prefetch image");
+
+  prefetch_.image = &image;
+  prefetch_.rows = print_height;
+  prefetch_.packets = packets;
+  prefetch_.encode_us = static_cast<uint32_t>(esp_timer_get_time() - start);
+  ESP_LOGI(kLogTag, "Prefetched %d rows: %zu packets, %zu bytes in %lu us", print_height, packets,
+           prefetch_.len, static_cast<unsigned long>(prefetch_.encode_us));
+  return ESP_OK;
+}
+
+esp_err_t NiimbotPrinter::StreamPackets(const uint8_t* buf, size_t len, const std::atomic<bool>* cancel,
+                                        size_t* packets)
+{
+  *packets = 0;
+  for (size_t off = 0; off < len; (*packets)++) {
+    if (IsCancelled(cancel)) {
+      ESP_LOGW(kLogTag, "Image data cancelled at packet %zu", *packets);
+      return ESP_ERR_NOT_FINISHED;
+    }
+    // Streams come from flash, a truncated one must not read past it
+    ESP_RETURN_ON_FALSE(len - off >= PacketWriter::kOverhead && buf[off + 3] + PacketWriter::kOverhead <= len - off,
+                        ESP_ERR_INVALID_SIZE, kLogTag, "packet %zu overruns the stream", *packets);
+    size_t pkt_len = buf[off + 3] + PacketWriter::kOverhead;
+    ESP_RETURN_ON_ERROR(StreamRowPacket(buf + off, pkt_len), kLogTag, "failed to stream packet");
+    off += pkt_len;
+  }
+  return ESP_OK;
 }
 
-esp_err_t NiimbotPrinter::Print(const Signs::RleImage& image)
+esp_err_t NiimbotPrinter::SendImageRows(const Signs::RleImage& image, uint16_t print_height,
+                                        const std::atomic<bool>* cancel)
+{
+  ESP_LOGI(kLogTag, "Sending %d rows of image data...", print_height);
+  int64_t rows_start = esp_timer_get_time();
+  stream_rows_ = 0;
+
+  bool first_row = true;
+  auto mark_first_row = [&]() {
+    if (first_row) {
+      first_row = false;
+      prefetch_stats_.first_row_us = static_cast<uint32_t>(esp_timer_get_time() - rows_start);
+    }
+  };
+
+  esp_err_t err = ESP_OK;
+  size_t packets = 0;
+  if (image.packets && print_height == image.h) {
+    // Encoded when the assets were generated
+    mark_first_row();
+    err = StreamPackets(image.packets, image.packets_len, cancel, &packets);
+  } else if (prefetch_.image == &image && prefetch_.rows == print_height) {
+    // Prefetched, only stream out the ready packets
+    prefetch_stats_.hits++;
+    prefetch_stats_.saved_us = prefetch_.encode_us;
+    mark_first_row();
+    err = StreamPackets(prefetch_.buf, prefetch_.len, cancel, &packets);
+  } else {
+    prefetch_stats_.misses++;
+    err = EncodeRows(image, print_height, cancel, [&](size_t max_len, const TxAggregator::BuildCallback& build) {
+      mark_first_row();
+      return StreamRowPacket(max_len, build);
+    }, &packets);
+  }
+
+  if (err == ESP_ERR_NOT_FINISHED) {
+    // Cancelled, still wait for what was sent
+    tx_.Flush(false);
+    DrainStream();
+    return err;
+  }
+  ESP_RETURN_ON_ERROR(err, kLogTag, "failed to send rows");
+
+  ESP_RETURN_ON_ERROR(tx_.Flush(false), kLogTag, "failed to flush image data");
+  ESP_RETURN_ON_ERROR(DrainStream(), kLogTag, "failed to flush image data");
+  ESP_LOGI(kLogTag, "Image data sent in %d ms! (%zu packets for %d rows, %zu saved, first row after %lu us)",
+           static_cast<int>((esp_timer_get_time() - rows_start) / 1000),
+           packets, print_height, print_height - packets,
+           static_cast<unsigned long>(prefetch_stats_.first_row_us));
+  return ESP_OK;
+}
+
+esp_err_t NiimbotPrinter::Print(const Signs::RleImage& image, uint16_t copies, const std::atomic<bool>* cancel)
+{
+  Page page = {&image, copies};
+  return PrintPages(&page, 1, cancel);
+}
+
+esp_err_t NiimbotPrinter::PrintPages(const Page* pages, size_t num_pages, const std::atomic<bool>* cancel)
 {
   if (!ready_) {
     ESP_LOGW(kLogTag, "Printer not ready");
     return ESP_ERR_INVALID_STATE;
   }
 
+  // The printer counts every printed label, copies included
+  uint32_t total_labels = 0;
+  for (size_t i = 0; i < num_pages; i++) {
+    if (!pages[i].image || pages[i].copies == 0) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    total_labels += pages[i].copies;
+  }
+  if (num_pages == 0 || total_labels > UINT16_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
   ESP_LOGI(kLogTag, "Starting print...");
-  ESP_LOGI(kLogTag, "   Image: %dx%d dots", image.w, image.h);
+  ESP_LOGI(kLogTag, "   %zu page(s), %lu labels", num_pages, static_cast<unsigned long>(total_labels));
+  int64_t print_start = esp_timer_get_time();
+
+  // Each step moves on once the printer answered it
+  PrintStep step = PrintStep::Configure;
+  size_t page = 0;
+  bool cancelled = false;
+  // First error once the session was opened, reported after closing it
+  esp_err_t failed = ESP_OK;
+  while (step != PrintStep::Done) {
+    if (!cancelled && IsCancelled(cancel)) {
+      ESP_LOGW(kLogTag, "Print cancelled at step %d", static_cast<int>(step));
+      cancelled = true;
+      if (step <= PrintStep::StartPrint) {
+        return ESP_ERR_NOT_FINISHED;
+      }
+      // Close the session so the printer is left idle
+      step = PrintStep::EndPrint;
+    }
 
-  // Row data buffer: 384 pixels = 48 bytes
-  constexpr size_t kRowBytes = kPaperWidthDots / 8;
-  uint8_t row_data[kRowBytes];
+    const Signs::RleImage& image = *pages[page].image;
+    // Use image dimensions (capped to paper size)
+    uint16_t print_height = image.h < kPaperHeightDots ? image.h : kPaperHeightDots;
+
+    esp_err_t err = ESP_OK;
+    PrintStep next = PrintStep::Done;
+    Transaction tx;
+
+    switch (step) {
+      case PrintStep::Configure: {
+        // Density (3 = medium) and label type (1 = with gaps) are
+        // independent, so both requests are in flight at once
+        Transaction type_tx;
+        err = SetLabelDensity(3, &tx);
+        if (err == ESP_OK) {
+          err = SetLabelType(1, &type_tx);
+          if (err != ESP_OK) {
+            Cancel(tx);
+          }
+        }
+        if (err == ESP_OK) {
+          err = WaitAck(ESP_OK, tx);
+          esp_err_t type_err = WaitAck(ESP_OK, type_tx);
+          if (err == ESP_OK) {
+            err = type_err;
+          }
+        }
+        next = PrintStep::StartPrint;
+        break;
+      }
 
-  // Use image dimensions (capped to paper size)
-  uint16_t print_height = image.h < kPaperHeightDots ? image.h : kPaperHeightDots;
+      case PrintStep::StartPrint:
+        err = WaitAck(StartPrint(total_labels, 0, &tx), tx);
+        next = PrintStep::StartPage;
+        break;
 
-  // Step 1: Set density (3 = medium)
-  ESP_RETURN_ON_ERROR(SetLabelDensity(3), kLogTag, "failed to set label density");
-  vTaskDelay(pdMS_TO_TICKS(10));
+      case PrintStep::StartPage:
+        ESP_LOGI(kLogTag, "   Page %zu: %dx%d dots, %d copies", page + 1, image.w, image.h, pages[page].copies);
+        err = WaitAck(StartPagePrint(&tx), tx);
+        next = PrintStep::SetPageSize;
+        break;
 
-  // Step 2: Set label type (1 = with gaps)
-  ESP_RETURN_ON_ERROR(SetLabelType(1), kLogTag, "failed to set label type");
-  vTaskDelay(pdMS_TO_TICKS(10));
+      case PrintStep::SetPageSize:
+        // Copies are printed by the printer from a single transfer
+        err = WaitAck(SetPageSize(print_height, kPaperWidthDots, pages[page].copies, &tx), tx);
+        next = PrintStep::SendRows;
+        break;
 
-  // Step 3: Start print
-  ESP_RETURN_ON_ERROR(StartPrint(1, 0), kLogTag, "failed to start print");
-  vTaskDelay(pdMS_TO_TICKS(10));
+      case PrintStep::SendRows:
+        err = SendImageRows(image, print_height, cancel);
+        if (err == ESP_ERR_NOT_FINISHED) {
+          // Cancelled, handled at the top of the loop
+          continue;
+        }
+        next = PrintStep::EndPage;
+        break;
 
-  // Step 4: Start page
-  ESP_RETURN_ON_ERROR(StartPagePrint(), kLogTag, "failed to start page print");
-  vTaskDelay(pdMS_TO_TICKS(10));
+      case PrintStep::EndPage:
+        err = WaitAck(EndPagePrint(&tx), tx);
+        if (++page < num_pages) {
+          next = PrintStep::StartPage;
+        } else {
+          page = 0;
+          next = PrintStep::WaitPrinted;
+        }
+        break;
 
-  // Step 5: Set page size (height, width)
-  ESP_RETURN_ON_ERROR(SetPageSize(print_height, kPaperWidthDots, 1), kLogTag, "failed to set page size");
-  vTaskDelay(pdMS_TO_TICKS(10));
+      case PrintStep::WaitPrinted:
+        err = WaitPrinted(total_labels);
+        next = PrintStep::EndPrint;
+        break;
 
-  // Step 6: Send image data
-  ESP_LOGI(kLogTag, "Sending %d rows of image data...", print_height);
+      case PrintStep::EndPrint:
+        err = WaitAck(EndPrint(&tx), tx);
+        next = PrintStep::Done;
+        break;
 
-  for (uint16_t y = 0; y < print_height; y++) {
-    // Decode the RLE row into 1bpp format
-    Signs::decode_rle_row_1bpp(image, y, row_data, kRowBytes);
-    ESP_RETURN_ON_ERROR(SendBitmapRow(y, row_data, kRowBytes), kLogTag, "failed to send bitmap row");
+      case PrintStep::Done:
+        break;
+    }
 
-    // Progress logging every 60 rows
-    if ((y % 60) == 59) {
-      ESP_LOGI(kLogTag, "   Progress: %d/%d rows", y + 1, print_height);
+    if (err != ESP_OK) {
+      ESP_LOGE(kLogTag, "Print failed at step %d: %s", static_cast<int>(step), esp_err_to_name(err));
+      if (failed != ESP_OK) {
+        return failed;
+      }
+      if (step < PrintStep::StartPrint || step == PrintStep::EndPrint) {
+        return err;
+      }
+      // Close the session, best effort, so the next print starts clean
+      failed = err;
+      step = PrintStep::EndPrint;
+      continue;
     }
+    step = next;
   }
 
-  ESP_LOGI(kLogTag, "Image data sent!");
-
-  // Step 7: End page
-  vTaskDelay(pdMS_TO_TICKS(100));
-  ESP_RETURN_ON_ERROR(EndPagePrint(), kLogTag, "failed to end page print");
-
-  // Step 8: Wait for printer to finish and end print
-  vTaskDelay(pdMS_TO_TICKS(2000));
-  ESP_RETURN_ON_ERROR(EndPrint(), kLogTag, "failed to end print");
+  if (failed != ESP_OK) {
+    return failed;
+  }
+  if (cancelled) {
+    return ESP_ERR_NOT_FINISHED;
+  }
 
-  ESP_LOGI(kLogTag, "Print complete!");
+  ESP_LOGI(kLogTag, "Print complete in %d ms! (%lu labels)",
+           static_cast<int>((esp_timer_get_time() - print_start) / 1000), static_cast<unsigned long>(total_labels));
   return ESP_OK;
 }
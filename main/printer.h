@@ -2,14 +2,20 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <array>
+#include <atomic>
 #include <functional>
 
 #include <esp_err.h>
 
 #include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
 #include <freertos/semphr.h>
 
+#include "frame_reader.h"
+#include "packet_view.h"
 #include "signs.h"
+#include "tx_aggregator.h"
 
 namespace PRNM {
 
@@ -41,6 +47,22 @@ public:
     PRINT_BITMAP_ROW = 0x85,
   };
 
+  // Niimbot response codes
+  enum class ResponseCode : uint8_t {
+    PRINTER_ERROR = 0xDB,
+    HEARTBEAT = 0xDD,
+    SET_LABEL_DENSITY = 0x31,
+    SET_LABEL_TYPE = 0x33,
+    START_PRINT = 0x02,
+    START_PAGE_PRINT = 0x04,
+    SET_DIMENSION = 0x14,
+    SET_QUANTITY = 0x16,
+    ALLOW_PRINT_CLEAR = 0x30,
+    END_PAGE_PRINT = 0xE4,
+    END_PRINT = 0xF4,
+    PRINT_STATUS = 0xB3,
+  };
+
   // Info request keys
   enum class InfoKey : uint8_t {
     DENSITY = 1,
@@ -63,10 +85,53 @@ public:
     uint8_t rfid_read_state = 0;
   };
 
-  // Callback type for sending packets over BLE
-  using SendPacketCallback = std::function<void(const uint8_t* data, size_t len, bool wait_for_response)>;
+  // Print progress from print status
+  struct PrintProgress {
+    uint16_t page = 0;
+    uint8_t print = 0;
+    uint8_t feed = 0;
+  };
+
+  // Max transactions waiting for a reply at once
+  static constexpr size_t kMaxTransactions = 4;
+  // Longest reply payload kept for a transaction
+  static constexpr size_t kMaxResponseLen = 32;
+
+  // Handle of a sent command waiting for its reply
+  struct Transaction {
+    uint8_t slot = UINT8_MAX;
+    uint32_t seq = 0;
+  };
+
+  // Reply to a transaction
+  struct Response {
+    uint8_t type = 0;
+    uint8_t len = 0;
+    uint8_t data[kMaxResponseLen] = {};
+
+    // Command acks carry a success flag in the first byte
+    bool Succeeded() const { return len > 0 && data[0] != 0; }
+  };
+
+  // Reply counters, routine acks are counted rather than logged
+  struct ResponseStats {
+    uint32_t acks = 0;
+    uint32_t failed_acks = 0;
+    uint32_t errors = 0;
+    uint32_t unknown = 0;
+  };
+
+  // Max subscribers per event
+  static constexpr size_t kMaxSubscribers = 4;
+
+  // Callback type for writing data over BLE, fails when nothing was sent
+  using SendPacketCallback = std::function<esp_err_t(const uint8_t* data, size_t len, bool wait_for_response)>;
   // Callback when printer becomes ready
   using ReadyCallback = std::function<void()>;
+  // Event callbacks, called from the BLE receive context
+  using StatusCallback = std::function<void(const Status& status)>;
+  using ProgressCallback = std::function<void(const PrintProgress& progress)>;
+  using ErrorCallback = std::function<void(uint8_t error)>;
 
   NiimbotPrinter();
   ~NiimbotPrinter();
@@ -75,6 +140,15 @@ public:
   void SetSendCallback(SendPacketCallback callback);
   // Set callback for when printer is ready
   void SetReadyCallback(ReadyCallback callback);
+  // Set the largest BLE write (negotiated MTU - 3) packets are packed into
+  void SetMaxWriteSize(size_t size);
+
+  // Subscribe to heartbeat status, print progress and printer errors.
+  // Fails with ESP_ERR_NO_MEM when kMaxSubscribers are subscribed.
+  // Subscribe before connecting, dispatch isn't locked against it.
+  esp_err_t SubscribeStatus(StatusCallback callback);
+  esp_err_t SubscribeProgress(ProgressCallback callback);
+  esp_err_t SubscribeError(ErrorCallback callback);
 
   // Process received data from BLE
   void ProcessReceivedData(const uint8_t* data, size_t len);
@@ -82,58 +156,221 @@ public:
   // Signal that a write operation completed
   void OnWriteComplete();
 
+  // Signal transport congestion, writes without response wait it out
+  void OnCongestion(bool congested);
+
   // Check if printer is ready
   bool IsReady() const { return ready_; }
 
   // Get printer status
   const Status& GetStatus() const { return status_; }
 
-  // Commands
-  esp_err_t SendHeartbeat();
-  esp_err_t GetDeviceInfo(InfoKey key);
-  esp_err_t SetLabelDensity(uint8_t density);
-  esp_err_t SetLabelType(uint8_t type);
-  esp_err_t StartPrint(uint16_t total_pages = 1, uint8_t page_color = 0);
-  esp_err_t StartPagePrint();
-  esp_err_t SetPageSize(uint16_t rows, uint16_t cols, uint16_t copies = 1);
-  esp_err_t SendBitmapRow(uint16_t row_num, const uint8_t* row_data, size_t row_len);
+  // Get last reported print progress
+  const PrintProgress& GetPrintProgress() const { return progress_; }
+
+  const ResponseStats& GetResponseStats() const { return response_stats_; }
+
+  // Commands. When tx is given, a transaction matched to the command's
+  // reply is opened before sending and must be completed with Wait()
+  esp_err_t SendHeartbeat(Transaction* tx = nullptr);
+  esp_err_t GetDeviceInfo(InfoKey key, Transaction* tx = nullptr);
+  esp_err_t SetLabelDensity(uint8_t density, Transaction* tx = nullptr);
+  esp_err_t SetLabelType(uint8_t type, Transaction* tx = nullptr);
+  esp_err_t StartPrint(uint16_t total_pages = 1, uint8_t page_color = 0, Transaction* tx = nullptr);
+  esp_err_t StartPagePrint(Transaction* tx = nullptr);
+  esp_err_t SetPageSize(uint16_t rows, uint16_t cols, uint16_t copies = 1, Transaction* tx = nullptr);
+  esp_err_t SendBitmapRow(uint16_t row_num, const uint8_t* row_data, size_t row_len, uint8_t repeat = 1);
+  esp_err_t SendIndexedRow(uint16_t row_num, const Signs::RleRun* runs, size_t num_runs, uint8_t repeat = 1);
   esp_err_t SendEmptyRow(uint16_t row_num, uint8_t count);
-  esp_err_t EndPagePrint();
-  esp_err_t EndPrint();
-  esp_err_t GetPrintStatus();
+  esp_err_t EndPagePrint(Transaction* tx = nullptr);
+  esp_err_t EndPrint(Transaction* tx = nullptr);
+  esp_err_t GetPrintStatus(Transaction* tx = nullptr);
 
-  // Print an RLE-encoded image
-  esp_err_t Print(const Signs::RleImage& image);
+  // Wait for the reply of a transaction. Fails with ESP_ERR_TIMEOUT
+  // when none arrives and ESP_ERR_INVALID_RESPONSE on a printer error.
+  // Transactions may overlap, each reply goes to the oldest transaction
+  // expecting that response type.
+  esp_err_t Wait(const Transaction& tx, TickType_t timeout, Response* response = nullptr);
+  // Drop a transaction without waiting for its reply
+  void Cancel(const Transaction& tx);
 
-  // Reset state (e.g., on disconnect)
+  // One page of a print session, printed `copies` times
+  struct Page {
+    const Signs::RleImage* image = nullptr;
+    uint16_t copies = 1;
+  };
+
+  // Print an RLE-encoded image `copies` times. Setting `cancel` aborts
+  // the job between steps or rows, closing the print session, and fails
+  // it with ESP_ERR_NOT_FINISHED.
+  esp_err_t Print(const Signs::RleImage& image, uint16_t copies = 1, const std::atomic<bool>* cancel = nullptr);
+  // Print several pages in one print session, setup and teardown are
+  // paid once for all labels
+  esp_err_t PrintPages(const Page* pages, size_t num_pages, const std::atomic<bool>* cancel = nullptr);
+
+  // Prefetch cache counters
+  struct PrefetchStats {
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    // Row encoding done ahead of time for the last hit
+    uint32_t saved_us = 0;
+    // Start of the rows to the first row packet queued, last page
+    uint32_t first_row_us = 0;
+  };
+
+  // Encode the row packets of an image ahead of time, so printing it
+  // next only streams out ready bytes. Keeps one image, matched by
+  // address, so it must not change until printed. Images generated with
+  // their row packets need none.
+  esp_err_t Prefetch(const Signs::RleImage& image);
+
+  const PrefetchStats& GetPrefetchStats() const { return prefetch_stats_; }
+
+  // Reset state on disconnect: pending transactions fail, buffered
+  // packets are dropped and the credits of writes in flight come back
   void Reset();
 
   // Packet building utilities
   static size_t BuildPacket(uint8_t* buf, size_t buf_size, uint8_t type,
                            const uint8_t* data, size_t data_len);
-  static bool ParsePacket(const uint8_t* buf, size_t len, uint8_t* type,
-                         uint8_t* data, size_t* data_len);
+  // Parse a complete packet in place, the view points into buf
+  static bool ParsePacket(const uint8_t* buf, size_t len, PacketView* packet);
 
 private:
   // Non-copyable
   NiimbotPrinter(const NiimbotPrinter&) = delete;
   NiimbotPrinter& operator=(const NiimbotPrinter&) = delete;
 
+  enum class RowEncoding : uint8_t;
+  struct EncodedRow;
+
+  // Print job steps, each one waits for the printer's answer
+  enum class PrintStep : uint8_t {
+    Configure,
+    StartPrint,
+    StartPage,
+    SetPageSize,
+    SendRows,
+    EndPage,
+    WaitPrinted,
+    EndPrint,
+    Done,
+  };
+
   // Timeout for write operations
   static constexpr TickType_t kWriteTimeout = pdMS_TO_TICKS(1000);
 
-  esp_err_t SendPacket(RequestCode code, const uint8_t* data, size_t data_len, bool wait_for_response = true);
-  void HandleResponse(uint8_t type, const uint8_t* data, size_t data_len);
+  // Write aggregated packets to the transport. Writes without response
+  // wait up to timeout, capped at kWriteTimeout, for congestion to clear
+  // and for a stream credit.
+  esp_err_t Write(const uint8_t* data, size_t len, bool wait_for_response, TickType_t timeout);
+  // Queue a built packet for the transport
+  esp_err_t QueuePacket(const uint8_t* pkt, size_t pkt_len, bool wait_for_response);
+  // Queue an image row packet, copied in or built in place. Rows are
+  // streamed without response when enabled.
+  esp_err_t StreamRowPacket(const uint8_t* pkt, size_t pkt_len);
+  esp_err_t StreamRowPacket(size_t max_len, const TxAggregator::BuildCallback& build);
+  // Flush with response every kStreamCheckpoint rows
+  esp_err_t PaceRowStream();
+  // Wait until no write without response is in flight
+  esp_err_t DrainStream();
+  // Give back the credit of a write without response, false when none
+  // was in flight
+  bool ReturnStreamCredit();
+  // Dispatch a reply to its handler through kResponseHandlers
+  void HandleResponse(const PacketView& packet);
+  void HandleError(const PacketView& packet);
+  void HandleHeartbeat(const PacketView& packet);
+  void HandleInfo(const PacketView& packet);
+  void HandlePrintStatus(const PacketView& packet);
+  void HandleAck(const PacketView& packet);
+  void HandleUnknown(const PacketView& packet);
+  // Send a built command packet, opening a transaction for its reply
+  // when tx is given
+  esp_err_t SendCommand(const uint8_t* pkt, size_t pkt_len, Transaction* tx);
+  template <size_t N>
+  esp_err_t SendCommand(const std::array<uint8_t, N>& pkt, Transaction* tx)
+  {
+    return SendCommand(pkt.data(), N, tx);
+  }
+  // Hand a reply to the transaction waiting for it
+  void CompleteTransaction(const PacketView& packet);
+  // Wait for a command ack, fails when the printer rejected the command
+  esp_err_t WaitAck(esp_err_t send_err, const Transaction& tx);
+  // Poll print status until total_pages are printed and fed
+  esp_err_t WaitPrinted(uint16_t total_pages);
+  esp_err_t SendImageRows(const Signs::RleImage& image, uint16_t print_height,
+                          const std::atomic<bool>* cancel);
+  // Stream ready row packets back to back
+  esp_err_t StreamPackets(const uint8_t* buf, size_t len, const std::atomic<bool>* cancel, size_t* packets);
+  // Encode image rows into packets, runs of identical rows share one.
+  // The sink provides the buffer each packet is built into.
+  using RowPacketSink = std::function<esp_err_t(size_t max_len, const TxAggregator::BuildCallback& build)>;
+  esp_err_t EncodeRows(const Signs::RleImage& image, uint16_t print_height,
+                       const std::atomic<bool>* cancel, const RowPacketSink& sink, size_t* packets);
+  // Same packets from the image's print plan, without classifying or
+  // comparing rows
+  esp_err_t EncodePlannedRows(const Signs::RleImage& image, uint16_t print_height,
+                              const std::atomic<bool>* cancel, const RowPacketSink& sink, size_t* packets);
+
+  // Reply handlers indexed by response type, built at compile time
+  using ResponseHandler = void (NiimbotPrinter::*)(const PacketView& packet);
+  using ResponseHandlers = std::array<ResponseHandler, 256>;
+  static constexpr ResponseHandlers MakeResponseHandlers();
+  static const ResponseHandlers kResponseHandlers;
+
+  template <typename Callback>
+  struct Subscribers {
+    Callback callbacks[kMaxSubscribers];
+    size_t count = 0;
+  };
 
   SendPacketCallback send_callback_;
+  TxAggregator tx_;
   ReadyCallback ready_callback_;
+  Subscribers<StatusCallback> status_subscribers_;
+  Subscribers<ProgressCallback> progress_subscribers_;
+  Subscribers<ErrorCallback> error_subscribers_;
+  ResponseStats response_stats_;
   SemaphoreHandle_t write_semaphore_;
 
-  // Packet receive buffer
-  uint8_t packet_buf_[512];
-  size_t packet_buf_len_ = 0;
+  // Credits for writes without response in flight
+  SemaphoreHandle_t stream_credits_;
+  // kStreamOpen is cleared while the transport is congested
+  EventGroupHandle_t stream_events_;
+  std::atomic<uint32_t> stream_in_flight_{0};
+  uint8_t stream_rows_ = 0;
+
+  // Splits received data into frames
+  FrameReader rx_;
+
+  // Transactions waiting for a reply
+  struct PendingTransaction {
+    uint8_t expected = 0;  // Response type, 0 = free slot
+    bool done = false;
+    uint32_t seq = 0;
+    esp_err_t result = ESP_OK;
+    Response response;
+    SemaphoreHandle_t done_semaphore = nullptr;
+  };
+  PendingTransaction transactions_[kMaxTransactions];
+  SemaphoreHandle_t transactions_mutex_;
+  uint32_t transaction_seq_ = 0;
+
+  // Row packets of one image built ahead of time
+  struct PrefetchCache {
+    uint8_t* buf = nullptr;
+    size_t len = 0;
+    const Signs::RleImage* image = nullptr;
+    uint16_t rows = 0;
+    size_t packets = 0;
+    uint32_t encode_us = 0;
+  };
+  PrefetchCache prefetch_;
+  PrefetchStats prefetch_stats_;
 
   Status status_;
+  PrintProgress progress_;
   bool ready_ = false;
 };
 
@@ -0,0 +1,324 @@
+#include "spooler.h"
+
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_timer.h>
+
+using namespace PRNM;
+
+namespace {
+  static constexpr const char* kLogTag = "prnm::spooler";
+
+  static constexpr size_t kSpoolerStackSize = 4096;
+  static constexpr UBaseType_t kSpoolerTaskPriority = 5;
+
+  // Ping the printer after this long without a job
+  static constexpr TickType_t kPingInterval = pdMS_TO_TICKS(CONFIG_PRNM_PRINTER_PING_MS);
+
+  // Wait up to this long after the first job for more to join its print
+  // session, 0 only takes jobs already queued
+  static constexpr TickType_t kBatchWindow = pdMS_TO_TICKS(CONFIG_PRNM_PRINT_BATCH_MS);
+}
+
+PrintSpooler::PrintSpooler(NiimbotPrinter& printer)
+  : printer_(printer)
+{
+  // Every job slot plus one heartbeat request
+  queue_ = xQueueCreate(kMaxJobs + 1, sizeof(uint8_t));
+  mutex_ = xSemaphoreCreateMutex();
+}
+
+PrintSpooler::~PrintSpooler()
+{
+  if (task_handle_) {
+    vTaskDelete(task_handle_);
+  }
+  if (queue_) {
+    vQueueDelete(queue_);
+  }
+  if (mutex_) {
+    vSemaphoreDelete(mutex_);
+  }
+}
+
+void PrintSpooler::SetJobCallback(JobCallback callback)
+{
+  job_callback_ = std::move(callback);
+}
+
+esp_err_t PrintSpooler::Start()
+{
+  if (!queue_ || !mutex_) {
+    ESP_LOGE(kLogTag, "failed to allocate job queue");
+    return ESP_ERR_NO_MEM;
+  }
+  if (task_handle_) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  BaseType_t ret = xTaskCreate(SpoolerTask, "spooler", kSpoolerStackSize, this,
+                               kSpoolerTaskPriority, &task_handle_);
+  if (ret != pdPASS) {
+    ESP_LOGE(kLogTag, "failed to create spooler task");
+    task_handle_ = nullptr;
+    return ESP_ERR_NO_MEM;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t PrintSpooler::Submit(const Signs::RleImage* image, uint16_t copies, JobId* id)
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+
+  size_t slot = 0;
+  while (slot < kMaxJobs && IsActive(jobs_[slot].state)) {
+    slot++;
+  }
+  if (slot == kMaxJobs) {
+    xSemaphoreGive(mutex_);
+    ESP_LOGW(kLogTag, "job queue full");
+    return ESP_ERR_NO_MEM;
+  }
+
+  Job& job = jobs_[slot];
+  job.id = next_id_++;
+  job.state = JobState::Queued;
+  job.result = ESP_OK;
+  job.image = image;
+  job.copies = copies;
+  job.cancel = false;
+
+  // A free slot means the queue has room too
+  uint8_t slot_index = static_cast<uint8_t>(slot);
+  xQueueSend(queue_, &slot_index, 0);
+
+  JobInfo info = {job.id, job.state, job.result};
+  xSemaphoreGive(mutex_);
+
+  ESP_LOGI(kLogTag, "job %lu queued", static_cast<unsigned long>(info.id));
+  if (id) {
+    *id = info.id;
+  }
+  if (job_callback_) {
+    job_callback_(info);
+  }
+  return ESP_OK;
+}
+
+esp_err_t PrintSpooler::Cancel(JobId id)
+{
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  for (Job& job : jobs_) {
+    if (job.id == id && IsActive(job.state)) {
+      // Queued jobs are dropped when dequeued, a printing session stops
+      // at the next step or row
+      job.cancel = true;
+      if (job.state == JobState::Sending) {
+        session_cancel_ = true;
+      }
+      err = ESP_OK;
+      break;
+    }
+  }
+  xSemaphoreGive(mutex_);
+
+  if (err == ESP_OK) {
+    ESP_LOGI(kLogTag, "job %lu cancelling", static_cast<unsigned long>(id));
+  }
+  return err;
+}
+
+void PrintSpooler::CancelAll()
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  for (Job& job : jobs_) {
+    if (IsActive(job.state)) {
+      job.cancel = true;
+      if (job.state == JobState::Sending) {
+        session_cancel_ = true;
+      }
+    }
+  }
+  xSemaphoreGive(mutex_);
+}
+
+size_t PrintSpooler::Pending() const
+{
+  size_t pending = 0;
+
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  for (const Job& job : jobs_) {
+    if (IsActive(job.state)) {
+      pending++;
+    }
+  }
+  xSemaphoreGive(mutex_);
+
+  return pending;
+}
+
+esp_err_t PrintSpooler::RequestHeartbeat()
+{
+  if (heartbeat_requested_.exchange(true)) {
+    return ESP_OK;  // Already queued
+  }
+
+  uint8_t slot_index = kHeartbeatSlot;
+  if (xQueueSend(queue_, &slot_index, 0) != pdTRUE) {
+    heartbeat_requested_ = false;
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+void PrintSpooler::SpoolerTask(void* param)
+{
+  static_cast<PrintSpooler*>(param)->Run();
+}
+
+void PrintSpooler::Run()
+{
+  while (true) {
+#if CONFIG_PRNM_PRINT_PREFETCH
+    // Get the next sign ready while idle
+    if (!next_sign_) {
+      next_sign_ = Signs::Next();
+      esp_err_t err = next_sign_ ? printer_.Prefetch(*next_sign_) : ESP_ERR_NOT_FOUND;
+      if (err != ESP_OK) {
+        ESP_LOGW(kLogTag, "failed to prefetch next sign: %s", esp_err_to_name(err));
+      }
+    }
+#endif
+
+    uint8_t slots[kMaxJobs];
+    if (xQueueReceive(queue_, &slots[0], kPingInterval) != pdTRUE) {
+      Ping();
+      continue;
+    }
+    if (slots[0] == kHeartbeatSlot) {
+      SendHeartbeat();
+      continue;
+    }
+
+    // Touches in quick succession share one print session, the window
+    // runs from the first job so later ones don't extend it
+    TickType_t batch_start = xTaskGetTickCount();
+    size_t num_slots = 1;
+    while (num_slots < kMaxJobs) {
+      TickType_t elapsed = xTaskGetTickCount() - batch_start;
+      TickType_t wait = elapsed < kBatchWindow ? kBatchWindow - elapsed : 0;
+      if (xQueueReceive(queue_, &slots[num_slots], wait) != pdTRUE) {
+        break;
+      }
+      if (slots[num_slots] == kHeartbeatSlot) {
+        SendHeartbeat();
+        continue;
+      }
+      num_slots++;
+    }
+
+    RunBatch(slots, num_slots);
+  }
+}
+
+void PrintSpooler::RunBatch(const uint8_t* slots, size_t num_slots)
+{
+  NiimbotPrinter::Page pages[kMaxJobs];
+  size_t num_pages = 0;
+
+  // Drop cancelled jobs, the rest start sending together
+  for (size_t i = 0; i < num_slots; i++) {
+    Job& job = jobs_[slots[i]];
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    bool cancelled = job.cancel;
+    if (!cancelled) {
+      job.state = JobState::Sending;
+    }
+    xSemaphoreGive(mutex_);
+
+    if (cancelled) {
+      SetState(job, JobState::Cancelled, ESP_ERR_NOT_FINISHED);
+      continue;
+    }
+    SetState(job, JobState::Sending);
+
+    pages[num_pages].image = job.image ? job.image : TakeNextSign();
+    pages[num_pages].copies = job.copies;
+    num_pages++;
+  }
+  if (num_pages == 0) {
+    return;
+  }
+
+  int64_t start = esp_timer_get_time();
+  esp_err_t err = printer_.PrintPages(pages, num_pages, &session_cancel_);
+
+  JobState state = JobState::Done;
+  if (err == ESP_OK) {
+    const NiimbotPrinter::PrefetchStats& stats = printer_.GetPrefetchStats();
+    ESP_LOGI(kLogTag, "%zu job(s) done in %d ms (prefetch %lu hits, %lu misses)", num_pages,
+             static_cast<int>((esp_timer_get_time() - start) / 1000),
+             static_cast<unsigned long>(stats.hits), static_cast<unsigned long>(stats.misses));
+  } else if (session_cancel_) {
+    state = JobState::Cancelled;
+  } else {
+    ESP_LOGE(kLogTag, "%zu job(s) failed: %s", num_pages, esp_err_to_name(err));
+    state = JobState::Failed;
+  }
+
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  session_cancel_ = false;
+  xSemaphoreGive(mutex_);
+
+  for (size_t i = 0; i < num_slots; i++) {
+    Job& job = jobs_[slots[i]];
+    if (job.state == JobState::Sending) {
+      SetState(job, state, err);
+    }
+  }
+}
+
+const Signs::RleImage* PrintSpooler::TakeNextSign()
+{
+  const Signs::RleImage* sign = next_sign_ ? next_sign_ : Signs::Next();
+  next_sign_ = nullptr;
+  return sign;
+}
+
+void PrintSpooler::Ping()
+{
+  if (!printer_.IsReady()) {
+    return;
+  }
+
+  esp_err_t err = printer_.GetPrintStatus();
+  if (err != ESP_OK) {
+    ESP_LOGE(kLogTag, "failed to ping printer: %s", esp_err_to_name(err));
+  }
+}
+
+void PrintSpooler::SendHeartbeat()
+{
+  // Cleared first, a request made while sending gets its own heartbeat
+  heartbeat_requested_ = false;
+  esp_err_t err = printer_.SendHeartbeat();
+  if (err != ESP_OK) {
+    ESP_LOGE(kLogTag, "failed to send heartbeat: %s", esp_err_to_name(err));
+  }
+}
+
+void PrintSpooler::SetState(Job& job, JobState state, esp_err_t result)
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  job.state = state;
+  job.result = result;
+  JobInfo info = {job.id, job.state, job.result};
+  xSemaphoreGive(mutex_);
+
+  if (job_callback_) {
+    job_callback_(info);
+  }
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <functional>
+
+#include <sdkconfig.h>
+#include <esp_err.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "printer.h"
+#include "signs.h"
+
+namespace PRNM {
+
+// Print job queue served by a task that owns the printer
+class PrintSpooler {
+public:
+  // Max jobs queued or printing at once
+  static constexpr size_t kMaxJobs = CONFIG_PRNM_PRINT_QUEUE_LEN;
+
+  using JobId = uint32_t;
+
+  enum class JobState : uint8_t {
+    Queued,
+    Sending,
+    Done,
+    Failed,
+    Cancelled,
+  };
+
+  // Job snapshot passed to the state callback
+  struct JobInfo {
+    JobId id = 0;
+    JobState state = JobState::Queued;
+    esp_err_t result = ESP_OK;
+  };
+
+  // Called on every job state change, from the submitting task for
+  // Queued and from the spooler task for everything else
+  using JobCallback = std::function<void(const JobInfo& job)>;
+
+  explicit PrintSpooler(NiimbotPrinter& printer);
+  ~PrintSpooler();
+
+  void SetJobCallback(JobCallback callback);
+
+  // Start the spooler task
+  esp_err_t Start();
+
+  // Queue a print job, a null image prints the next sign when the job
+  // starts. Fails with ESP_ERR_NO_MEM when the queue is full.
+  esp_err_t Submit(const Signs::RleImage* image, uint16_t copies = 1, JobId* id = nullptr);
+
+  // Cancel a queued or printing job. Jobs queued during a print or
+  // within PRNM_PRINT_BATCH_MS of the first share a print session,
+  // cancelling a printing job cancels the whole session.
+  esp_err_t Cancel(JobId id);
+  void CancelAll();
+
+  // Jobs queued or printing
+  size_t Pending() const;
+
+  // Send a heartbeat from the spooler task, for callers that mustn't
+  // wait on the printer such as BLE callbacks. Requests made before
+  // one is sent are sent once.
+  esp_err_t RequestHeartbeat();
+
+private:
+  // Non-copyable
+  PrintSpooler(const PrintSpooler&) = delete;
+  PrintSpooler& operator=(const PrintSpooler&) = delete;
+
+  struct Job {
+    JobId id = 0;
+    JobState state = JobState::Done;
+    esp_err_t result = ESP_OK;
+    const Signs::RleImage* image = nullptr;
+    uint16_t copies = 1;
+    std::atomic<bool> cancel{false};
+  };
+
+  // Queued in place of a job slot to request a heartbeat
+  static constexpr uint8_t kHeartbeatSlot = UINT8_MAX;
+  static_assert(kMaxJobs < kHeartbeatSlot, "job slots must fit below kHeartbeatSlot");
+
+  static bool IsActive(JobState state) { return state == JobState::Queued || state == JobState::Sending; }
+
+  static void SpoolerTask(void* param);
+  void Run();
+  // Print queued jobs as pages of one print session
+  void RunBatch(const uint8_t* slots, size_t num_slots);
+  // Next sign for jobs without an image, prefetched one first
+  const Signs::RleImage* TakeNextSign();
+  // Ping the printer while idle so it doesn't power off
+  void Ping();
+  // Send a requested heartbeat
+  void SendHeartbeat();
+  // Update job state and notify the callback
+  void SetState(Job& job, JobState state, esp_err_t result = ESP_OK);
+
+  NiimbotPrinter& printer_;
+  JobCallback job_callback_;
+
+  Job jobs_[kMaxJobs];
+  JobId next_id_ = 1;
+  // Slots of queued jobs, in order, and kHeartbeatSlot when requested
+  QueueHandle_t queue_ = nullptr;
+  std::atomic<bool> heartbeat_requested_{false};
+  // Cancels the print session in progress
+  std::atomic<bool> session_cancel_{false};
+  SemaphoreHandle_t mutex_ = nullptr;
+  TaskHandle_t task_handle_ = nullptr;
+  // Sign prefetched into the printer while idle
+  const Signs::RleImage* next_sign_ = nullptr;
+};
+
+}
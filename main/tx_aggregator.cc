@@ -0,0 +1,192 @@
+#include "tx_aggregator.h"
+
+#include <cstring>
+
+#include <esp_log.h>
+
+#include "packet_writer.h"
+
+using namespace PRNM;
+
+namespace {
+  static constexpr const char* kLogTag = "prnm::tx";
+
+  // Flush a partially filled write if nothing else was queued meanwhile
+  static constexpr uint64_t kFlushDelayUs = 5000;
+}
+
+TxAggregator::TxAggregator()
+{
+  mutex_ = xSemaphoreCreateMutex();
+
+  esp_timer_create_args_t timer_args = {};
+  timer_args.callback = FlushTimerCallback;
+  timer_args.arg = this;
+  timer_args.dispatch_method = ESP_TIMER_TASK;
+  timer_args.name = "tx_flush";
+  if (esp_timer_create(&timer_args, &flush_timer_) != ESP_OK) {
+    ESP_LOGE(kLogTag, "Failed to create flush timer");
+    flush_timer_ = nullptr;
+  }
+}
+
+TxAggregator::~TxAggregator()
+{
+  if (flush_timer_) {
+    esp_timer_stop(flush_timer_);
+    esp_timer_delete(flush_timer_);
+  }
+  if (mutex_) {
+    vSemaphoreDelete(mutex_);
+  }
+}
+
+void TxAggregator::SetWriteCallback(WriteCallback callback)
+{
+  write_callback_ = std::move(callback);
+}
+
+void TxAggregator::SetMaxWriteSize(size_t size)
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  max_write_size_ = size < kMaxWriteSize ? size : kMaxWriteSize;
+  ESP_LOGI(kLogTag, "Max write size: %zu", max_write_size_);
+  xSemaphoreGive(mutex_);
+}
+
+esp_err_t TxAggregator::Append(const uint8_t* data, size_t len)
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+
+  esp_err_t err = TakeTimerError();
+  if (err == ESP_OK && buf_len_ + len > max_write_size_) {
+    err = FlushLocked(false);
+  }
+
+  if (err == ESP_OK) {
+    if (len > max_write_size_) {
+      // Oversized packets go out on their own. A write without response
+      // must fit one ATT packet, the stack truncates longer ones, so
+      // they take a long write with response.
+      err = write_callback_(data, len, true, portMAX_DELAY);
+    } else {
+      memcpy(buf_ + buf_len_, data, len);
+      buf_len_ += len;
+      if (flush_timer_) {
+        esp_timer_stop(flush_timer_);
+        esp_timer_start_once(flush_timer_, kFlushDelayUs);
+      }
+    }
+  }
+
+  xSemaphoreGive(mutex_);
+  return err;
+}
+
+esp_err_t TxAggregator::Emplace(size_t max_len, const BuildCallback& build)
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+
+  esp_err_t err = TakeTimerError();
+  if (err == ESP_OK && buf_len_ + max_len > max_write_size_) {
+    err = FlushLocked(false);
+  }
+
+  if (err == ESP_OK) {
+    if (max_len > max_write_size_) {
+      // Oversized packets go out on their own, as a long write
+      uint8_t pkt[PacketWriter::kMaxPacketLen];
+      size_t len = build(pkt, sizeof(pkt));
+      err = len > 0 ? write_callback_(pkt, len, true, portMAX_DELAY) : ESP_ERR_INVALID_SIZE;
+    } else {
+      size_t len = build(buf_ + buf_len_, max_write_size_ - buf_len_);
+      if (len > 0) {
+        buf_len_ += len;
+        if (flush_timer_) {
+          esp_timer_stop(flush_timer_);
+          esp_timer_start_once(flush_timer_, kFlushDelayUs);
+        }
+      } else {
+        err = ESP_ERR_INVALID_SIZE;
+      }
+    }
+  }
+
+  xSemaphoreGive(mutex_);
+  return err;
+}
+
+esp_err_t TxAggregator::Flush(bool wait_for_response)
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  esp_err_t err = TakeTimerError();
+  if (err == ESP_OK) {
+    err = FlushLocked(wait_for_response);
+  }
+  xSemaphoreGive(mutex_);
+  return err;
+}
+
+void TxAggregator::Reset()
+{
+  xSemaphoreTake(mutex_, portMAX_DELAY);
+  if (flush_timer_) {
+    esp_timer_stop(flush_timer_);
+  }
+  buf_len_ = 0;
+  max_write_size_ = kDefaultWriteSize;
+  timer_err_ = ESP_OK;
+  xSemaphoreGive(mutex_);
+}
+
+esp_err_t TxAggregator::TakeTimerError()
+{
+  esp_err_t err = timer_err_;
+  timer_err_ = ESP_OK;
+  return err;
+}
+
+esp_err_t TxAggregator::FlushLocked(bool wait_for_response, TickType_t timeout)
+{
+  if (flush_timer_) {
+    esp_timer_stop(flush_timer_);
+  }
+
+  if (buf_len_ == 0) {
+    return ESP_OK;
+  }
+
+  if (!write_callback_) {
+    ESP_LOGE(kLogTag, "Write callback not set");
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  ESP_LOGD(kLogTag, "Flushing %zu bytes", buf_len_);
+  esp_err_t err = write_callback_(buf_, buf_len_, wait_for_response, timeout);
+  if (err != ESP_ERR_TIMEOUT || timeout != 0) {
+    buf_len_ = 0;
+  }
+  return err;
+}
+
+void TxAggregator::FlushTimerCallback(void* arg)
+{
+  auto* self = static_cast<TxAggregator*>(arg);
+
+  // The sender holds the lock while appending, it will re-arm the timer
+  if (xSemaphoreTake(self->mutex_, 0) != pdTRUE) {
+    return;
+  }
+
+  // Never wait for the stream window here, that would hold up every
+  // other esp_timer callback. Try again later while it's full.
+  esp_err_t err = self->FlushLocked(false, 0);
+  if (err == ESP_ERR_TIMEOUT) {
+    esp_timer_start_once(self->flush_timer_, kFlushDelayUs);
+  } else if (err != ESP_OK) {
+    // The packets are lost, fail whatever the sender queues next
+    ESP_LOGW(kLogTag, "Timed flush failed: %s", esp_err_to_name(err));
+    self->timer_err_ = err;
+  }
+  xSemaphoreGive(self->mutex_);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+#include <sdkconfig.h>
+#include <esp_err.h>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+namespace PRNM {
+
+// Packs consecutive packets into MTU-sized BLE writes
+class TxAggregator {
+public:
+  // Writes one aggregated buffer to the transport. A write without
+  // response waits up to timeout for the transport to take it and fails
+  // with ESP_ERR_TIMEOUT, having sent nothing, when it doesn't.
+  using WriteCallback =
+    std::function<esp_err_t(const uint8_t* data, size_t len, bool wait_for_response, TickType_t timeout)>;
+  // Builds a packet into buf, returns its length or 0 when it didn't fit
+  using BuildCallback = std::function<size_t(uint8_t* buf, size_t size)>;
+
+  // Largest write we can ever buffer (ATT payload of the configured MTU)
+  static constexpr size_t kMaxWriteSize = CONFIG_PRNM_BT_MTU - 3;
+  // ATT payload of the default 23 byte MTU, used until one is negotiated
+  static constexpr size_t kDefaultWriteSize = 20;
+
+  TxAggregator();
+  ~TxAggregator();
+
+  void SetWriteCallback(WriteCallback callback);
+
+  // Set write size limit from the negotiated MTU (MTU - 3)
+  void SetMaxWriteSize(size_t size);
+
+  // Queue a packet, flushing first when it doesn't fit. Anything left
+  // buffered is flushed by a timer if no other packet follows, a failed
+  // timed flush is returned by the next call. Packets larger than the
+  // write size are written alone, with response.
+  esp_err_t Append(const uint8_t* data, size_t len);
+  // Like Append, but the packet of up to max_len bytes is built straight
+  // into the write buffer instead of being copied in
+  esp_err_t Emplace(size_t max_len, const BuildCallback& build);
+
+  // Write everything buffered. With wait_for_response the write acts as
+  // a barrier: it is acknowledged once every packet before it landed.
+  esp_err_t Flush(bool wait_for_response);
+
+  // Drop buffered data (e.g., on disconnect)
+  void Reset();
+
+private:
+  // Non-copyable
+  TxAggregator(const TxAggregator&) = delete;
+  TxAggregator& operator=(const TxAggregator&) = delete;
+
+  static void FlushTimerCallback(void* arg);
+  // A write that times out with a zero timeout keeps the buffer
+  esp_err_t FlushLocked(bool wait_for_response, TickType_t timeout = portMAX_DELAY);
+  // Report a failed timed flush once
+  esp_err_t TakeTimerError();
+
+  WriteCallback write_callback_;
+  SemaphoreHandle_t mutex_;
+  esp_timer_handle_t flush_timer_ = nullptr;
+
+  uint8_t buf_[kMaxWriteSize];
+  size_t buf_len_ = 0;
+  size_t max_write_size_ = kDefaultWriteSize;
+  // Error of the last timed flush, not yet reported
+  esp_err_t timer_err_ = ESP_OK;
+};
+
+}